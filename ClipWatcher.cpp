@@ -1,1058 +1,8983 @@
-//  ClipWatcher.cpp
-//
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <windows.h>
-#include <strsafe.h>
-#include <shlobj.h>
-#include <dbt.h>
-#include "Resource.h"
-
-#pragma comment(lib, "user32.lib")
-#pragma comment(lib, "shell32.lib")
-
-// Constants (you shouldn't change)
-const LPCWSTR CLIPWATCHER_NAME = L"ClipWatcher";
-const LPCWSTR CLIPWATCHER_WNDCLASS = L"ClipWatcherClass";
-const LPCWSTR CLIPWATCHER_ORIGIN = L"ClipWatcherOrigin";
-const LPCWSTR TASKBAR_CREATED = L"TaskbarCreated";
-const WORD BMP_SIGNATURE = 0x4d42; // 'BM' in little endian.
-static UINT CF_ORIGIN;
-static UINT WM_TASKBAR_CREATED;
-enum {
-    WM_NOTIFY_ICON = WM_USER+1,
-    WM_NOTIFY_FILE,
-};
-const LPCWSTR FILE_EXT_TEXT = L".txt";
-const LPCWSTR FILE_EXT_BITMAP = L".bmp";
-enum {
-    FILETYPE_TEXT = 0,
-    FILETYPE_BITMAP = 1,
-};
-
-// Constants (you may change)
-const int CLIPBOARD_RETRY = 3;
-const UINT CLIPBOARD_DELAY = 100;
-const UINT ICON_BLINK_INTERVAL = 400;
-const UINT ICON_BLINK_COUNT = 10;
-const UINT FILESYSTEM_INTERVAL = 1000;
-const LPCWSTR ERROR_TITLE = L"ClipWatcher Error";
-const LPCWSTR ERROR_NOTFOUND = L"Directory does not exist";
-
-// Resources (loaded at runtime)
-static HICON HICON_EMPTY;
-static HICON HICON_FILETYPE[2];
-static WCHAR DEFAULT_CLIPPATH[100] = L"Clipboard";
-static WCHAR MESSAGE_WATCHING[100] = L"Watching: %s";
-static WCHAR MESSAGE_UPDATED[100] = L"Clipboard Updated";
-static WCHAR MESSAGE_BITMAP[100] = L"Bitmap";
-
-// logging
-static FILE* logfp = NULL;
-
-static int getNumColors(BITMAPINFO* bmp)
-{
-    int ncolors = bmp->bmiHeader.biClrUsed;
-    if (ncolors == 0) {
-        switch (bmp->bmiHeader.biBitCount) {
-        case 1:
-            ncolors = 2;
-        case 8:
-            ncolors = 256;
-        }
-    }
-    return ncolors;
-}
-
-static size_t getBMPHeaderSize(BITMAPINFO* bmp)
-{
-    return (bmp->bmiHeader.biSize + getNumColors(bmp)*sizeof(RGBQUAD));
-}
-
-static size_t getBMPSize(BITMAPINFO* bmp)
-{
-    return (getBMPHeaderSize(bmp) + bmp->bmiHeader.biSizeImage);
-}
-
-static LPWSTR getWCHARfromCHAR(LPCSTR bytes, int nbytes, int* pnchars)
-{
-    int nchars = MultiByteToWideChar(CP_UTF8, 0, bytes, nbytes, NULL, 0);
-    LPWSTR chars = (LPWSTR) malloc(sizeof(WCHAR)*(nchars+1));
-    if (chars != NULL) {
-	MultiByteToWideChar(CP_UTF8, 0, bytes, nbytes, chars, nchars);
-	chars[nchars] = L'\0';
-	if (pnchars != NULL) {
-	    *pnchars = nchars;
-	}
-    }
-    return chars;
-}
-
-static LPSTR getCHARfromWCHAR(LPCWSTR chars, int nchars, int* pnbytes)
-{
-    int nbytes = WideCharToMultiByte(CP_UTF8, 0, chars, nchars, 
-				     NULL, 0, NULL, NULL);
-    LPSTR bytes = (LPSTR) malloc(sizeof(CHAR)*(nbytes+1));
-    if (bytes != NULL) {
-	WideCharToMultiByte(CP_UTF8, 0, chars, nchars, 
-			    (LPSTR)bytes, nbytes, NULL, NULL);
-	bytes[nbytes] = '\0';
-	if (pnbytes != NULL) {
-	    *pnbytes = nbytes;
-	}
-    }
-    return bytes;
-}
-
-// stripspace(text1, text2)
-static LPWSTR ristrip(LPCWSTR text1, LPCWSTR text2)
-{
-    int len1 = wcslen(text1);
-    int len2 = wcslen(text2);
-    int dstlen = len1;
-    if (len2 < len1 && wcsicmp(&text1[len1-len2], text2) == 0) {
-	dstlen -= len2;
-    }
-
-    LPWSTR dst = (LPWSTR) malloc(sizeof(WCHAR)*(dstlen+1));
-    if (dst != NULL) {
-	StringCchCopy(dst, dstlen+1, text1);
-    }
-    return dst;
-}
-
-// rmspace(text)
-static void rmspace(LPWSTR src)
-{
-    WCHAR* dst = src;
-    WCHAR c;
-    while ((c = *(src++)) != 0) {
-        if (L' ' < c) {
-            *(dst++) = c;
-        }
-    }
-    *dst = L'\0';
-}
-
-// rindex(filename)
-static int rindex(LPCWSTR text, WCHAR c)
-{
-    int i = wcslen(text)-1;
-    while (0 <= i) {
-        if (text[i] == c) return i;
-        i--;
-    }
-    return -1;
-}
-
-// istartswith(text1, text2)
-static int istartswith(LPCWSTR text1, LPCWSTR text2)
-{
-    while (*text1 != 0 && *text2 != 0 && *text1 == *text2) {
-	text1++;
-	text2++;
-    }
-    return (*text2 == 0);
-}
-
-// setClipboardOrigin(path)
-static void setClipboardOrigin(LPCWSTR path)
-{
-    int nbytes = sizeof(WCHAR)*(wcslen(path)+1);
-    HANDLE data = GlobalAlloc(GHND, nbytes);
-    if (data != NULL) {
-        BYTE* dst = (BYTE*) GlobalLock(data);
-        if (dst != NULL) {
-            CopyMemory(dst, path, nbytes);
-            GlobalUnlock(data);
-            SetClipboardData(CF_ORIGIN, data);
-            data = NULL;
-        }
-        if (data != NULL) {
-            GlobalFree(data);
-	}
-    }
-}
-
-// setClipboardText(text, nchars)
-static void setClipboardText(LPCWSTR text, int nchars)
-{
-    int nbytes = sizeof(WCHAR)*(nchars+1);
-    HANDLE data = GlobalAlloc(GHND, nbytes);
-    if (data != NULL) {
-        BYTE* dst = (BYTE*) GlobalLock(data);
-        if (dst != NULL) {
-            CopyMemory(dst, text, nbytes);
-            GlobalUnlock(data);
-            SetClipboardData(CF_UNICODETEXT, data);
-            data = NULL;
-        }
-        if (data != NULL) {
-            GlobalFree(data);
-        }
-    }
-}
-
-// setClipboardDIB(bmp)
-static void setClipboardDIB(BITMAPINFO* src)
-{
-    size_t nbytes = getBMPSize(src);
-    HANDLE data = GlobalAlloc(GHND, nbytes);
-    if (data != NULL) {
-        LPVOID dst = GlobalLock(data);
-        if (dst != NULL) {
-            CopyMemory(dst, src, nbytes);
-            GlobalUnlock(data);
-            SetClipboardData(CF_DIB, data);
-            data = NULL;
-        }
-        if (data != NULL) {
-            GlobalFree(data);
-        }
-    }
-}
-
-// getClipboardText(buf, buflen)
-static int getClipboardText(LPWSTR buf, int buflen)
-{
-    int filetype = -1;
-
-    // CF_UNICODETEXT
-    HANDLE data = GetClipboardData(CF_UNICODETEXT);
-    if (data != NULL) {
-        LPWSTR text = (LPWSTR) GlobalLock(data);
-        if (text != NULL) {
-            filetype = FILETYPE_TEXT;
-            StringCchCopy(buf, buflen, text);
-            GlobalUnlock(data);
-        }
-    }
-
-    // CF_DIB
-    data = GetClipboardData(CF_DIB);
-    if (data != NULL) {
-        LPVOID bytes = GlobalLock(data);
-        if (bytes != NULL) {
-            SIZE_T nbytes = GlobalSize(data);
-            filetype = FILETYPE_BITMAP;
-            StringCchCopy(buf, buflen, MESSAGE_BITMAP);
-            GlobalUnlock(bytes);
-        }
-    }
-    
-    return filetype;
-}
-
-// writeBytes(path, bytes, nbytes)
-static void writeBytes(LPCWSTR path, LPVOID bytes, int nbytes)
-{
-    HANDLE fp = CreateFile(path, GENERIC_WRITE, 0,
-			   NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 
-			   NULL);
-    if (fp != INVALID_HANDLE_VALUE) {
-        if (logfp != NULL) {
-            fwprintf(logfp, L"write: path=%s, nbytes=%u\n", path, nbytes);
-        }
-        DWORD writtenbytes;
-        WriteFile(fp, bytes, nbytes, &writtenbytes, NULL);
-	CloseHandle(fp);
-    }
-}
-
-// writeTextFile(path, text, nchars)
-static void writeTextFile(LPCWSTR path, LPCWSTR text, int nchars)
-{
-    int nbytes;
-    LPSTR bytes = getCHARfromWCHAR(text, nchars, &nbytes);
-    if (bytes != NULL) {
-        writeBytes(path, bytes, nbytes);
-        free(bytes);
-    }
-}
-
-// readTextFile(path, &nchars)
-static LPWSTR readTextFile(LPCWSTR path, int* nchars)
-{
-    const DWORD MAX_FILE_SIZE = 32767;
-
-    LPWSTR text = NULL;
-    HANDLE fp = CreateFile(path, GENERIC_READ, FILE_SHARE_READ,
-			   NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 
-			   NULL);
-    if (fp != INVALID_HANDLE_VALUE) {
-	DWORD nbytes = GetFileSize(fp, NULL);
-	if (MAX_FILE_SIZE < nbytes) {
-	    nbytes = MAX_FILE_SIZE;
-	}
-        if (logfp != NULL) {
-            fwprintf(logfp, L"read: path=%s, nbytes=%u\n", path, nbytes);
-        }
-	LPSTR bytes = (LPSTR) malloc(nbytes);
-	if (bytes != NULL) {
-	    DWORD readbytes;
-	    ReadFile(fp, bytes, nbytes, &readbytes, NULL);
-	    text = getWCHARfromCHAR(bytes, (int)readbytes, nchars);
-	    free(bytes);
-	}
-	CloseHandle(fp);
-    }
-
-    return text;
-}
-
-// writeBMPFile(path, bytes, nbytes)
-static void writeBMPFile(LPCWSTR path, LPVOID bytes, SIZE_T nbytes)
-{
-    BITMAPFILEHEADER filehdr = {0};
-    filehdr.bfType = BMP_SIGNATURE;
-    filehdr.bfSize = sizeof(filehdr)+nbytes;
-    filehdr.bfOffBits = sizeof(filehdr)+getBMPHeaderSize((BITMAPINFO*)bytes);
-    HANDLE fp = CreateFile(path, GENERIC_WRITE, 0,
-			   NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 
-			   NULL);
-    if (fp != INVALID_HANDLE_VALUE) {
-        if (logfp != NULL) {
-            fwprintf(logfp, L"write: path=%s, nbytes=%u\n", path, filehdr.bfSize);
-        }
-        DWORD writtenbytes;
-        WriteFile(fp, &filehdr, sizeof(filehdr), &writtenbytes, NULL);
-        WriteFile(fp, bytes, nbytes, &writtenbytes, NULL);
-	CloseHandle(fp);
-    }
-}
-
-// readBMPFile(path, &nchars)
-static BITMAPINFO* readBMPFile(LPCWSTR path)
-{
-    BITMAPINFO* bmp = NULL;
-    HANDLE fp = CreateFile(path, GENERIC_READ, FILE_SHARE_READ,
-			   NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 
-			   NULL);
-    if (fp != INVALID_HANDLE_VALUE) {
-        DWORD readbytes;
-        BITMAPFILEHEADER filehdr;
-        ReadFile(fp, &filehdr, sizeof(filehdr), &readbytes, NULL);
-        if (filehdr.bfType == BMP_SIGNATURE) {
-            DWORD bmpsize = filehdr.bfSize - sizeof(filehdr);
-            bmp = (BITMAPINFO*) malloc(bmpsize);
-            if (bmp != NULL) {
-                ReadFile(fp, bmp, bmpsize, &readbytes, NULL);
-            }
-	}
-	CloseHandle(fp);
-    }
-
-    return bmp;
-}
-
-// openClipFile()
-static BOOL openClipFile()
-{
-    const LPCWSTR OP_OPEN = L"open";
-
-    BOOL success = FALSE;
-
-    // Try opening CF_UNICODETEXT.
-    HANDLE data = GetClipboardData(CF_UNICODETEXT);
-    if (data != NULL) {
-        LPWSTR text = (LPWSTR) GlobalLock(data);
-        if (text != NULL) {
-            text = _wcsdup(text);
-            if (text != NULL) {
-                rmspace(text);
-                if (istartswith(text, L"http://") ||
-                    istartswith(text, L"https://")) {
-                    if (logfp != NULL) {
-                        fwprintf(logfp, L"open: url=%s\n", text);
-                    }
-                    ShellExecute(NULL, OP_OPEN, text, NULL, NULL, SW_SHOWDEFAULT);
-                    success = TRUE;
-                }
-                free(text);
-            }
-            GlobalUnlock(data);
-        }
-    }
-    if (success) return success;
-
-    // Try opening CF_ORIGIN.
-    data = GetClipboardData(CF_ORIGIN);
-    if (data != NULL) {
-        LPWSTR path = (LPWSTR) GlobalLock(data);
-        if (path != NULL) {
-            if (logfp != NULL) {
-                fwprintf(logfp, L"open: path=%s\n", path);
-            }
-            ShellExecute(NULL, OP_OPEN, path, NULL, NULL, SW_SHOWDEFAULT);
-            success = TRUE;
-            GlobalUnlock(data);
-        }
-    }
-    if (success) return success;
-
-    return FALSE;
-}
-
-// exportClipFile(basepath)
-static void exportClipFile(LPCWSTR basepath)
-{
-    // CF_UNICODETEXT
-    HANDLE data = GetClipboardData(CF_UNICODETEXT);
-    if (data != NULL) {
-        LPWSTR text = (LPWSTR) GlobalLock(data);
-        if (text != NULL) {
-            WCHAR path[MAX_PATH];
-            StringCchPrintf(path, _countof(path), L"%s.txt", basepath);
-            setClipboardOrigin(path);
-            writeTextFile(path, text, wcslen(text));
-            GlobalUnlock(data);
-        }
-    }
-
-    // CF_DIB
-    data = GetClipboardData(CF_DIB);
-    if (data != NULL) {
-        LPVOID bytes = GlobalLock(data);
-        if (bytes != NULL) {
-            SIZE_T nbytes = GlobalSize(data);
-            WCHAR path[MAX_PATH];
-            StringCchPrintf(path, _countof(path), L"%s.bmp", basepath);
-            setClipboardOrigin(path);
-            writeBMPFile(path, bytes, nbytes);
-            GlobalUnlock(bytes);
-        }
-    }
-}
-
-// getFileHash(fp)
-static DWORD getFileHash(HANDLE fp, DWORD n)
-{
-    DWORD hash = 0;
-    DWORD bufsize = sizeof(DWORD)*n;
-    DWORD* buf = (DWORD*) malloc(bufsize);
-    if (buf != NULL) {
-	DWORD readbytes;
-	ZeroMemory(buf, bufsize);
-	ReadFile(fp, buf, bufsize, &readbytes, NULL);
-	for (int i = 0; i < n; i++) {
-	    hash ^= buf[i];
-	}
-	free(buf);
-    }
-    return hash;
-}
-
-
-//  FileEntry
-// 
-typedef struct _FileEntry {
-    WCHAR path[MAX_PATH];
-    DWORD hash;
-    FILETIME mtime;
-    struct _FileEntry* next;
-} FileEntry;
-
-//  ClipWatcher
-// 
-typedef struct _ClipWatcher {
-    LPWSTR dstdir;
-    LPWSTR srcdir;
-    HANDLE notifier;
-    LPWSTR name;
-    FileEntry* files;
-    DWORD seqno;
-
-    UINT icon_id;
-    UINT_PTR blink_timer_id;
-    UINT_PTR check_timer_id;
-    HICON icon_blinking;
-    int icon_blink_count;
-    int show_balloon;
-} ClipWatcher;
-
-// findFileEntry(files, path)
-static FileEntry* findFileEntry(FileEntry* entry, LPCWSTR path)
-{
-    while (entry != NULL) {
-	if (wcsicmp(entry->path, path) == 0) return entry;
-	entry = entry->next;
-    }
-    return entry;
-}
-
-// freeFileEntries(files)
-static void freeFileEntries(FileEntry* entry)
-{
-    while (entry != NULL) {
-	void* p = entry;
-	entry = entry->next;
-	free(p);
-    }
-}
-
-// checkFileChanges(watcher)
-static FileEntry* checkFileChanges(ClipWatcher* watcher)
-{
-    WCHAR dirpath[MAX_PATH];
-    StringCchPrintf(dirpath, _countof(dirpath), L"%s\\*.*", watcher->srcdir);
-
-    WIN32_FIND_DATA data;
-    FileEntry* found = NULL;
-
-    HANDLE fft = FindFirstFile(dirpath, &data);
-    if (fft == NULL) goto fail;
-    
-    for (;;) {
-        LPWSTR name = data.cFileName;
-        int index = rindex(name, L'.');
-        if (0 <= index && wcsnicmp(name, watcher->name, index) != 0) {
-            WCHAR path[MAX_PATH];
-            StringCchPrintf(path, _countof(path), L"%s\\%s", 
-                            watcher->srcdir, name);
-            HANDLE fp = CreateFile(path, GENERIC_READ, FILE_SHARE_READ,
-                                   NULL, OPEN_EXISTING, 
-                                   (FILE_ATTRIBUTE_NORMAL | 
-                                    FILE_FLAG_NO_BUFFERING),
-                                   NULL);
-            if (fp != INVALID_HANDLE_VALUE) {
-                DWORD hash = getFileHash(fp, 256);
-                FILETIME mtime;
-                GetFileTime(fp, NULL, NULL, &mtime);
-                if (logfp != NULL) {
-                    fwprintf(logfp, L"check: name=%s (%08x, %08x)\n", 
-                             name, hash, mtime.dwLowDateTime);
-                }
-                FileEntry* entry = findFileEntry(watcher->files, path);
-                if (entry == NULL) {
-                    if (logfp != NULL) {
-                        fwprintf(logfp, L"added: name=%s\n", name);
-                    }
-                    entry = (FileEntry*) malloc(sizeof(FileEntry));
-                    StringCchCopy(entry->path, _countof(entry->path), path);
-                    entry->hash = hash;
-                    entry->mtime = mtime;
-                    entry->next = watcher->files;
-                    watcher->files = entry;
-                    found = entry;
-                } else if (hash != entry->hash ||
-                           CompareFileTime(&mtime, &(entry->mtime)) != 0) {
-                    if (logfp != NULL) {
-                        fwprintf(logfp, L"updated: name=%s\n", name);
-                    }
-                    entry->hash = hash;
-                    entry->mtime = mtime;
-                    found = entry;
-                }
-                CloseHandle(fp);
-            }
-        }
-	if (!FindNextFile(fft, &data)) break;
-    }
-    FindClose(fft);
-
-fail:
-    return found;
-}
-
-//  CreateClipWatcher
-// 
-ClipWatcher* CreateClipWatcher(
-    LPCWSTR dstdir, LPCWSTR srcdir, LPCWSTR name)
-{
-    ClipWatcher* watcher = (ClipWatcher*) malloc(sizeof(ClipWatcher));
-    if (watcher == NULL) return NULL;
-
-    watcher->dstdir = wcsdup(dstdir);
-    watcher->srcdir = wcsdup(srcdir);
-    watcher->notifier = INVALID_HANDLE_VALUE;
-    watcher->name = wcsdup(name);
-    watcher->files = NULL;
-    watcher->seqno = 0;
-
-    watcher->icon_id = 1;
-    watcher->blink_timer_id = 1;
-    watcher->check_timer_id = 2;
-    watcher->icon_blinking = NULL;
-    watcher->icon_blink_count = 0;
-    watcher->show_balloon = 0;
-    return watcher;
-}
-
-//  StartClipWatcher
-// 
-void StartClipWatcher(ClipWatcher* watcher)
-{
-    if (watcher->notifier == INVALID_HANDLE_VALUE) {
-        watcher->notifier = FindFirstChangeNotification(
-            watcher->srcdir, FALSE, 
-            (FILE_NOTIFY_CHANGE_FILE_NAME |
-             FILE_NOTIFY_CHANGE_SIZE |
-             FILE_NOTIFY_CHANGE_ATTRIBUTES |
-             FILE_NOTIFY_CHANGE_LAST_WRITE));
-        if (logfp != NULL) {
-            fwprintf(logfp, L"register: srcdir=%s, notifier=%p\n", 
-                     watcher->srcdir, watcher->notifier);
-        }
-    }
-}
-
-//  StopClipWatcher
-// 
-void StopClipWatcher(ClipWatcher* watcher)
-{
-    if (watcher->notifier != INVALID_HANDLE_VALUE) {
-        FindCloseChangeNotification(watcher->notifier);
-        watcher->notifier = INVALID_HANDLE_VALUE;
-    }
-}
-
-//  DestroyClipWatcher
-// 
-void DestroyClipWatcher(ClipWatcher* watcher)
-{
-    if (watcher->srcdir != NULL) {
-	free(watcher->srcdir);
-    }
-    if (watcher->dstdir != NULL) {
-	free(watcher->dstdir);
-    }
-    if (watcher->name != NULL) {
-	free(watcher->name);
-    }
-
-    freeFileEntries(watcher->files);
-
-    free(watcher);
-}
-
-
-//  clipWatcherWndProc
-//
-static LRESULT CALLBACK clipWatcherWndProc(
-    HWND hWnd,
-    UINT uMsg,
-    WPARAM wParam,
-    LPARAM lParam)
-{
-    //fwprintf(stderr, L"msg: %x, hWnd=%p, wParam=%p\n", uMsg, hWnd, wParam);
-
-    switch (uMsg) {
-    case WM_CREATE:
-    {
-        // Initialization.
-	CREATESTRUCT* cs = (CREATESTRUCT*)lParam;
-	ClipWatcher* watcher = (ClipWatcher*)(cs->lpCreateParams);
-	if (watcher != NULL) {
-	    SetWindowLongPtr(hWnd, GWLP_USERDATA, (LONG_PTR)watcher);
-            if (logfp != NULL) {
-                fwprintf(logfp, L"watcher: %s\n", watcher->name);
-            }
-	    // Start watching the clipboard content.
-            AddClipboardFormatListener(hWnd);
-            SetTimer(hWnd, watcher->blink_timer_id, ICON_BLINK_INTERVAL, NULL);
-            SetTimer(hWnd, watcher->check_timer_id, FILESYSTEM_INTERVAL, NULL);
-	    SendMessage(hWnd, WM_TASKBAR_CREATED, 0, 0);
-	}
-	return FALSE;
-    }
-    
-    case WM_DESTROY:
-    {
-        // Clean up.
-	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
-	ClipWatcher* watcher = (ClipWatcher*)lp;
-	if (watcher != NULL) {
-            KillTimer(hWnd, watcher->blink_timer_id);
-            KillTimer(hWnd, watcher->check_timer_id);
-	    // Stop watching the clipboard content.
-            RemoveClipboardFormatListener(hWnd);
-	    // Unregister the icon.
-	    NOTIFYICONDATA nidata = {0};
-	    nidata.cbSize = sizeof(nidata);
-	    nidata.hWnd = hWnd;
-	    nidata.uID = watcher->icon_id;
-	    Shell_NotifyIcon(NIM_DELETE, &nidata);
-	}
-	PostQuitMessage(0);
-	return FALSE;
-    }
-
-    case WM_CLIPBOARDUPDATE:
-    {
-        // Clipboard change detected.
-	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
-	ClipWatcher* watcher = (ClipWatcher*)lp;
-	if (watcher != NULL) {
-            DWORD seqno = GetClipboardSequenceNumber();
-	    if (watcher->seqno < seqno) {
-                watcher->seqno = seqno;
-                if (logfp != NULL) {
-                    fwprintf(logfp, L"updated clipboard: seqno=%d\n", seqno);
-                }
-                for (int i = 0; i < CLIPBOARD_RETRY; i++) {
-                    Sleep(CLIPBOARD_DELAY);
-                    if (OpenClipboard(hWnd)) {
-                        if (GetClipboardData(CF_ORIGIN) == NULL) {
-                            WCHAR path[MAX_PATH];
-                            StringCchPrintf(path, _countof(path), L"%s\\%s", 
-                                            watcher->dstdir, watcher->name);
-                            exportClipFile(path);
-                        }
-                        WCHAR text[256];
-                        int filetype = getClipboardText(text, _countof(text));
-                        if (0 <= filetype) {
-                            if (watcher->show_balloon) {
-                                NOTIFYICONDATA nidata = {0};
-                                nidata.cbSize = sizeof(nidata);
-                                nidata.hWnd = hWnd;
-                                nidata.uID = watcher->icon_id;
-                                nidata.uFlags = NIF_INFO;
-                                nidata.dwInfoFlags = NIIF_INFO;
-                                nidata.uTimeout = 1000;
-                                StringCchCopy(nidata.szInfoTitle, 
-                                              _countof(nidata.szInfoTitle), 
-                                              MESSAGE_UPDATED);
-                                StringCchCopy(nidata.szInfo, 
-                                              _countof(nidata.szInfo),
-                                              text);
-                                Shell_NotifyIcon(NIM_MODIFY, &nidata);
-                            }
-                            watcher->icon_blinking = HICON_FILETYPE[filetype];
-                            watcher->icon_blink_count = ICON_BLINK_COUNT;
-                        }
-                        CloseClipboard();
-                        break;
-                    }
-                }
-	    }
-	}
-	return FALSE;
-    }
-
-    case WM_NOTIFY_FILE:
-    {
-        // File change detected.
-	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
-	ClipWatcher* watcher = (ClipWatcher*)lp;
-	if (watcher != NULL) {
-	    FileEntry* entry = checkFileChanges(watcher);
-	    if (entry != NULL) {
-                if (logfp != NULL) {
-                    fwprintf(logfp, L"updated file: path=%s\n", entry->path);
-                }
-                int index = rindex(entry->path, L'.');
-                if (0 <= index) {
-                    WCHAR* ext = &(entry->path[index]);
-                    if (_wcsicmp(ext, FILE_EXT_TEXT) == 0) {
-                        // CF_UNICODETEXT
-                        int nchars;
-                        LPWSTR text = readTextFile(entry->path, &nchars);
-                        if (text != NULL) {
-                            if (OpenClipboard(hWnd)) {
-                                EmptyClipboard();
-                                setClipboardOrigin(entry->path);
-                                setClipboardText(text, nchars);
-                                CloseClipboard();
-                            }
-                            free(text);
-                        }
-                    } else if (_wcsicmp(ext, FILE_EXT_BITMAP) == 0) {
-                        // CF_DIB
-                        BITMAPINFO* bmp = readBMPFile(entry->path);
-                        if (bmp != NULL) {
-                            if (OpenClipboard(hWnd)) {
-                                EmptyClipboard();
-                                setClipboardOrigin(entry->path);
-                                setClipboardDIB(bmp);
-                                CloseClipboard();
-                            }
-                            free(bmp);
-                        }
-                    }
-		}
-	    }
-	}
-	return FALSE;
-    }
-
-    case WM_COMMAND:
-    {
-        // Command specified.
-	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
-	ClipWatcher* watcher = (ClipWatcher*)lp;
-	switch (LOWORD(wParam)) {
-	case IDM_OPEN:
-	    if (watcher != NULL) {
-		if (OpenClipboard(hWnd)) {
-                    openClipFile();
-		    CloseClipboard();
-		}
-	    }
-	    break;
-	case IDM_EXIT:
-	    SendMessage(hWnd, WM_CLOSE, 0, 0);
-	    break;
-	}
-	return FALSE;
-    }
-
-    case WM_TIMECHANGE:
-    {
-        // Filesytem/Network share change detected.
-        // NOTICE: We wanted to check if wParam is DBT_DEVICEARRIVAL.
-        //   But it doesn't work when the system is suspended.
-	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
-	ClipWatcher* watcher = (ClipWatcher*)lp;
-	if (watcher != NULL) {
-            // Re-initialize the watcher object.
-            StopClipWatcher(watcher);
-        }
-        return TRUE;
-    }
-
-    case WM_NOTIFY_ICON:
-    {
-        // UI event handling.
-	POINT pt;
-        HMENU menu = GetMenu(hWnd);
-        if (menu != NULL) {
-            menu = GetSubMenu(menu, 0);
-        }
-	switch (lParam) {
-	case WM_LBUTTONDBLCLK:
-            if (menu != NULL) {
-                UINT item = GetMenuDefaultItem(menu, FALSE, 0);
-                SendMessage(hWnd, WM_COMMAND, MAKEWPARAM(item, 1), NULL);
-            }
-	    break;
-	case WM_LBUTTONUP:
-	    break;
-	case WM_RBUTTONUP:
-	    if (GetCursorPos(&pt)) {
-                SetForegroundWindow(hWnd);
-                if (menu != NULL) {
-                    TrackPopupMenu(menu, TPM_LEFTALIGN, 
-                                   pt.x, pt.y, 0, hWnd, NULL);
-                }
-		PostMessage(hWnd, WM_NULL, 0, 0);
-	    }
-	    break;
-	}
-	return FALSE;
-    }
-
-    case WM_TIMER:
-    {
-	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
-	ClipWatcher* watcher = (ClipWatcher*)lp;
-	if (watcher != NULL) {
-            UINT_PTR timer_id = wParam;
-            if (timer_id == watcher->blink_timer_id) {
-                // Blink the icon.
-                if (watcher->icon_blink_count) {
-                    watcher->icon_blink_count--;
-                    BOOL on = (watcher->icon_blink_count % 2);
-                    NOTIFYICONDATA nidata = {0};
-                    nidata.cbSize = sizeof(nidata);
-                    nidata.hWnd = hWnd;
-                    nidata.uID = watcher->icon_id;
-                    nidata.uFlags = NIF_ICON;
-                    nidata.hIcon = (on? watcher->icon_blinking : HICON_EMPTY);
-                    Shell_NotifyIcon(NIM_MODIFY, &nidata);
-                }
-            } else if (timer_id == watcher->check_timer_id) {
-                // Check the filesystem.
-                StartClipWatcher(watcher);
-            }
-        }
-        return FALSE;
-    }
-
-    case WM_CLOSE:
-	DestroyWindow(hWnd);
-	return FALSE;
-
-    default:
-        if (uMsg == WM_TASKBAR_CREATED) {
-            LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
-            ClipWatcher* watcher = (ClipWatcher*)lp;
-            if (watcher != NULL) {
-                // Register the icon.
-                NOTIFYICONDATA nidata = {0};
-                nidata.cbSize = sizeof(nidata);
-                nidata.hWnd = hWnd;
-                nidata.uID = watcher->icon_id;
-                nidata.uFlags = NIF_ICON | NIF_MESSAGE | NIF_TIP;
-                nidata.uCallbackMessage = WM_NOTIFY_ICON;
-                nidata.hIcon = HICON_EMPTY;
-                StringCchPrintf(nidata.szTip, _countof(nidata.szTip),
-                                MESSAGE_WATCHING, watcher->srcdir);
-                Shell_NotifyIcon(NIM_ADD, &nidata);
-            }
-        }
-	return DefWindowProc(hWnd, uMsg, wParam, lParam);
-    }
-}
-
-
-//  ClipWatcherMain
-// 
-int ClipWatcherMain(
-    HINSTANCE hInstance, 
-    HINSTANCE hPrevInstance, 
-    int nCmdShow,
-    int argc, LPWSTR* argv)
-{
-    LPCWSTR clippath = DEFAULT_CLIPPATH;
-    if (2 <= argc) {
-	clippath = argv[1];
-    }
-
-    // Prevent a duplicate process.
-    HANDLE mutex = CreateMutex(NULL, TRUE, CLIPWATCHER_NAME);
-    if (GetLastError() == ERROR_ALREADY_EXISTS) {
-	CloseHandle(mutex);
-	return 0;
-    }
-    
-    // Obtain the clipboard directory path.
-    WCHAR clipdir[MAX_PATH];
-    if (GetFileAttributes(clippath) == INVALID_FILE_ATTRIBUTES) {
-	// Obtain the home path.
-	WCHAR home[MAX_PATH];
-	SHGetFolderPath(NULL, CSIDL_PROFILE, NULL, SHGFP_TYPE_CURRENT, home);
-	StringCchPrintf(clipdir, _countof(clipdir), L"%s\\%s", 
-			home, clippath);
-        if (GetFileAttributes(clipdir) == INVALID_FILE_ATTRIBUTES) {
-            WCHAR msg[MAX_PATH];
-            StringCchPrintf(msg, _countof(msg), L"%s (%s)", 
-                            ERROR_NOTFOUND, clipdir);
-            MessageBox(NULL, msg, ERROR_TITLE, MB_OK | MB_ICONERROR);
-            return 1;
-        }
-    } else {
-	StringCchCopy(clipdir, _countof(clipdir), clippath);
-    }
-    
-    // Obtain the computer name.
-    WCHAR name[MAX_COMPUTERNAME_LENGTH+1];
-    DWORD namelen = sizeof(name);
-    GetComputerName(name, &namelen);
-
-    // Register the window class.
-    ATOM atom;
-    {
-	WNDCLASS klass;
-	ZeroMemory(&klass, sizeof(klass));
-	klass.lpfnWndProc = clipWatcherWndProc;
-	klass.hInstance = hInstance;
-	klass.hIcon = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_CLIPWATCHER));
-	klass.hbrBackground = (HBRUSH)(COLOR_WINDOW+1);
-        klass.lpszMenuName = MAKEINTRESOURCE(IDM_POPUPMENU);
-	klass.lpszClassName = CLIPWATCHER_WNDCLASS;
-	atom = RegisterClass(&klass);
-    }
-    
-    // Register the clipboard format.
-    CF_ORIGIN = RegisterClipboardFormat(CLIPWATCHER_ORIGIN);
-    // Register the window message.
-    WM_TASKBAR_CREATED = RegisterWindowMessage(TASKBAR_CREATED);
-
-    // Load the resources.
-    HICON_EMPTY = \
-        LoadIcon(hInstance, MAKEINTRESOURCE(IDI_CLIPEMPTY));
-    HICON_FILETYPE[FILETYPE_TEXT] = \
-        LoadIcon(hInstance, MAKEINTRESOURCE(IDI_CLIPTEXT));
-    HICON_FILETYPE[FILETYPE_BITMAP] = \
-        LoadIcon(hInstance, MAKEINTRESOURCE(IDI_CLIPBITMAP));
-    LoadString(hInstance, IDS_DEFAULT_CLIPPATH, 
-               DEFAULT_CLIPPATH, _countof(DEFAULT_CLIPPATH));
-    LoadString(hInstance, IDS_MESSAGE_WATCHING, 
-               MESSAGE_WATCHING, _countof(MESSAGE_WATCHING));
-    LoadString(hInstance, IDS_MESSAGE_UPDATED, 
-               MESSAGE_UPDATED, _countof(MESSAGE_UPDATED));
-    LoadString(hInstance, IDS_MESSAGE_BITMAP, 
-               MESSAGE_BITMAP, _countof(MESSAGE_BITMAP));
-    
-    // Create a ClipWatcher object.
-    ClipWatcher* watcher = CreateClipWatcher(clipdir, clipdir, name);
-    StartClipWatcher(watcher);
-    checkFileChanges(watcher);
-    
-    // Create a SysTray window.
-    HWND hWnd = CreateWindow(
-	(LPCWSTR)atom,
-	CLIPWATCHER_NAME,
-	(WS_OVERLAPPED | WS_SYSMENU),
-	CW_USEDEFAULT, CW_USEDEFAULT,
-	CW_USEDEFAULT, CW_USEDEFAULT,
-	NULL, NULL, hInstance, watcher);
-    UpdateWindow(hWnd);
-    {
-        // Set the default item.
-        HMENU menu = GetMenu(hWnd);
-        if (menu != NULL) {
-            menu = GetSubMenu(menu, 0);
-            if (menu != NULL) {
-                SetMenuDefaultItem(menu, IDM_OPEN, FALSE);
-            }
-        }
-    }
-
-    // Event loop.
-    MSG msg;
-    BOOL loop = TRUE;
-    while (loop) {
-        int n = (watcher->notifier != INVALID_HANDLE_VALUE)? 1 : 0;
-	DWORD obj = MsgWaitForMultipleObjects(n, &(watcher->notifier),
-                                              FALSE, INFINITE, QS_ALLINPUT);
-        if (obj < WAIT_OBJECT_0) {
-	    // Unexpected failure!
-	    loop = FALSE;
-	    break;
-        }
-        int i = obj - WAIT_OBJECT_0;
-        if (i < n) {
-            // We got a notification;
-            FindNextChangeNotification(watcher->notifier);
-            PostMessage(hWnd, WM_NOTIFY_FILE, 0, 0);
-        } else {
-            // We got a Window Message.
-            while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
-                if (msg.message == WM_QUIT) {
-                    loop = FALSE;
-                    break;
-                }
-                TranslateMessage(&msg);
-                DispatchMessage(&msg);
-            }
-	}
-    }
-
-    // Clean up.
-    StopClipWatcher(watcher);
-    DestroyClipWatcher(watcher);
-
-    return (int)msg.wParam;
-}
-
-
-// WinMain and wmain
-#ifdef WINDOWS
-int WinMain(HINSTANCE hInstance, 
-	    HINSTANCE hPrevInstance, 
-	    LPSTR lpCmdLine,
-	    int nCmdShow)
-{
-    int argc;
-    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
-    return ClipWatcherMain(hInstance, hPrevInstance, nCmdShow, argc, argv);
-}
-#else
-int wmain(int argc, wchar_t* argv[])
-{
-    logfp = stderr;
-    return ClipWatcherMain(GetModuleHandle(NULL), NULL, 0, argc, argv);
-}
-#endif
+//  ClipWatcher.cpp
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <windows.h>
+#include <strsafe.h>
+#include <shlobj.h>
+#include <dbt.h>
+#include <sddl.h>
+#include <wtsapi32.h>
+#include <psapi.h>
+#include "Resource.h"
+
+#pragma comment(lib, "user32.lib")
+#pragma comment(lib, "shell32.lib")
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "advapi32.lib")
+#pragma comment(lib, "wtsapi32.lib")
+#pragma comment(lib, "psapi.lib")
+
+// Constants (you shouldn't change)
+const LPCWSTR CLIPWATCHER_NAME = L"ClipWatcher";
+const LPCWSTR CLIPWATCHER_WNDCLASS = L"ClipWatcherClass";
+const LPCWSTR CLIPWATCHER_ORIGIN = L"ClipWatcherOrigin";
+const LPCWSTR TASKBAR_CREATED = L"TaskbarCreated";
+const WORD BMP_SIGNATURE = 0x4d42; // 'BM' in little endian.
+const DWORD PUSH_SIGNATURE = 0x48535550; // 'PUSH' in little endian.
+const DWORD PUSH_VERSION = 2;
+const DWORD TEXTZ_SIGNATURE = 0x315a5743; // 'CWZ1' in little endian.
+const DWORD TILEDELTA_SIGNATURE = 0x32545743; // 'CWT2' in little endian.
+const DWORD TEXTDELTA_SIGNATURE = 0x44585743; // 'CWXD' in little endian.
+const DWORD TEXTDELTA_LITERAL = 0xffffffff;
+const DWORD RING_SIGNATURE = 0x32525743; // 'CWR2' in little endian.
+const DWORD TRACE_SIGNATURE = 0x52545743; // 'CWTR' in little endian.
+const DWORD TRACE_VERSION = 1;
+const DWORD STAMP_SIGNATURE = 0x504d5453; // 'STMP' in little endian.
+const LPCWSTR RING_SDDL = L"D:(A;;GA;;;SY)(A;;GA;;;IU)";
+#define RING_MAX_READERS 64
+#define SHA256_SIZE 32
+#define POOL_NCLASSES 16
+#define LATENCY_NBUCKETS 32
+static UINT CF_ORIGIN;
+static UINT WM_TASKBAR_CREATED;
+enum {
+    WM_NOTIFY_ICON = WM_USER+1,
+    WM_NOTIFY_FILE,
+    WM_NOTIFY_SOCKET,
+    WM_NOTIFY_RING,
+    WM_NOTIFY_DROP,
+    WM_NOTIFY_STAMP,
+};
+const LPCWSTR FILE_EXT_TEXT = L".txt";
+const LPCWSTR FILE_EXT_BITMAP = L".bmp";
+const LPCWSTR FILE_EXT_TEXTZ = L".txz";
+const LPCWSTR FILE_EXT_BITMAPDELTA = L".bmd";
+const LPCWSTR FILE_EXT_TEXTDELTA = L".txd";
+const LPCWSTR FILE_EXT_TEMP = L".tmp";
+const LPCWSTR FILE_EXT_LIST = L".lst";
+const LPCWSTR FILE_EXT_STAMP = L".stm";
+const LPCWSTR STAGE_DIR = L"stage";
+enum {
+    FILETYPE_TEXT = 0,
+    FILETYPE_BITMAP = 1,
+};
+enum {
+    TRACE_CLIPBOARD = 1,        // clipboard updated (hash: seqno)
+    TRACE_EXPORT,               // exported (nbytes: total size)
+    TRACE_WRITE,                // file written (hash: fingerprint)
+    TRACE_NOTIFY,               // notifier woke up
+    TRACE_FILE,                 // file found in a scan
+    TRACE_SCAN,                 // scan done (nbytes: files, hash: msec)
+    TRACE_PUSH,                 // file pushed (hash: fingerprint)
+    TRACE_RING,                 // clip from the local ring
+    TRACE_IMPORT,               // copied to the clipboard
+};
+enum {
+    LATENCY_FILE = 0,
+    LATENCY_PUSH = 1,
+    LATENCY_RING = 2,
+};
+const LPCWSTR LATENCY_VIA[] = { L"file", L"push", L"ring" };
+
+// Constants (you may change)
+const int CLIPBOARD_RETRY = 3;
+const UINT CLIPBOARD_DELAY = 100;
+const UINT ICON_BLINK_INTERVAL = 400;
+const UINT ICON_BLINK_COUNT = 10;
+const UINT FILESYSTEM_INTERVAL = 1000;
+const UINT FILESYSTEM_BATTERY_INTERVAL = 30*1000;
+const int SCAN_MAX_THREADS = 8;
+const DWORD EXPORT_MIN_INTERVAL = 200;
+const DWORD EXPORT_MAX_DELAY = 1000;
+const DWORD EXPORT_MAX_BACKOFF = 60*1000;
+const DWORD EXPORT_STREAM_THRESHOLD = 1024*1024;
+const DWORD EXPORT_STREAM_CHUNK = 1024*1024;
+const DWORD MAX_TEXT_FILE_SIZE = 64*1024*1024;
+const DWORD TEXT_COMPRESS_THRESHOLD = 64*1024;
+const DWORD MAX_BITMAP_SIZE = 256*1024*1024;
+const LONG MAX_BITMAP_DIMENSION = 32768;
+const LONG TILE_SIZE = 64;
+const int DELTA_KEYFRAME_INTERVAL = 30;
+const DWORD TEXT_DELTA_THRESHOLD = 1024*1024;
+const DWORD CHUNK_MIN_SIZE = 2*1024;
+const DWORD CHUNK_MAX_SIZE = 64*1024;
+const ULONGLONG CHUNK_MASK = 0xfff8000000000000ULL; // 8KB on average.
+const WORD PUSH_DEFAULT_PORT = 21120;
+const UINT PUSH_TIMEOUT = 500;
+const DWORD PUSH_CHUNK_SIZE = 65536;
+const DWORD PUSH_MAX_SIZE = 64*1024*1024;
+const int PUSH_MAX_RECEIVERS = 4;
+const DWORD PUSH_RECV_TIMEOUT = 30*1000;
+const DWORD RING_SIZE = 16*1024*1024;
+const DWORD RING_MAX_PAYLOAD = 4*1024*1024;
+const SIZE_T POOL_MIN_SIZE = 4096;
+const SIZE_T POOL_MAX_RETAINED = 64*1024*1024;
+const DWORD FILEDROP_CHUNK_SIZE = 4*1024*1024;
+const int FILEDROP_MAX_THREADS = 4;
+const UINT FILEDROP_MAX_FILES = 1000;
+const DWORD MAX_LIST_FILE_SIZE = 1024*1024;
+const DWORD STAGE_EXPIRE_AGE = 60*60*1000; // msec
+const DWORD STAGE_CLEAN_INTERVAL = 60*60*1000; // msec
+const DWORD LATENCY_DUMP_INTERVAL = 60000; // msec
+const DWORD WAKEUP_DUMP_INTERVAL = 60000; // msec
+const LPCWSTR ERROR_TITLE = L"ClipWatcher Error";
+const LPCWSTR ERROR_NOTFOUND = L"Directory does not exist";
+
+// Resources (loaded at runtime)
+static HICON HICON_EMPTY;
+static HICON HICON_FILETYPE[2];
+static WCHAR DEFAULT_CLIPPATH[100] = L"Clipboard";
+static WCHAR MESSAGE_WATCHING[100] = L"Watching: %s";
+static WCHAR MESSAGE_UPDATED[100] = L"Clipboard Updated";
+static WCHAR MESSAGE_BITMAP[100] = L"Bitmap";
+
+// logging
+static FILE* logfp = NULL;
+
+//  PoolBlock
+//  Header of a buffer taken from the pool, followed by the buffer.
+//  A buffer shared by several jobs returns when the last one frees it.
+typedef struct _PoolBlock {
+    struct _PoolBlock* next;
+    SIZE_T size;
+    LONG nrefs;
+} PoolBlock;
+
+//  BufferPool
+//  Keeps the released buffers by their size classes (POOL_MIN_SIZE
+//  times powers of two) for reuse, up to max_retained bytes in total.
+//  It is shared by the scan threads.
+typedef struct _BufferPool {
+    CRITICAL_SECTION lock;
+    PoolBlock* blocks[POOL_NCLASSES];
+    SIZE_T retained;
+    SIZE_T max_retained;
+    DWORD nrequests;
+    DWORD nallocs;
+} BufferPool;
+
+//  Arena
+//  Buffers used while handling a single event, which are all
+//  returned to the pool by resetArena() after the event.
+typedef struct _Arena {
+    BufferPool* pool;
+    PoolBlock* blocks;
+} Arena;
+
+//  FileEntry
+// 
+typedef struct _FileEntry {
+    WCHAR path[MAX_PATH];
+    DWORD hash;
+    FILETIME mtime;
+    BOOL pushed;
+    // The last text imported in full, to which deltas refer.
+    LPSTR text;
+    DWORD ntext;
+    ULONGLONG text_hash;
+    struct _FileEntry* next;
+} FileEntry;
+
+//  PushPeer
+// 
+typedef struct _PushPeer {
+    WCHAR host[256];
+    SOCKADDR_STORAGE addr;
+    int addrlen;
+    struct _PushPeer* next;
+} PushPeer;
+
+//  OriginStamp
+//  The copy of the clip being exported, written to NAME.stm and sent
+//  with the pushes. origin is the time of the copy by the clock of
+//  the shared folder.
+typedef struct _OriginStamp {
+    DWORD signature;
+    DWORD seqno;
+    ULONGLONG clock;
+    ULONGLONG origin;
+} OriginStamp;
+
+//  StampWriter
+//  Writes NAME.stm by a thread so that an export does not wait for
+//  the shared folder. Only the latest stamp is written, and the time
+//  the server gives the file is passed back as a sample of its clock.
+typedef struct _StampWriter {
+    HWND hWnd;
+    WCHAR path[MAX_PATH];
+    HANDLE thread;
+    HANDLE event;
+    CRITICAL_SECTION lock;
+    OriginStamp stamp;
+    BOOL queued;
+    BOOL sampled;
+    ULONGLONG t0, t1, server;
+    volatile LONG quit;
+} StampWriter;
+
+//  LatencyPeer
+//  The delays of the copies from a host through a path.
+typedef struct _LatencyPeer {
+    WCHAR host[64];
+    int via;
+    ULONGLONG clock;            // of the last copy counted.
+    // A copy taken before its stamp was written.
+    ULONGLONG pending;
+    ULONGLONG pending_time;
+    DWORD nsamples;
+    DWORD nskewed;              // negative delays.
+    ULONGLONG sum;              // usec
+    DWORD counts[LATENCY_NBUCKETS];
+    struct _LatencyPeer* next;
+} LatencyPeer;
+
+//  WakeupCounter
+//  Counts how often the event loop wakes up, for each cause.
+typedef struct _WakeupCounter {
+    DWORD start;
+    DWORD dump;                 // time of the last dump.
+    DWORD ndumped;              // wakeups until the last dump.
+    DWORD nnotify;
+    DWORD nwrite;
+    DWORD nring;
+    DWORD nmessage;
+    DWORD ntimer;               // WM_TIMER messages.
+} WakeupCounter;
+
+//  PushHeader
+//  Sent as the first frame of a push, followed by the file content
+//  in frames of up to PUSH_CHUNK_SIZE bytes. A push from a peer with
+//  another version (or header size) is rejected.
+typedef struct _PushHeader {
+    DWORD signature;
+    DWORD version;
+    DWORD nbytes;
+    ULONGLONG clock;
+    WCHAR name[64];
+    OriginStamp stamp;
+} PushHeader;
+
+//  PushJob
+//  A push waiting for the push thread, which frames it as it sends.
+typedef struct _PushJob {
+    PushHeader hdr;
+    BYTE* head;                 // from the pool.
+    DWORD nhead;
+    BYTE* body;                 // from the pool, may be shared.
+    SIZE_T nbody;
+    BOOL transcode;             // the body is UTF-16 text sent as UTF-8.
+    LONG generation;            // cancelled when it changes.
+    struct _PushJob* next;
+} PushJob;
+
+//  PushReceiver
+//  A push being received without blocking the window.
+//  The length of the current frame is read first, then the frame.
+typedef struct _PushReceiver {
+    SOCKET s;
+    DWORD start;
+    DWORD framelen;
+    DWORD framepos;
+    BOOL inframe;
+    PushHeader hdr;
+    DWORD hdrpos;
+    BYTE* bytes;
+    DWORD nbytes;
+    struct _PushReceiver* next;
+} PushReceiver;
+
+//  TextZHeader
+//  Header of a .txz file, followed by the UTF-8 text
+//  compressed in the LZ4 block format.
+typedef struct _TextZHeader {
+    DWORD signature;
+    DWORD nbytes;
+    DWORD checksum;
+} TextZHeader;
+
+//  TileDeltaHeader
+//  Header of a .bmd file, followed by the DIB header and the tiles
+//  which differ from the keyframe (NAME.bmp with the same id).
+//  Each tile is its index followed by its rows.
+//  Both hashes are getImageHash() of the pixels.
+typedef struct _TileDeltaHeader {
+    DWORD signature;
+    DWORD keyframe_id;
+    DWORD hdrsize;
+    DWORD ntiles;
+    ULONGLONG keyframe_hash;
+    ULONGLONG image_hash;
+} TileDeltaHeader;
+
+//  KeyFrame
+//  The last bitmap written in full, to which deltas refer.
+typedef struct _KeyFrame {
+    DWORD id;
+    int ndeltas;
+    DWORD hdrsize;
+    BYTE header[sizeof(BITMAPV5HEADER)+3*sizeof(DWORD)];
+    DWORD ntiles;
+    ULONGLONG* hashes;
+    ULONGLONG hash;
+} KeyFrame;
+
+//  TextChunk
+//  A content-defined chunk of a text keyframe.
+typedef struct _TextChunk {
+    ULONGLONG hash;
+    DWORD offset;
+    DWORD nbytes;
+} TextChunk;
+
+//  TextKeyFrame
+//  The last large text written in full, to which deltas refer.
+typedef struct _TextKeyFrame {
+    ULONGLONG hash;
+    DWORD nbytes;
+    BOOL compressed;
+    int ndeltas;
+    DWORD nchunks;
+    TextChunk* chunks;  // sorted by hash.
+} TextKeyFrame;
+
+//  TextDeltaHeader
+//  Header of a .txd file, followed by the operations. Each operation
+//  copies nbytes at offset of the keyframe (NAME.txt or NAME.txz),
+//  or nbytes of literal text following it if offset is TEXTDELTA_LITERAL.
+typedef struct _TextDeltaHeader {
+    DWORD signature;
+    DWORD nbytes;
+    DWORD checksum;
+    DWORD base_nbytes;
+    ULONGLONG base_hash;
+    DWORD base_compressed;
+    DWORD nops;
+} TextDeltaHeader;
+
+typedef struct _TextDeltaOp {
+    DWORD offset;
+    DWORD nbytes;
+} TextDeltaOp;
+
+//  WriteJob
+//  A large file written a chunk at a time with overlapped I/O, first
+//  to a temporary file which is renamed when complete. The next chunk
+//  is filled (and transcoded) while the last one is being written.
+typedef struct _WriteJob {
+    WCHAR path[MAX_PATH];
+    WCHAR tmppath[MAX_PATH];
+    ULONGLONG clock;
+    HANDLE fp;
+    BYTE* head;                 // from the pool.
+    DWORD nhead;
+    BYTE* body;                 // from the pool.
+    SIZE_T nbody;
+    BOOL transcode;             // the body is UTF-16 written as UTF-8.
+    struct _RingRecord* record; // put to the local ring when written.
+    // The parts of the head and the body taken, and the UTF-8 bytes
+    // of a character split at the end of the last chunk.
+    DWORD headpos;
+    SIZE_T bodypos;
+    BYTE carry[4];
+    DWORD ncarry;
+    // A chunk is being written from bufs[cur^1] while bufs[cur]
+    // is filled with nready bytes.
+    BYTE* bufs[2];
+    int cur;
+    DWORD nready;
+    DWORD nwriting;
+    BOOL pending;
+    OVERLAPPED ov;
+    ULONGLONG offset;
+    struct _WriteJob* next;
+} WriteJob;
+
+//  RingHeader
+//  Header of the local ring, followed by the records.
+typedef struct _RingHeader {
+    DWORD signature;
+    DWORD capacity;
+    ULONGLONG head;  // bytes written so far.
+    DWORD readers[RING_MAX_READERS];  // process ids.
+} RingHeader;
+
+//  RingRecord
+//  A clip file in the local ring, followed by its content or
+//  the name of the spill file in the spill directory.
+typedef struct _RingRecord {
+    DWORD nbytes;    // size of the record with padding.
+    DWORD sender;    // process id.
+    ULONGLONG clock;
+    DWORD ndata;
+    BOOL spilled;
+    WCHAR name[64];
+    OriginStamp stamp;  // of the copy, with -L.
+} RingRecord;
+
+//  LocalRing
+// 
+typedef struct _LocalRing {
+    HANDLE file;
+    HANDLE mapping;
+    RingHeader* header;
+    HANDLE mutex;
+    HANDLE event;
+    int slot;
+    ULONGLONG cursor;
+    DWORD capacity;  // RING_SIZE, never taken from the header.
+    WCHAR prefix[64];
+    WCHAR spilldir[MAX_PATH];
+} LocalRing;
+
+//  HostFilter
+//  Host names (upper case, sorted) and glob patterns to match.
+typedef struct _HostFilter {
+    int nnames;
+    LPWSTR* names;
+    int npatterns;
+    LPWSTR* patterns;
+} HostFilter;
+
+//  SizeLimit
+//  The largest file to take for a file extension.
+typedef struct _SizeLimit {
+    WCHAR ext[16];
+    ULONGLONG maxbytes;
+    struct _SizeLimit* next;
+} SizeLimit;
+
+//  ScanItem
+//  A file in the folder to be fingerprinted by the scan workers.
+typedef struct _ScanItem {
+    WCHAR path[MAX_PATH];
+    ULONGLONG nbytes;
+    BOOL opened;
+    DWORD hash;
+    FILETIME mtime;
+} ScanItem;
+
+//  ScanJob
+//  The items shared by the scan workers, each of which takes
+//  the next item in turn.
+typedef struct _ScanJob {
+    BufferPool* pool;
+    ScanItem* items;
+    LONG nitems;
+    volatile LONG next;
+    const DWORD* delays;        // msec added to each item by the test.
+} ScanJob;
+
+//  ChunkState
+//  A chunk of a partial copy, kept after the content. The digest is
+//  checked against the data when the copy is resumed, since a write
+//  may have been cut short.
+typedef struct _ChunkState {
+    BYTE digest[SHA256_SIZE];
+    DWORD done;                 // TRUE once the chunk is written.
+    DWORD reserved;
+} ChunkState;
+
+//  ChunkCopy
+//  A file copied and hashed a chunk at a time by several threads.
+//  Each thread opens the files by itself so that the requests are
+//  not serialized on a single handle.
+typedef struct _ChunkCopy {
+    BufferPool* pool;
+    WCHAR srcpath[MAX_PATH];
+    WCHAR dstpath[MAX_PATH];
+    ULONGLONG nbytes;
+    DWORD chunksize;
+    DWORD nchunks;
+    ChunkState* states;
+    volatile LONG next;
+    volatile LONG nwritten;
+    volatile LONG failed;
+    volatile LONG* cancel;
+} ChunkCopy;
+
+//  StagedFile
+//  A source file staged before, by its identity (ID) and the KEY
+//  of its content.
+typedef struct _StagedFile {
+    ULONGLONG id;
+    ULONGLONG key;
+    struct _StagedFile* next;
+} StagedFile;
+
+//  FileDrop
+//  The files of a CF_HDROP copied to the staging area by a thread.
+//  Each file is stored as STAGE_DIR\KEY\NAME where KEY is the hash
+//  of its content, and NAME.lst lists them when all are staged.
+typedef struct _FileDrop {
+    HWND hWnd;
+    BufferPool* pool;
+    int nthreads;
+    LPCWSTR host;
+    WCHAR stagedir[MAX_PATH];
+    StagedFile** staged;        // only used by the thread.
+    BOOL clean;
+    DWORD nchunks;              // chunks staged,
+    DWORD ncopied;              // of which copied from the source.
+    LPWSTR files;               // paths ending with an empty one.
+    ULONGLONG clock;
+    HANDLE thread;
+    volatile LONG cancel;
+    volatile LONG done;
+    // Lines of NAME.lst in UTF-8: "KEY\tSIZE\tNAME".
+    LPSTR list;
+    DWORD nlist;
+    BOOL success;
+} FileDrop;
+
+//  ClipSnapshot
+//  Copies of the clipboard formats taken while the clipboard is open.
+typedef struct _ClipSnapshot {
+    LPWSTR text;
+    int nchars;
+    BYTE* dib;
+    SIZE_T ndib;
+    LPWSTR files;               // paths ending with an empty one.
+    SIZE_T nfilechars;
+} ClipSnapshot;
+
+//  ExportScheduler
+//  Debounces the clipboard updates so that only the last state of
+//  a burst is exported. The times are GetTickCount() values given
+//  by the caller.
+typedef struct _ExportScheduler {
+    DWORD min_interval;  // quiet time before exporting (msec).
+    DWORD max_delay;     // longest time an update is held (msec).
+    DWORD rate;          // bytes per second, or 0 if unlimited.
+    BOOL pending;
+    DWORD first_update;
+    DWORD last_update;
+    DWORD last_export;
+    DWORD backoff;       // time after last_export held by the rate.
+} ExportScheduler;
+
+//  TraceHeader
+//  Header of a trace file, followed by the records.
+typedef struct _TraceHeader {
+    DWORD signature;
+    DWORD version;
+    WCHAR name[64];
+} TraceHeader;
+
+//  TraceRecord
+//  An event seen by the window procedure, followed by namelen
+//  characters of the file name (without the directory).
+typedef struct _TraceRecord {
+    ULONGLONG nbytes;
+    ULONGLONG clock;
+    DWORD time;                 // msec since the trace started.
+    DWORD hash;
+    WORD type;
+    WORD namelen;
+} TraceRecord;
+
+//  ReplayExport
+//  What a recorded export wrote: the total size and the files
+//  (nwrites items of the writes from first).
+typedef struct _ReplayExport {
+    ULONGLONG nbytes;
+    int first;
+    int nwrites;
+} ReplayExport;
+
+//  ReplayWrite
+//  A file written by a recorded export.
+typedef struct _ReplayWrite {
+    WCHAR name[MAX_PATH];
+    DWORD hash;
+} ReplayWrite;
+
+//  ClipWatcher
+// 
+typedef struct _ClipWatcher {
+    LPWSTR dstdir;
+    LPWSTR srcdir;
+    HANDLE notifier;
+    LPWSTR name;
+    FileEntry* files;
+    DWORD seqno;
+    SOCKET listener;
+    WORD port;
+    PushPeer* peers;
+    // Pushes are sent by a thread and received as the data arrives.
+    HANDLE push_thread;
+    HANDLE push_event;
+    CRITICAL_SECTION push_lock;
+    PushJob* pushes;
+    volatile LONG push_generation;
+    volatile LONG push_quit;
+    PushReceiver* receivers;
+    HostFilter allow;
+    HostFilter deny;
+    SizeLimit* limits;
+    int scan_threads;
+    BOOL compress;
+    BOOL delta;
+    KeyFrame keyframe;
+    TextKeyFrame textkey;
+    ExportScheduler scheduler;
+    WriteJob* jobs;
+    HANDLE write_event;
+    FileDrop* drop;
+    StagedFile* staged;
+    DWORD stage_clean;
+    LocalRing* ring;
+    // Hybrid logical clock, and the clock and the path of the clip
+    // on the clipboard.
+    ULONGLONG clock;
+    ULONGLONG clip_clock;
+    WCHAR clip_path[MAX_PATH];
+
+    UINT icon_id;
+    UINT_PTR blink_timer_id;
+    UINT_PTR check_timer_id;
+    UINT_PTR export_timer_id;
+    HICON icon_blinking;
+    int icon_blink_count;
+    int show_balloon;
+    // The folder is not retried while the session is locked,
+    // and less often on battery.
+    BOOL locked;
+    BOOL on_battery;
+    FILE* trace;
+    DWORD trace_start;
+    // Latency tracing: the offset of the clock of the shared folder
+    // (100ns), and the time of the last local copy.
+    BOOL latency;
+    LONGLONG share_offset;
+    ULONGLONG share_rtt;
+    ULONGLONG copy_time;
+    OriginStamp stamp;
+    StampWriter* stamper;
+    LatencyPeer* latency_peers;
+    DWORD latency_dump;
+    BufferPool pool;
+    Arena arena;
+} ClipWatcher;
+
+static int getNumColors(BITMAPINFO* bmp)
+{
+    int ncolors = bmp->bmiHeader.biClrUsed;
+    if (ncolors == 0) {
+        switch (bmp->bmiHeader.biBitCount) {
+        case 1:
+        case 4:
+        case 8:
+            ncolors = 1 << bmp->bmiHeader.biBitCount;
+            break;
+        }
+    }
+    return ncolors;
+}
+
+static size_t getBMPHeaderSize(BITMAPINFO* bmp)
+{
+    size_t nbytes = bmp->bmiHeader.biSize + getNumColors(bmp)*sizeof(RGBQUAD);
+    // BI_BITFIELDS has three color masks after a BITMAPINFOHEADER.
+    if (bmp->bmiHeader.biSize == sizeof(BITMAPINFOHEADER) &&
+        bmp->bmiHeader.biCompression == BI_BITFIELDS) {
+        nbytes += 3*sizeof(DWORD);
+    }
+    return nbytes;
+}
+
+static size_t getBMPStride(BITMAPINFO* bmp)
+{
+    return ((bmp->bmiHeader.biWidth * bmp->bmiHeader.biBitCount + 31) / 32) * 4;
+}
+
+static size_t getBMPImageSize(BITMAPINFO* bmp)
+{
+    // biSizeImage may be 0 for uncompressed bitmaps.
+    size_t nbytes = bmp->bmiHeader.biSizeImage;
+    if (nbytes == 0) {
+        nbytes = getBMPStride(bmp) * abs(bmp->bmiHeader.biHeight);
+    }
+    return nbytes;
+}
+
+static size_t getBMPSize(BITMAPINFO* bmp)
+{
+    return (getBMPHeaderSize(bmp) + getBMPImageSize(bmp));
+}
+
+// checkBMPHeader(bmp, nbytes)
+//   Returns TRUE if the header is sane and the whole DIB fits in nbytes.
+//   Only bmp->bmiHeader is accessed.
+static BOOL checkBMPHeader(BITMAPINFO* bmp, ULONGLONG nbytes)
+{
+    BITMAPINFOHEADER* hdr = &(bmp->bmiHeader);
+    if (hdr->biSize < sizeof(BITMAPINFOHEADER) ||
+        sizeof(BITMAPV5HEADER) < hdr->biSize) return FALSE;
+    if (hdr->biWidth <= 0 || MAX_BITMAP_DIMENSION < hdr->biWidth ||
+        hdr->biHeight == 0 || MAX_BITMAP_DIMENSION < abs(hdr->biHeight)) return FALSE;
+    if (hdr->biPlanes != 1 || 256 < hdr->biClrUsed) return FALSE;
+    switch (hdr->biBitCount) {
+    case 1:
+    case 4:
+    case 8:
+        if (((DWORD)1 << hdr->biBitCount) < hdr->biClrUsed) return FALSE;
+        break;
+    case 16:
+    case 24:
+    case 32:
+        break;
+    default:
+        return FALSE;
+    }
+
+    ULONGLONG stride = (((ULONGLONG)hdr->biWidth * hdr->biBitCount + 31) / 32) * 4;
+    ULONGLONG imagesize = stride * abs(hdr->biHeight);
+    if (hdr->biCompression == BI_RGB || hdr->biCompression == BI_BITFIELDS) {
+        if (hdr->biSizeImage != 0 && hdr->biSizeImage < imagesize) return FALSE;
+    } else {
+        // Compressed (RLE, JPEG or PNG) bitmaps must have biSizeImage.
+        if (hdr->biSizeImage == 0) return FALSE;
+    }
+    if (hdr->biSizeImage != 0) {
+        imagesize = hdr->biSizeImage;
+    }
+    ULONGLONG total = getBMPHeaderSize(bmp) + imagesize;
+    return (total <= nbytes && total <= MAX_BITMAP_SIZE);
+}
+
+// isTileBitmap(bmp)
+//   Returns TRUE if the bitmap can be split into tiles (screenshots).
+static BOOL isTileBitmap(BITMAPINFO* bmp)
+{
+    BITMAPINFOHEADER* hdr = &(bmp->bmiHeader);
+    return ((hdr->biCompression == BI_RGB || 
+             hdr->biCompression == BI_BITFIELDS) &&
+            (hdr->biBitCount == 24 || hdr->biBitCount == 32) &&
+            hdr->biClrUsed == 0);
+}
+
+static DWORD getNumTiles(BITMAPINFO* bmp)
+{
+    DWORD ncols = (bmp->bmiHeader.biWidth + TILE_SIZE-1) / TILE_SIZE;
+    DWORD nrows = (abs(bmp->bmiHeader.biHeight) + TILE_SIZE-1) / TILE_SIZE;
+    return ncols * nrows;
+}
+
+// getTileGeometry(bmp, index, &offset, &rowbytes, &nrows)
+//   Tiles are counted in the stored row order.
+static void getTileGeometry(BITMAPINFO* bmp, DWORD index, 
+                            SIZE_T* poffset, DWORD* prowbytes, DWORD* pnrows)
+{
+    LONG width = bmp->bmiHeader.biWidth;
+    LONG height = abs(bmp->bmiHeader.biHeight);
+    DWORD ncols = (width + TILE_SIZE-1) / TILE_SIZE;
+    LONG x = (index % ncols) * TILE_SIZE;
+    LONG y = (index / ncols) * TILE_SIZE;
+    DWORD bpp = bmp->bmiHeader.biBitCount / 8;
+    *poffset = y*getBMPStride(bmp) + x*bpp;
+    *prowbytes = min(TILE_SIZE, width-x) * bpp;
+    *pnrows = min(TILE_SIZE, height-y);
+}
+
+// getTileHash(bits, stride, rowbytes, nrows)
+//   Hashes a tile in four independent lanes of 64-bit words
+//   so that the inner loop can be vectorized.
+static ULONGLONG getTileHash(const BYTE* bits, SIZE_T stride, 
+                             DWORD rowbytes, DWORD nrows)
+{
+    const ULONGLONG PRIME = 0x9e3779b97f4a7c15ULL;
+    ULONGLONG h[4] = { 1, 2, 3, 4 };
+    for (DWORD y = 0; y < nrows; y++) {
+        const BYTE* row = &bits[y*stride];
+        DWORD i = 0;
+        for (; i+32 <= rowbytes; i += 32) {
+            for (int k = 0; k < 4; k++) {
+                ULONGLONG v;
+                CopyMemory(&v, &row[i+k*8], sizeof(v));
+                h[k] = (h[k] ^ v) * PRIME;
+            }
+        }
+        for (; i < rowbytes; i++) {
+            h[i & 3] = (h[i & 3] ^ row[i]) * PRIME;
+        }
+    }
+    return (h[0] ^ (h[1] << 16 | h[1] >> 48) ^ 
+            (h[2] << 32 | h[2] >> 32) ^ (h[3] << 48 | h[3] >> 16));
+}
+
+// getHash64(bytes, nbytes)
+static ULONGLONG getHash64(const BYTE* bytes, DWORD nbytes)
+{
+    return getTileHash(bytes, nbytes, nbytes, 1);
+}
+
+// getTileHashes(bmp, hashes)
+//   Hashes each tile of the bitmap.
+static void getTileHashes(BITMAPINFO* bmp, ULONGLONG* hashes)
+{
+    const BYTE* bits = &(((const BYTE*)bmp)[getBMPHeaderSize(bmp)]);
+    SIZE_T stride = getBMPStride(bmp);
+    DWORD ntiles = getNumTiles(bmp);
+    for (DWORD i = 0; i < ntiles; i++) {
+        SIZE_T offset;
+        DWORD rowbytes, nrows;
+        getTileGeometry(bmp, i, &offset, &rowbytes, &nrows);
+        hashes[i] = getTileHash(&bits[offset], stride, rowbytes, nrows);
+    }
+}
+
+// getImageHash(hashes, ntiles)
+//   Hashes the whole image from the hashes of its tiles, so that
+//   a delta only has to hash the tiles it changes.
+static ULONGLONG getImageHash(const ULONGLONG* hashes, DWORD ntiles)
+{
+    return getHash64((const BYTE*)hashes, sizeof(ULONGLONG)*ntiles);
+}
+
+// getChunkLength(bytes, nbytes)
+//   Finds the end of the chunk with a rolling (Gear) hash so that
+//   the boundaries move with the content after an insertion.
+static DWORD getChunkLength(const BYTE* bytes, DWORD nbytes)
+{
+    static ULONGLONG gear[256];
+    if (gear[0] == 0) {
+        // splitmix64
+        ULONGLONG x = 0;
+        for (int i = 0; i < 256; i++) {
+            ULONGLONG z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            gear[i] = z ^ (z >> 31);
+        }
+    }
+
+    if (nbytes <= CHUNK_MIN_SIZE) return nbytes;
+    DWORD n = min(nbytes, CHUNK_MAX_SIZE);
+    ULONGLONG h = 0;
+    for (DWORD i = CHUNK_MIN_SIZE; i < n; i++) {
+        h = (h << 1) + gear[bytes[i]];
+        if ((h & CHUNK_MASK) == 0) return i+1;
+    }
+    return n;
+}
+
+// getTextChunks(bytes, nbytes, &nchunks)
+static TextChunk* getTextChunks(const BYTE* bytes, DWORD nbytes, DWORD* pnchunks)
+{
+    TextChunk* chunks = (TextChunk*) malloc(
+        sizeof(TextChunk)*(nbytes/CHUNK_MIN_SIZE+1));
+    if (chunks == NULL) return NULL;
+
+    DWORD nchunks = 0;
+    DWORD offset = 0;
+    while (offset < nbytes) {
+        DWORD n = getChunkLength(&bytes[offset], nbytes-offset);
+        chunks[nchunks].hash = getHash64(&bytes[offset], n);
+        chunks[nchunks].offset = offset;
+        chunks[nchunks].nbytes = n;
+        nchunks++;
+        offset += n;
+    }
+    *pnchunks = nchunks;
+    return chunks;
+}
+
+// compareTextChunks(a, b)
+static int compareTextChunks(const void* a, const void* b)
+{
+    const TextChunk* chunk1 = (const TextChunk*)a;
+    const TextChunk* chunk2 = (const TextChunk*)b;
+    if (chunk1->hash != chunk2->hash) {
+        return (chunk1->hash < chunk2->hash)? -1 : +1;
+    }
+    if (chunk1->nbytes != chunk2->nbytes) {
+        return (chunk1->nbytes < chunk2->nbytes)? -1 : +1;
+    }
+    return 0;
+}
+
+//  Buffer pool
+//  The buffers for the clipboard content are taken from the pool
+//  so that the large ones stay mapped between the events.
+
+// initBufferPool(pool, max_retained)
+static void initBufferPool(BufferPool* pool, SIZE_T max_retained)
+{
+    InitializeCriticalSection(&(pool->lock));
+    ZeroMemory(pool->blocks, sizeof(pool->blocks));
+    pool->retained = 0;
+    pool->max_retained = max_retained;
+    pool->nrequests = 0;
+    pool->nallocs = 0;
+}
+
+// getPoolClass(nbytes)
+//   Returns the size class, or -1 if it is too large to be kept.
+static int getPoolClass(SIZE_T nbytes)
+{
+    SIZE_T size = POOL_MIN_SIZE;
+    for (int i = 0; i < POOL_NCLASSES; i++) {
+        if (nbytes <= size) return i;
+        size *= 2;
+    }
+    return -1;
+}
+
+// allocBuffer(pool, nbytes)
+//   The buffer must be released by freeBuffer().
+static void* allocBuffer(BufferPool* pool, SIZE_T nbytes)
+{
+    PoolBlock* block = NULL;
+    int i = getPoolClass(nbytes);
+    EnterCriticalSection(&(pool->lock));
+    pool->nrequests++;
+    if (0 <= i && pool->blocks[i] != NULL) {
+        block = pool->blocks[i];
+        pool->blocks[i] = block->next;
+        pool->retained -= block->size;
+    }
+    LeaveCriticalSection(&(pool->lock));
+
+    if (block == NULL) {
+        SIZE_T size = (0 <= i)? (POOL_MIN_SIZE << i) : max(nbytes, 1);
+        block = (PoolBlock*) malloc(sizeof(PoolBlock)+size);
+        if (block == NULL) return NULL;
+        block->size = size;
+        InterlockedIncrement((LONG volatile*)&(pool->nallocs));
+    }
+    block->next = NULL;
+    block->nrefs = 1;
+    return &(block[1]);
+}
+
+// freeBuffer(pool, buf)
+//   Keeps the buffer for reuse if the pool has room.
+static void freeBuffer(BufferPool* pool, void* buf)
+{
+    if (buf == NULL) return;
+    PoolBlock* block = &(((PoolBlock*)buf)[-1]);
+    if (0 < InterlockedDecrement(&(block->nrefs))) return;
+    int i = getPoolClass(block->size);
+    EnterCriticalSection(&(pool->lock));
+    if (0 <= i && pool->retained+block->size <= pool->max_retained) {
+        block->next = pool->blocks[i];
+        pool->blocks[i] = block;
+        pool->retained += block->size;
+        block = NULL;
+    }
+    LeaveCriticalSection(&(pool->lock));
+    if (block != NULL) {
+        free(block);
+    }
+}
+
+// freeBufferPool(pool)
+static void freeBufferPool(BufferPool* pool)
+{
+    for (int i = 0; i < POOL_NCLASSES; i++) {
+        while (pool->blocks[i] != NULL) {
+            PoolBlock* block = pool->blocks[i];
+            pool->blocks[i] = block->next;
+            free(block);
+        }
+    }
+    pool->retained = 0;
+    DeleteCriticalSection(&(pool->lock));
+}
+
+// allocArena(arena, nbytes)
+//   The buffer is valid until resetArena() is called.
+static void* allocArena(Arena* arena, SIZE_T nbytes)
+{
+    void* buf = allocBuffer(arena->pool, nbytes);
+    if (buf != NULL) {
+        PoolBlock* block = &(((PoolBlock*)buf)[-1]);
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    return buf;
+}
+
+// resetArena(arena)
+//   Returns all the buffers to the pool.
+static void resetArena(Arena* arena)
+{
+    while (arena->blocks != NULL) {
+        PoolBlock* block = arena->blocks;
+        arena->blocks = block->next;
+        freeBuffer(arena->pool, &(block[1]));
+    }
+}
+
+// shareArena(arena, buf)
+//   Takes a reference to a buffer of the arena so that it outlives
+//   the event. It must then be released by freeBuffer(). Returns FALSE
+//   if it is not a buffer of the arena.
+static BOOL shareArena(Arena* arena, LPCVOID buf)
+{
+    for (PoolBlock* block = arena->blocks; block != NULL; block = block->next) {
+        if (&(block[1]) == buf) {
+            InterlockedIncrement(&(block->nrefs));
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// runWorkers(proc, param, nthreads)
+//   Runs proc(param) on nthreads threads including the calling one
+//   and returns when all of them are done.
+static void runWorkers(LPTHREAD_START_ROUTINE proc, LPVOID param, 
+                       int nthreads)
+{
+    HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+    DWORD nworkers = 0;
+    nthreads = min(nthreads, MAXIMUM_WAIT_OBJECTS+1);
+    for (int i = 1; i < nthreads; i++) {
+        HANDLE thread = CreateThread(NULL, 0, proc, param, 0, NULL);
+        if (thread == NULL) break;
+        threads[nworkers++] = thread;
+    }
+    proc(param);
+    if (0 < nworkers) {
+        WaitForMultipleObjects(nworkers, threads, TRUE, INFINITE);
+        for (DWORD i = 0; i < nworkers; i++) {
+            CloseHandle(threads[i]);
+        }
+    }
+}
+
+// getWCHARfromCHAR(arena, bytes, nbytes, &nchars)
+static LPWSTR getWCHARfromCHAR(Arena* arena, LPCSTR bytes, int nbytes, 
+                               int* pnchars)
+{
+    int nchars = MultiByteToWideChar(CP_UTF8, 0, bytes, nbytes, NULL, 0);
+    LPWSTR chars = (LPWSTR) allocArena(arena, sizeof(WCHAR)*(nchars+1));
+    if (chars != NULL) {
+	MultiByteToWideChar(CP_UTF8, 0, bytes, nbytes, chars, nchars);
+	chars[nchars] = L'\0';
+	if (pnchars != NULL) {
+	    *pnchars = nchars;
+	}
+    }
+    return chars;
+}
+
+// getCHARfromWCHAR(arena, chars, nchars, &nbytes)
+static LPSTR getCHARfromWCHAR(Arena* arena, LPCWSTR chars, int nchars, 
+                              int* pnbytes)
+{
+    int nbytes = WideCharToMultiByte(CP_UTF8, 0, chars, nchars, 
+				     NULL, 0, NULL, NULL);
+    LPSTR bytes = (LPSTR) allocArena(arena, sizeof(CHAR)*(nbytes+1));
+    if (bytes != NULL) {
+	WideCharToMultiByte(CP_UTF8, 0, chars, nchars, 
+			    (LPSTR)bytes, nbytes, NULL, NULL);
+	bytes[nbytes] = '\0';
+	if (pnbytes != NULL) {
+	    *pnbytes = nbytes;
+	}
+    }
+    return bytes;
+}
+
+// getAdler32(bytes, nbytes)
+static DWORD getAdler32(const BYTE* bytes, SIZE_T nbytes)
+{
+    DWORD a = 1, b = 0;
+    while (0 < nbytes) {
+        // 5552 is the largest n that does not overflow b.
+        SIZE_T n = min(nbytes, 5552);
+        nbytes -= n;
+        while (n--) {
+            a += *(bytes++);
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+//  LZ4 block format
+//  Each sequence is a token (literal length:4, match length:4),
+//  extra literal length bytes, literals, a 16-bit offset and
+//  extra match length bytes. The last sequence has only literals.
+const DWORD LZ_MIN_MATCH = 4;
+const DWORD LZ_LAST_LITERALS = 5;
+const DWORD LZ_MFLIMIT = 12;
+const int LZ_HASH_BITS = 16;
+
+// getLZBound(nbytes)
+static SIZE_T getLZBound(SIZE_T nbytes)
+{
+    return nbytes + nbytes/255 + 16;
+}
+
+// writeLZLength(op, n)
+static BYTE* writeLZLength(BYTE* op, DWORD n)
+{
+    if (15 <= n) {
+        n -= 15;
+        while (255 <= n) {
+            *(op++) = 255;
+            n -= 255;
+        }
+        *(op++) = (BYTE)n;
+    }
+    return op;
+}
+
+// readLZLength(&ip, iend, &n)
+static BOOL readLZLength(const BYTE** pip, const BYTE* iend, DWORD* pn)
+{
+    if (*pn == 15) {
+        BYTE b;
+        do {
+            if (iend <= *pip || MAX_TEXT_FILE_SIZE < *pn) return FALSE;
+            b = *((*pip)++);
+            *pn += b;
+        } while (b == 255);
+    }
+    return TRUE;
+}
+
+// writeLZSequence(op, literals, nliterals, offset, nmatch)
+static BYTE* writeLZSequence(BYTE* op, const BYTE* literals, DWORD nliterals,
+                             DWORD offset, DWORD nmatch)
+{
+    BYTE* token = op++;
+    *token = (BYTE)(min(nliterals, 15) << 4);
+    op = writeLZLength(op, nliterals);
+    CopyMemory(op, literals, nliterals);
+    op += nliterals;
+    if (0 < nmatch) {
+        nmatch -= LZ_MIN_MATCH;
+        *token |= (BYTE)min(nmatch, 15);
+        *(op++) = (BYTE)(offset & 0xff);
+        *(op++) = (BYTE)(offset >> 8);
+        op = writeLZLength(op, nmatch);
+    }
+    return op;
+}
+
+// compressLZ(arena, src, nsrc, dst)
+//   dst must have getLZBound(nsrc) bytes. Returns the compressed size.
+//   The hash table is taken from the arena.
+static DWORD compressLZ(Arena* arena, const BYTE* src, DWORD nsrc, BYTE* dst)
+{
+    DWORD* table = (DWORD*) allocArena(arena, sizeof(DWORD) << LZ_HASH_BITS);
+    if (table == NULL) return 0;
+    ZeroMemory(table, sizeof(DWORD) << LZ_HASH_BITS);
+
+    BYTE* op = dst;
+    DWORD anchor = 0;
+    DWORD ip = 0;
+    DWORD misses = 0;
+    while (ip+LZ_MFLIMIT < nsrc) {
+        DWORD seq;
+        CopyMemory(&seq, &src[ip], sizeof(seq));
+        DWORD h = (seq * 2654435761U) >> (32 - LZ_HASH_BITS);
+        DWORD ref = table[h];
+        table[h] = ip;
+        DWORD seq1;
+        CopyMemory(&seq1, &src[ref], sizeof(seq1));
+        if (ref < ip && ip-ref <= 0xffff && seq1 == seq) {
+            DWORD nmatch = LZ_MIN_MATCH;
+            DWORD limit = nsrc - LZ_LAST_LITERALS;
+            while (ip+nmatch < limit && src[ref+nmatch] == src[ip+nmatch]) {
+                nmatch++;
+            }
+            op = writeLZSequence(op, &src[anchor], ip-anchor, ip-ref, nmatch);
+            ip += nmatch;
+            anchor = ip;
+            misses = 0;
+        } else {
+            // Skip faster over incompressible data.
+            ip += 1 + (misses++ >> 6);
+        }
+    }
+    op = writeLZSequence(op, &src[anchor], nsrc-anchor, 0, 0);
+
+    return (DWORD)(op - dst);
+}
+
+// decompressLZ(src, nsrc, dst, ndst)
+//   Returns TRUE if src expands to exactly ndst bytes.
+static BOOL decompressLZ(const BYTE* src, DWORD nsrc, BYTE* dst, DWORD ndst)
+{
+    const BYTE* ip = src;
+    const BYTE* iend = src+nsrc;
+    BYTE* op = dst;
+    BYTE* oend = dst+ndst;
+    while (ip < iend) {
+        DWORD token = *(ip++);
+        DWORD nliterals = token >> 4;
+        if (!readLZLength(&ip, iend, &nliterals)) return FALSE;
+        if ((DWORD)(iend-ip) < nliterals || 
+            (DWORD)(oend-op) < nliterals) return FALSE;
+        CopyMemory(op, ip, nliterals);
+        ip += nliterals;
+        op += nliterals;
+        if (ip == iend) break;
+
+        if (iend-ip < 2) return FALSE;
+        DWORD offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || (DWORD)(op-dst) < offset) return FALSE;
+        DWORD nmatch = token & 15;
+        if (!readLZLength(&ip, iend, &nmatch)) return FALSE;
+        nmatch += LZ_MIN_MATCH;
+        if ((DWORD)(oend-op) < nmatch) return FALSE;
+        // An overlapping match repeats the last offset bytes.
+        const BYTE* ref = op-offset;
+        while (offset < nmatch) {
+            CopyMemory(op, ref, offset);
+            op += offset;
+            ref += offset;
+            nmatch -= offset;
+        }
+        CopyMemory(op, ref, nmatch);
+        op += nmatch;
+    }
+    return (op == oend);
+}
+
+// stripspace(text1, text2)
+static LPWSTR ristrip(LPCWSTR text1, LPCWSTR text2)
+{
+    int len1 = wcslen(text1);
+    int len2 = wcslen(text2);
+    int dstlen = len1;
+    if (len2 < len1 && wcsicmp(&text1[len1-len2], text2) == 0) {
+	dstlen -= len2;
+    }
+
+    LPWSTR dst = (LPWSTR) malloc(sizeof(WCHAR)*(dstlen+1));
+    if (dst != NULL) {
+	StringCchCopy(dst, dstlen+1, text1);
+    }
+    return dst;
+}
+
+// rmspace(text)
+static void rmspace(LPWSTR src)
+{
+    WCHAR* dst = src;
+    WCHAR c;
+    while ((c = *(src++)) != 0) {
+        if (L' ' < c) {
+            *(dst++) = c;
+        }
+    }
+    *dst = L'\0';
+}
+
+// rindex(filename)
+static int rindex(LPCWSTR text, WCHAR c)
+{
+    int i = wcslen(text)-1;
+    while (0 <= i) {
+        if (text[i] == c) return i;
+        i--;
+    }
+    return -1;
+}
+
+// istartswith(text1, text2)
+static int istartswith(LPCWSTR text1, LPCWSTR text2)
+{
+    while (*text1 != 0 && *text2 != 0 && *text1 == *text2) {
+	text1++;
+	text2++;
+    }
+    return (*text2 == 0);
+}
+
+//  Hybrid logical clock
+//  A clock is a FILETIME value whose millisecond part follows
+//  the wall clock and whose sub-millisecond part counts the events
+//  within the same millisecond. It is stored as the last write time
+//  of every file published, so that all the hosts order the clips
+//  in the same way even when their clocks are slightly off.
+
+// getFileTimeValue(ft)
+static ULONGLONG getFileTimeValue(const FILETIME* ft)
+{
+    return ((ULONGLONG)ft->dwHighDateTime << 32) | ft->dwLowDateTime;
+}
+
+// getWallClock()
+static ULONGLONG getWallClock()
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    ULONGLONG t = getFileTimeValue(&ft);
+    return t - (t % 10000);
+}
+
+// tickClock(watcher)
+//   Advances the clock for a local event and returns it.
+static ULONGLONG tickClock(ClipWatcher* watcher)
+{
+    watcher->clock = max(getWallClock(), watcher->clock+1);
+    return watcher->clock;
+}
+
+// mergeClock(watcher, clock)
+//   Advances the clock past an event received from another host.
+static void mergeClock(ClipWatcher* watcher, ULONGLONG clock)
+{
+    watcher->clock = max(getWallClock(), max(watcher->clock, clock)+1);
+}
+
+// getClipHost(path, host, hostlen)
+//   Extracts the host name from a clip path "DIR\HOST.ext".
+static void getClipHost(LPCWSTR path, LPWSTR host, int hostlen)
+{
+    StringCchCopy(host, hostlen, &(path[rindex(path, L'\\')+1]));
+    LPWSTR ext = wcschr(host, L'.');
+    if (ext != NULL) {
+        *ext = L'\0';
+    }
+}
+
+// compareClips(clock1, path1, clock2, path2)
+//   Orders two clips by their clocks, then by their host names.
+static int compareClips(ULONGLONG clock1, LPCWSTR path1, 
+                        ULONGLONG clock2, LPCWSTR path2)
+{
+    if (clock1 != clock2) {
+        return (clock1 < clock2)? -1 : +1;
+    }
+    WCHAR host1[MAX_PATH], host2[MAX_PATH];
+    getClipHost(path1, host1, _countof(host1));
+    getClipHost(path2, host2, _countof(host2));
+    return _wcsicmp(host1, host2);
+}
+
+// isNewerClip(watcher, clock, path)
+//   Returns TRUE if the clip is newer than the one on the clipboard.
+static BOOL isNewerClip(ClipWatcher* watcher, ULONGLONG clock, LPCWSTR path)
+{
+    return (0 < compareClips(clock, path, 
+                             watcher->clip_clock, watcher->clip_path));
+}
+
+// setClipClock(watcher, clock, path)
+//   Records the clip put on the clipboard.
+static void setClipClock(ClipWatcher* watcher, ULONGLONG clock, LPCWSTR path)
+{
+    watcher->clip_clock = clock;
+    StringCchCopy(watcher->clip_path, _countof(watcher->clip_path), path);
+}
+
+// setClipboardOrigin(path)
+static void setClipboardOrigin(LPCWSTR path)
+{
+    int nbytes = sizeof(WCHAR)*(wcslen(path)+1);
+    HANDLE data = GlobalAlloc(GHND, nbytes);
+    if (data != NULL) {
+        BYTE* dst = (BYTE*) GlobalLock(data);
+        if (dst != NULL) {
+            CopyMemory(dst, path, nbytes);
+            GlobalUnlock(data);
+            SetClipboardData(CF_ORIGIN, data);
+            data = NULL;
+        }
+        if (data != NULL) {
+            GlobalFree(data);
+	}
+    }
+}
+
+// setClipboardText(text, nchars)
+static void setClipboardText(LPCWSTR text, int nchars)
+{
+    int nbytes = sizeof(WCHAR)*(nchars+1);
+    HANDLE data = GlobalAlloc(GHND, nbytes);
+    if (data != NULL) {
+        BYTE* dst = (BYTE*) GlobalLock(data);
+        if (dst != NULL) {
+            CopyMemory(dst, text, nbytes);
+            GlobalUnlock(data);
+            SetClipboardData(CF_UNICODETEXT, data);
+            data = NULL;
+        }
+        if (data != NULL) {
+            GlobalFree(data);
+        }
+    }
+}
+
+// setClipboardUTF8(bytes, nbytes)
+//   Converts the UTF-8 text directly into the clipboard memory.
+static void setClipboardUTF8(LPCSTR bytes, int nbytes)
+{
+    int nchars = MultiByteToWideChar(CP_UTF8, 0, bytes, nbytes, NULL, 0);
+    HANDLE data = GlobalAlloc(GHND, sizeof(WCHAR)*(nchars+1));
+    if (data != NULL) {
+        LPWSTR dst = (LPWSTR) GlobalLock(data);
+        if (dst != NULL) {
+            MultiByteToWideChar(CP_UTF8, 0, bytes, nbytes, dst, nchars);
+            GlobalUnlock(data);
+            SetClipboardData(CF_UNICODETEXT, data);
+            data = NULL;
+        }
+        if (data != NULL) {
+            GlobalFree(data);
+        }
+    }
+}
+
+// setClipboardDIB(bmp)
+static void setClipboardDIB(BITMAPINFO* src)
+{
+    size_t nbytes = getBMPSize(src);
+    HANDLE data = GlobalAlloc(GHND, nbytes);
+    if (data != NULL) {
+        LPVOID dst = GlobalLock(data);
+        if (dst != NULL) {
+            CopyMemory(dst, src, nbytes);
+            GlobalUnlock(data);
+            SetClipboardData(CF_DIB, data);
+            data = NULL;
+        }
+        if (data != NULL) {
+            GlobalFree(data);
+        }
+    }
+}
+
+// setClipboardHDROP(files, nchars)
+//   files is the paths ending with an empty one.
+static void setClipboardHDROP(LPCWSTR files, SIZE_T nchars)
+{
+    HANDLE data = GlobalAlloc(GHND, sizeof(DROPFILES)+sizeof(WCHAR)*nchars);
+    if (data != NULL) {
+        BYTE* dst = (BYTE*) GlobalLock(data);
+        if (dst != NULL) {
+            DROPFILES* drop = (DROPFILES*)dst;
+            drop->pFiles = sizeof(DROPFILES);
+            drop->fWide = TRUE;
+            CopyMemory(&dst[sizeof(DROPFILES)], files, sizeof(WCHAR)*nchars);
+            GlobalUnlock(data);
+            SetClipboardData(CF_HDROP, data);
+            data = NULL;
+        }
+        if (data != NULL) {
+            GlobalFree(data);
+        }
+    }
+}
+
+// getClipboardText(buf, buflen)
+static int getClipboardText(LPWSTR buf, int buflen)
+{
+    int filetype = -1;
+
+    // CF_UNICODETEXT
+    HANDLE data = GetClipboardData(CF_UNICODETEXT);
+    if (data != NULL) {
+        LPWSTR text = (LPWSTR) GlobalLock(data);
+        if (text != NULL) {
+            filetype = FILETYPE_TEXT;
+            StringCchCopy(buf, buflen, text);
+            GlobalUnlock(data);
+        }
+    }
+
+    // CF_DIB
+    data = GetClipboardData(CF_DIB);
+    if (data != NULL) {
+        LPVOID bytes = GlobalLock(data);
+        if (bytes != NULL) {
+            SIZE_T nbytes = GlobalSize(data);
+            filetype = FILETYPE_BITMAP;
+            StringCchCopy(buf, buflen, MESSAGE_BITMAP);
+            GlobalUnlock(data);
+        }
+    }
+    
+    return filetype;
+}
+
+// sendFrame(s, bytes1, nbytes1, bytes2, nbytes2)
+//   Sends a length-prefixed frame of two parts in one call.
+static BOOL sendFrame(SOCKET s, const BYTE* bytes1, DWORD nbytes1,
+                      const BYTE* bytes2, DWORD nbytes2)
+{
+    DWORD nbytes = nbytes1+nbytes2;
+    WSABUF bufs[3];
+    bufs[0].buf = (char*)&nbytes;
+    bufs[0].len = sizeof(nbytes);
+    bufs[1].buf = (char*)bytes1;
+    bufs[1].len = nbytes1;
+    bufs[2].buf = (char*)bytes2;
+    bufs[2].len = nbytes2;
+    DWORD sentbytes = 0;
+    return (WSASend(s, bufs, 3, &sentbytes, 0, NULL, NULL) == 0 &&
+            sentbytes == sizeof(nbytes)+nbytes);
+}
+
+// connectPushPeer(peer)
+static SOCKET connectPushPeer(PushPeer* peer)
+{
+    SOCKET s = socket(peer->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) return s;
+
+    // Do not wait for an unreachable peer longer than PUSH_TIMEOUT.
+    BOOL connected = FALSE;
+    u_long nonblocking = 1;
+    ioctlsocket(s, FIONBIO, &nonblocking);
+    if (connect(s, (SOCKADDR*)&(peer->addr), peer->addrlen) == 0) {
+        connected = TRUE;
+    } else if (WSAGetLastError() == WSAEWOULDBLOCK) {
+        // A refused connection is reported in efds, not in wfds.
+        fd_set wfds, efds;
+        FD_ZERO(&wfds);
+        FD_SET(s, &wfds);
+        FD_ZERO(&efds);
+        FD_SET(s, &efds);
+        TIMEVAL timeout;
+        timeout.tv_sec = PUSH_TIMEOUT / 1000;
+        timeout.tv_usec = (PUSH_TIMEOUT % 1000) * 1000;
+        if (0 < select(0, NULL, &wfds, &efds, &timeout) &&
+            FD_ISSET(s, &wfds)) {
+            int error = 0;
+            int n = sizeof(error);
+            connected = (getsockopt(s, SOL_SOCKET, SO_ERROR, 
+                                    (char*)&error, &n) == 0 && error == 0);
+        }
+    }
+    if (!connected) {
+        closesocket(s);
+        return INVALID_SOCKET;
+    }
+
+    nonblocking = 0;
+    ioctlsocket(s, FIONBIO, &nonblocking);
+    DWORD timeout = PUSH_TIMEOUT;
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&timeout, sizeof(timeout));
+    return s;
+}
+
+// sendTextFrames(watcher, job, s, buf)
+//   Sends the text of the job as UTF-8 in frames of up to
+//   PUSH_CHUNK_SIZE bytes, each transcoded into buf just before.
+//   A surrogate pair is never split across the frames.
+static BOOL sendTextFrames(ClipWatcher* watcher, PushJob* job, 
+                           SOCKET s, BYTE* buf)
+{
+    LPCWSTR text = (LPCWSTR)job->body;
+    SIZE_T nchars = job->nbody/sizeof(WCHAR);
+    BOOL success = TRUE;
+    SIZE_T i = 0;
+    while (success && i < nchars) {
+        // A character takes up to 3 bytes, and a surrogate pair 4.
+        int m = (int)min(nchars-i, PUSH_CHUNK_SIZE/3);
+        if (IS_HIGH_SURROGATE(text[i+m-1]) && i+m < nchars) {
+            m--;
+        }
+        DWORD n = WideCharToMultiByte(CP_UTF8, 0, &(text[i]), m, 
+                                      (LPSTR)buf, PUSH_CHUNK_SIZE, NULL, NULL);
+        success = (job->generation == watcher->push_generation &&
+                   sendFrame(s, buf, n, NULL, 0));
+        i += m;
+    }
+    return success;
+}
+
+// sendPushJob(watcher, job)
+//   Sends the header frame and then the head and the body as one
+//   stream in frames of up to PUSH_CHUNK_SIZE bytes, to every peer
+//   in turn. It stops when a newer clip is exported.
+static void sendPushJob(ClipWatcher* watcher, PushJob* job)
+{
+    BYTE* buf = NULL;
+    if (job->transcode) {
+        // The length of the UTF-8 text is counted for the header
+        // without converting it.
+        DWORD n = WideCharToMultiByte(CP_UTF8, 0, (LPCWSTR)job->body, 
+                                      (int)(job->nbody/sizeof(WCHAR)),
+                                      NULL, 0, NULL, NULL);
+        if (PUSH_MAX_SIZE < n) return;
+        job->hdr.nbytes = n;
+        buf = (BYTE*) allocBuffer(&(watcher->pool), PUSH_CHUNK_SIZE);
+        if (buf == NULL) return;
+    }
+    DWORD nbytes = job->hdr.nbytes;
+    for (PushPeer* peer = watcher->peers; peer != NULL; peer = peer->next) {
+        if (job->generation != watcher->push_generation) break;
+        SOCKET s = connectPushPeer(peer);
+        if (s != INVALID_SOCKET) {
+            BOOL success = sendFrame(s, (const BYTE*)&(job->hdr), 
+                                     sizeof(job->hdr), NULL, 0);
+            if (job->transcode) {
+                success = (success && sendTextFrames(watcher, job, s, buf));
+            } else {
+                for (DWORD i = 0; success && i < nbytes; i += PUSH_CHUNK_SIZE) {
+                    DWORD n = min(nbytes-i, PUSH_CHUNK_SIZE);
+                    const BYTE* head = NULL;
+                    const BYTE* body = NULL;
+                    DWORD k = 0;
+                    if (i < job->nhead) {
+                        head = &(job->head[i]);
+                        k = min(job->nhead-i, n);
+                    }
+                    if (k < n) {
+                        body = &(job->body[i+k-job->nhead]);
+                    }
+                    success = (job->generation == watcher->push_generation &&
+                               sendFrame(s, head, k, body, n-k));
+                }
+            }
+            if (logfp != NULL) {
+                fwprintf(logfp, L"push: host=%s, name=%s, nbytes=%u, success=%d\n",
+                         peer->host, job->hdr.name, nbytes, success);
+            }
+            closesocket(s);
+        }
+    }
+    freeBuffer(&(watcher->pool), buf);
+}
+
+// freePushJob(watcher, job)
+static void freePushJob(ClipWatcher* watcher, PushJob* job)
+{
+    freeBuffer(&(watcher->pool), job->head);
+    freeBuffer(&(watcher->pool), job->body);
+    free(job);
+}
+
+// pushWorker(param)
+//   Sends the queued files until the watcher is destroyed.
+static DWORD WINAPI pushWorker(LPVOID param)
+{
+    ClipWatcher* watcher = (ClipWatcher*)param;
+    for (;;) {
+        EnterCriticalSection(&(watcher->push_lock));
+        PushJob* job = watcher->pushes;
+        if (job != NULL) {
+            watcher->pushes = job->next;
+        }
+        LeaveCriticalSection(&(watcher->push_lock));
+        if (job == NULL) {
+            // The queue is drained before quitting.
+            if (watcher->push_quit) break;
+            WaitForSingleObject(watcher->push_event, INFINITE);
+            continue;
+        }
+        sendPushJob(watcher, job);
+        freePushJob(watcher, job);
+    }
+    return 0;
+}
+
+// queuePushJob(watcher, name, head, nhead, body, nbody, transcode)
+//   Queues the file content for the peers. It is framed and sent by
+//   pushWorker(). A body taken from the arena is shared with the job
+//   without a copy. If transcode is TRUE, the body is UTF-16 text
+//   which the push thread converts to UTF-8 as it is sent.
+static void queuePushJob(ClipWatcher* watcher, LPCWSTR name,
+                         LPCVOID head, DWORD nhead,
+                         LPCVOID body, SIZE_T nbody, BOOL transcode)
+{
+    // A character takes at least a byte in UTF-8.
+    SIZE_T nmin = (transcode)? nbody/sizeof(WCHAR) : nbody;
+    if (PUSH_MAX_SIZE < nhead+nmin) return;
+    if (watcher->push_thread == NULL) {
+        watcher->push_thread = CreateThread(NULL, 0, pushWorker, watcher, 
+                                            0, NULL);
+        if (watcher->push_thread == NULL) return;
+    }
+
+    PushJob* job = (PushJob*) malloc(sizeof(PushJob));
+    if (job == NULL) return;
+    ZeroMemory(job, sizeof(*job));
+    if (0 < nhead) {
+        job->head = (BYTE*) allocBuffer(&(watcher->pool), nhead);
+        if (job->head == NULL) {
+            free(job);
+            return;
+        }
+        CopyMemory(job->head, head, nhead);
+    }
+    if (shareArena(&(watcher->arena), body)) {
+        job->body = (BYTE*)body;
+    } else {
+        job->body = (BYTE*) allocBuffer(&(watcher->pool), nbody);
+        if (job->body == NULL) {
+            freeBuffer(&(watcher->pool), job->head);
+            free(job);
+            return;
+        }
+        CopyMemory(job->body, body, nbody);
+    }
+    job->hdr.signature = PUSH_SIGNATURE;
+    job->hdr.version = PUSH_VERSION;
+    // The length of a text is counted by the push thread.
+    job->hdr.nbytes = (transcode)? 0 : (DWORD)(nhead+nbody);
+    job->hdr.clock = watcher->clip_clock;
+    StringCchCopy(job->hdr.name, _countof(job->hdr.name), name);
+    job->hdr.stamp = watcher->stamp;
+    job->nhead = nhead;
+    job->nbody = nbody;
+    job->transcode = transcode;
+    job->generation = watcher->push_generation;
+    job->next = NULL;
+
+    EnterCriticalSection(&(watcher->push_lock));
+    PushJob** last = &(watcher->pushes);
+    while (*last != NULL) {
+        last = &((*last)->next);
+    }
+    *last = job;
+    LeaveCriticalSection(&(watcher->push_lock));
+    SetEvent(watcher->push_event);
+}
+
+// cancelPushJobs(watcher)
+//   Drops the queued pushes and stops the one being sent.
+static void cancelPushJobs(ClipWatcher* watcher)
+{
+    InterlockedIncrement(&(watcher->push_generation));
+    EnterCriticalSection(&(watcher->push_lock));
+    PushJob* job = watcher->pushes;
+    watcher->pushes = NULL;
+    LeaveCriticalSection(&(watcher->push_lock));
+    while (job != NULL) {
+        PushJob* next = job->next;
+        if (logfp != NULL) {
+            fwprintf(logfp, L"cancel: push=%s\n", job->hdr.name);
+        }
+        freePushJob(watcher, job);
+        job = next;
+    }
+}
+
+// stopPushWorker(watcher)
+//   Waits until the queued files are sent.
+static void stopPushWorker(ClipWatcher* watcher)
+{
+    if (watcher->push_thread == NULL) return;
+    InterlockedExchange(&(watcher->push_quit), 1);
+    SetEvent(watcher->push_event);
+    WaitForSingleObject(watcher->push_thread, INFINITE);
+    CloseHandle(watcher->push_thread);
+    watcher->push_thread = NULL;
+}
+
+// writeBytes(path, clock, head, nhead, body, nbody)
+//   The clock is stored as the last write time.
+static void writeBytes(LPCWSTR path, ULONGLONG clock,
+                       LPCVOID head, DWORD nhead,
+                       LPCVOID body, SIZE_T nbody)
+{
+    HANDLE fp = CreateFile(path, GENERIC_WRITE, 0,
+			   NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 
+			   NULL);
+    if (fp != INVALID_HANDLE_VALUE) {
+        if (logfp != NULL) {
+            fwprintf(logfp, L"write: path=%s, nbytes=%u\n", path, nhead+nbody);
+        }
+        DWORD writtenbytes;
+        if (0 < nhead) {
+            WriteFile(fp, head, nhead, &writtenbytes, NULL);
+        }
+        WriteFile(fp, body, (DWORD)nbody, &writtenbytes, NULL);
+        FILETIME mtime;
+        mtime.dwLowDateTime = (DWORD)clock;
+        mtime.dwHighDateTime = (DWORD)(clock >> 32);
+        SetFileTime(fp, NULL, NULL, &mtime);
+	CloseHandle(fp);
+    }
+}
+
+// queueWriteJob(watcher, path, clock, head, nhead, body, nbody, transcode)
+//   A body taken from the arena is kept by the job without a copy.
+//   If transcode is TRUE, the body is UTF-16 text written as UTF-8.
+//   Returns the job queued, or NULL.
+static WriteJob* queueWriteJob(ClipWatcher* watcher, LPCWSTR path, ULONGLONG clock,
+                          LPCVOID head, DWORD nhead,
+                          LPCVOID body, SIZE_T nbody, BOOL transcode)
+{
+    WriteJob* job = (WriteJob*) malloc(sizeof(WriteJob));
+    if (job == NULL) return NULL;
+    ZeroMemory(job, sizeof(*job));
+    if (0 < nhead) {
+        job->head = (BYTE*) allocBuffer(&(watcher->pool), nhead);
+        if (job->head == NULL) {
+            free(job);
+            return NULL;
+        }
+        CopyMemory(job->head, head, nhead);
+    }
+    if (shareArena(&(watcher->arena), body)) {
+        job->body = (BYTE*)body;
+    } else {
+        job->body = (BYTE*) allocBuffer(&(watcher->pool), nbody);
+        if (job->body == NULL) {
+            freeBuffer(&(watcher->pool), job->head);
+            free(job);
+            return NULL;
+        }
+        CopyMemory(job->body, body, nbody);
+    }
+    StringCchCopy(job->path, _countof(job->path), path);
+    StringCchPrintf(job->tmppath, _countof(job->tmppath), L"%s%s", 
+                    path, FILE_EXT_TEMP);
+    job->clock = clock;
+    job->fp = INVALID_HANDLE_VALUE;
+    job->nhead = nhead;
+    job->nbody = nbody;
+    job->transcode = transcode;
+    job->next = NULL;
+    // Keep the order of the jobs.
+    WriteJob** last = &(watcher->jobs);
+    while (*last != NULL) {
+        last = &((*last)->next);
+    }
+    *last = job;
+    return job;
+}
+
+// putLocalRing(watcher, rec, head, nhead, body, nbody)
+static BOOL putLocalRing(ClipWatcher* watcher, RingRecord* rec, 
+                         LPCVOID head, DWORD nhead,
+                         LPCVOID body, SIZE_T nbody);
+
+// freeWriteJob(watcher, job, success)
+//   Removes the first job. A keyframe which has not been written
+//   must not be referred to by the later deltas. A spill file
+//   which has been written is announced to the local ring.
+static void freeWriteJob(ClipWatcher* watcher, WriteJob* job, BOOL success)
+{
+    if (job->fp != INVALID_HANDLE_VALUE) {
+        if (job->pending) {
+            // The buffer must stay until the write is cancelled.
+            DWORD writtenbytes;
+            CancelIo(job->fp);
+            GetOverlappedResult(job->fp, &(job->ov), &writtenbytes, TRUE);
+        }
+        CloseHandle(job->fp);
+        DeleteFile(job->tmppath);
+    }
+    if (job->record != NULL) {
+        if (success) {
+            LPCWSTR name = &(job->path[rindex(job->path, L'\\')+1]);
+            putLocalRing(watcher, job->record, NULL, 0, 
+                         name, sizeof(WCHAR)*(wcslen(name)+1));
+        }
+        free(job->record);
+    } else if (!success) {
+        int index = rindex(job->path, L'.');
+        LPCWSTR ext = &(job->path[max(index, 0)]);
+        if (_wcsicmp(ext, FILE_EXT_BITMAP) == 0 &&
+            watcher->keyframe.hashes != NULL) {
+            free(watcher->keyframe.hashes);
+            watcher->keyframe.hashes = NULL;
+            watcher->keyframe.id++;
+        } else if ((_wcsicmp(ext, FILE_EXT_TEXT) == 0 ||
+                    _wcsicmp(ext, FILE_EXT_TEXTZ) == 0) &&
+                   watcher->textkey.chunks != NULL) {
+            free(watcher->textkey.chunks);
+            watcher->textkey.chunks = NULL;
+        }
+    }
+    watcher->jobs = job->next;
+    freeBuffer(&(watcher->pool), job->bufs[0]);
+    freeBuffer(&(watcher->pool), job->bufs[1]);
+    freeBuffer(&(watcher->pool), job->head);
+    freeBuffer(&(watcher->pool), job->body);
+    free(job);
+}
+
+// cancelWriteJobs(watcher)
+static void cancelWriteJobs(ClipWatcher* watcher)
+{
+    while (watcher->jobs != NULL) {
+        if (logfp != NULL) {
+            fwprintf(logfp, L"cancel: path=%s\n", watcher->jobs->path);
+        }
+        freeWriteJob(watcher, watcher->jobs, FALSE);
+    }
+}
+
+// fillWriteBuffer(job, buf)
+//   Fills buf with the next EXPORT_STREAM_CHUNK bytes of the file,
+//   transcoding the text if needed, so that every chunk but the last
+//   is written at an aligned offset. Returns the number of bytes.
+static DWORD fillWriteBuffer(WriteJob* job, BYTE* buf)
+{
+    DWORD n = 0;
+    if (0 < job->ncarry) {
+        CopyMemory(buf, job->carry, job->ncarry);
+        n = job->ncarry;
+        job->ncarry = 0;
+    }
+    if (job->headpos < job->nhead) {
+        DWORD k = min(job->nhead-job->headpos, EXPORT_STREAM_CHUNK-n);
+        CopyMemory(&(buf[n]), &(job->head[job->headpos]), k);
+        job->headpos += k;
+        n += k;
+    }
+    if (!job->transcode) {
+        DWORD k = (DWORD)min(job->nbody-job->bodypos, EXPORT_STREAM_CHUNK-n);
+        CopyMemory(&(buf[n]), &(job->body[job->bodypos]), k);
+        job->bodypos += k;
+        return n+k;
+    }
+
+    LPCWSTR text = (LPCWSTR)job->body;
+    SIZE_T nchars = job->nbody/sizeof(WCHAR);
+    SIZE_T i = job->bodypos/sizeof(WCHAR);
+    while (i < nchars && n < EXPORT_STREAM_CHUNK) {
+        DWORD space = EXPORT_STREAM_CHUNK-n;
+        // A character takes up to 3 bytes, and a surrogate pair 4.
+        int m = (int)min(nchars-i, space/3);
+        if (0 < m && IS_HIGH_SURROGATE(text[i+m-1]) && i+m < nchars) {
+            m--;
+        }
+        if (m == 0) {
+            // Split the next character across the chunks.
+            m = (IS_HIGH_SURROGATE(text[i]) && i+1 < nchars &&
+                 IS_LOW_SURROGATE(text[i+1]))? 2 : 1;
+            BYTE tmp[4];
+            DWORD k = WideCharToMultiByte(CP_UTF8, 0, &(text[i]), m, 
+                                          (LPSTR)tmp, sizeof(tmp), NULL, NULL);
+            DWORD c = min(k, space);
+            CopyMemory(&(buf[n]), tmp, c);
+            CopyMemory(job->carry, &(tmp[c]), k-c);
+            job->ncarry = k-c;
+            n += c;
+            i += m;
+            break;
+        }
+        n += WideCharToMultiByte(CP_UTF8, 0, &(text[i]), m, 
+                                 (LPSTR)&(buf[n]), space, NULL, NULL);
+        i += m;
+    }
+    job->bodypos = i*sizeof(WCHAR);
+    return n;
+}
+
+// stepWriteJobs(watcher, wait)
+//   Starts writing the next chunk when the last one is done, and
+//   fills the other buffer meanwhile. Returns TRUE if more are to be
+//   written; watcher->write_event is signaled when the chunk is done.
+//   If wait is TRUE, it waits for the chunk.
+static BOOL stepWriteJobs(ClipWatcher* watcher, BOOL wait)
+{
+    while (watcher->jobs != NULL) {
+        WriteJob* job = watcher->jobs;
+        if (job->fp == INVALID_HANDLE_VALUE) {
+            job->fp = CreateFile(job->tmppath, GENERIC_WRITE, 0,
+                                 NULL, CREATE_ALWAYS, 
+                                 (FILE_ATTRIBUTE_NORMAL | 
+                                  FILE_FLAG_OVERLAPPED), 
+                                 NULL);
+            if (job->fp == INVALID_HANDLE_VALUE) {
+                freeWriteJob(watcher, job, FALSE);
+                continue;
+            }
+            job->bufs[0] = (BYTE*) allocBuffer(&(watcher->pool), 
+                                               EXPORT_STREAM_CHUNK);
+            job->bufs[1] = (BYTE*) allocBuffer(&(watcher->pool), 
+                                               EXPORT_STREAM_CHUNK);
+            if (job->bufs[0] == NULL || job->bufs[1] == NULL) {
+                freeWriteJob(watcher, job, FALSE);
+                continue;
+            }
+            job->nready = fillWriteBuffer(job, job->bufs[job->cur]);
+        }
+
+        if (job->pending) {
+            DWORD writtenbytes;
+            if (!GetOverlappedResult(job->fp, &(job->ov), 
+                                     &writtenbytes, wait)) {
+                if (GetLastError() == ERROR_IO_INCOMPLETE) return TRUE;
+                freeWriteJob(watcher, job, FALSE);
+                continue;
+            }
+            job->pending = FALSE;
+            if (writtenbytes != job->nwriting) {
+                freeWriteJob(watcher, job, FALSE);
+                continue;
+            }
+            job->offset += writtenbytes;
+        }
+
+        if (0 < job->nready) {
+            ZeroMemory(&(job->ov), sizeof(job->ov));
+            job->ov.Offset = (DWORD)job->offset;
+            job->ov.OffsetHigh = (DWORD)(job->offset >> 32);
+            job->ov.hEvent = watcher->write_event;
+            job->nwriting = job->nready;
+            if (!WriteFile(job->fp, job->bufs[job->cur], job->nwriting, 
+                           NULL, &(job->ov)) &&
+                GetLastError() != ERROR_IO_PENDING) {
+                freeWriteJob(watcher, job, FALSE);
+                continue;
+            }
+            job->pending = TRUE;
+            job->cur ^= 1;
+            job->nready = fillWriteBuffer(job, job->bufs[job->cur]);
+            return TRUE;
+        }
+
+        // All the chunks are written.
+        FILETIME mtime;
+        mtime.dwLowDateTime = (DWORD)job->clock;
+        mtime.dwHighDateTime = (DWORD)(job->clock >> 32);
+        SetFileTime(job->fp, NULL, NULL, &mtime);
+        CloseHandle(job->fp);
+        job->fp = INVALID_HANDLE_VALUE;
+        BOOL success = MoveFileEx(job->tmppath, job->path, 
+                                  MOVEFILE_REPLACE_EXISTING);
+        if (logfp != NULL) {
+            fwprintf(logfp, L"write: path=%s, nbytes=%I64u, success=%d\n", 
+                     job->path, job->offset, success);
+        }
+        if (!success) {
+            DeleteFile(job->tmppath);
+        }
+        freeWriteJob(watcher, job, success);
+    }
+    return FALSE;
+}
+
+// publishClipFile(watcher, path, head, nhead, body, nbody)
+//   Writes the content to the shared folder and queues it for the peers.
+//   A large file is written later by stepWriteJobs().
+static void publishClipFile(ClipWatcher* watcher, LPCWSTR path,
+                            LPCVOID head, DWORD nhead,
+                            LPCVOID body, SIZE_T nbody)
+{
+    if (nhead+nbody < EXPORT_STREAM_THRESHOLD ||
+        !queueWriteJob(watcher, path, watcher->clip_clock, 
+                       head, nhead, body, nbody, FALSE)) {
+        writeBytes(path, watcher->clip_clock, head, nhead, body, nbody);
+    }
+    if (watcher->peers != NULL) {
+        LPCWSTR name = &(path[rindex(path, L'\\')+1]);
+        queuePushJob(watcher, name, head, nhead, body, nbody, FALSE);
+    }
+}
+
+// writeTextDelta(watcher, basepath, bytes, nbytes)
+//   Writes the text as chunks of the keyframe and new bytes.
+//   Returns FALSE if a new keyframe has to be written instead.
+static BOOL writeTextDelta(ClipWatcher* watcher, LPCWSTR basepath, 
+                           const BYTE* bytes, DWORD nbytes)
+{
+    TextKeyFrame* key = &(watcher->textkey);
+    DWORD nchunks;
+    TextChunk* chunks = getTextChunks(bytes, nbytes, &nchunks);
+    if (chunks == NULL) {
+        // The text is written in full but cannot be a keyframe.
+        if (key->chunks != NULL) {
+            free(key->chunks);
+            key->chunks = NULL;
+        }
+        return FALSE;
+    }
+
+    BOOL success = FALSE;
+    TextDeltaOp* ops = NULL;
+    if (key->chunks != NULL && key->ndeltas < DELTA_KEYFRAME_INTERVAL) {
+        ops = (TextDeltaOp*) malloc(sizeof(TextDeltaOp)*nchunks);
+    }
+    if (ops != NULL) {
+        // Look up each chunk in the keyframe and merge adjacent ones.
+        DWORD nops = 0;
+        DWORD nliterals = 0;
+        for (DWORD i = 0; i < nchunks; i++) {
+            TextChunk* ref = (TextChunk*) bsearch(
+                &chunks[i], key->chunks, key->nchunks, 
+                sizeof(TextChunk), compareTextChunks);
+            DWORD offset = (ref != NULL)? ref->offset : TEXTDELTA_LITERAL;
+            TextDeltaOp* last = (0 < nops)? &ops[nops-1] : NULL;
+            if (last != NULL && offset == TEXTDELTA_LITERAL &&
+                last->offset == TEXTDELTA_LITERAL) {
+                last->nbytes += chunks[i].nbytes;
+            } else if (last != NULL && offset != TEXTDELTA_LITERAL &&
+                       last->offset != TEXTDELTA_LITERAL &&
+                       last->offset+last->nbytes == offset) {
+                last->nbytes += chunks[i].nbytes;
+            } else {
+                ops[nops].offset = offset;
+                ops[nops].nbytes = chunks[i].nbytes;
+                nops++;
+            }
+            if (offset == TEXTDELTA_LITERAL) {
+                nliterals += chunks[i].nbytes;
+            }
+        }
+
+        // Write a keyframe when more than half of the text is new.
+        SIZE_T ndelta = sizeof(TextDeltaOp)*nops + nliterals;
+        BYTE* delta = NULL;
+        if (nliterals*2 <= nbytes) {
+            delta = (BYTE*) allocArena(&(watcher->arena), ndelta);
+        }
+        if (delta != NULL) {
+            BYTE* dst = delta;
+            DWORD offset = 0;
+            for (DWORD i = 0; i < nops; i++) {
+                CopyMemory(dst, &ops[i], sizeof(ops[i]));
+                dst += sizeof(ops[i]);
+                if (ops[i].offset == TEXTDELTA_LITERAL) {
+                    CopyMemory(dst, &bytes[offset], ops[i].nbytes);
+                    dst += ops[i].nbytes;
+                }
+                offset += ops[i].nbytes;
+            }
+            TextDeltaHeader hdr;
+            hdr.signature = TEXTDELTA_SIGNATURE;
+            hdr.nbytes = nbytes;
+            hdr.checksum = getAdler32(bytes, nbytes);
+            hdr.base_nbytes = key->nbytes;
+            hdr.base_hash = key->hash;
+            hdr.base_compressed = key->compressed;
+            hdr.nops = nops;
+            WCHAR path[MAX_PATH];
+            StringCchPrintf(path, _countof(path), L"%s%s", 
+                            basepath, FILE_EXT_TEXTDELTA);
+            publishClipFile(watcher, path, &hdr, sizeof(hdr), delta, ndelta);
+            key->ndeltas++;
+            success = TRUE;
+        }
+        free(ops);
+    }
+
+    if (success) {
+        free(chunks);
+    } else {
+        // The caller writes this text as a new keyframe.
+        if (key->chunks != NULL) {
+            free(key->chunks);
+        }
+        qsort(chunks, nchunks, sizeof(TextChunk), compareTextChunks);
+        key->hash = getHash64(bytes, nbytes);
+        key->nbytes = nbytes;
+        key->ndeltas = 0;
+        key->nchunks = nchunks;
+        key->chunks = chunks;
+    }
+    return success;
+}
+
+// writeTextFile(watcher, basepath, text, nchars)
+//   Returns the file extension used. Any text written in full other
+//   than a new keyframe replaces the keyframe file, so the keyframe
+//   is then forgotten.
+static LPCWSTR writeTextFile(ClipWatcher* watcher, LPCWSTR basepath, 
+                             LPCWSTR text, int nchars)
+{
+    TextKeyFrame* key = &(watcher->textkey);
+    LPCWSTR ext = FILE_EXT_TEXT;
+    if (!watcher->compress && !watcher->delta &&
+        EXPORT_STREAM_THRESHOLD <= sizeof(WCHAR)*nchars) {
+        // Transcode a large plain text while it is written and
+        // pushed rather than making a UTF-8 copy of the whole.
+        // The compression and the deltas need the whole.
+        WCHAR path[MAX_PATH];
+        StringCchPrintf(path, _countof(path), L"%s%s", basepath, ext);
+        if (queueWriteJob(watcher, path, watcher->clip_clock, NULL, 0, 
+                          text, sizeof(WCHAR)*nchars, TRUE)) {
+            if (watcher->peers != NULL) {
+                LPCWSTR name = &(path[rindex(path, L'\\')+1]);
+                queuePushJob(watcher, name, NULL, 0, 
+                             text, sizeof(WCHAR)*nchars, TRUE);
+            }
+            if (key->chunks != NULL) {
+                free(key->chunks);
+                key->chunks = NULL;
+            }
+            return ext;
+        }
+    }
+    int nbytes;
+    LPSTR bytes = getCHARfromWCHAR(&(watcher->arena), text, nchars, &nbytes);
+    BOOL keyframe = FALSE;
+    if (bytes != NULL && watcher->delta && 
+        TEXT_DELTA_THRESHOLD <= (DWORD)nbytes &&
+        (DWORD)nbytes <= MAX_TEXT_FILE_SIZE) {
+        if (writeTextDelta(watcher, basepath, (const BYTE*)bytes, nbytes)) {
+            return FILE_EXT_TEXTDELTA;
+        }
+        // writeTextDelta() made this text the keyframe.
+        keyframe = (key->chunks != NULL);
+    }
+    if (bytes != NULL) {
+        WCHAR path[MAX_PATH];
+        BYTE* zbytes = NULL;
+        DWORD nzbytes = 0;
+        if (watcher->compress && TEXT_COMPRESS_THRESHOLD <= (DWORD)nbytes) {
+            zbytes = (BYTE*) allocArena(&(watcher->arena), getLZBound(nbytes));
+            if (zbytes != NULL) {
+                nzbytes = compressLZ(&(watcher->arena), 
+                                     (const BYTE*)bytes, nbytes, zbytes);
+            }
+        }
+        if (0 < nzbytes && nzbytes < (DWORD)nbytes) {
+            TextZHeader hdr;
+            hdr.signature = TEXTZ_SIGNATURE;
+            hdr.nbytes = nbytes;
+            hdr.checksum = getAdler32((const BYTE*)bytes, nbytes);
+            ext = FILE_EXT_TEXTZ;
+            StringCchPrintf(path, _countof(path), L"%s%s", basepath, ext);
+            publishClipFile(watcher, path, &hdr, sizeof(hdr), zbytes, nzbytes);
+        } else {
+            StringCchPrintf(path, _countof(path), L"%s%s", basepath, ext);
+            publishClipFile(watcher, path, NULL, 0, bytes, nbytes);
+        }
+        if (keyframe) {
+            key->compressed = (ext == FILE_EXT_TEXTZ);
+        } else if (key->chunks != NULL) {
+            free(key->chunks);
+            key->chunks = NULL;
+        }
+    }
+    return ext;
+}
+
+// decodeTextZ(bytes, nbytes, &ntext)
+//   Decompresses the content of a .txz file into UTF-8 text.
+static LPSTR decodeTextZ(const BYTE* bytes, DWORD nbytes, DWORD* pntext)
+{
+    const TextZHeader* hdr = (const TextZHeader*)bytes;
+    if (nbytes < sizeof(*hdr) || 
+        hdr->signature != TEXTZ_SIGNATURE ||
+        MAX_TEXT_FILE_SIZE < hdr->nbytes) return NULL;
+
+    LPSTR text = (LPSTR) malloc(max(hdr->nbytes, 1));
+    if (text != NULL) {
+        if (decompressLZ(&bytes[sizeof(*hdr)], nbytes-sizeof(*hdr),
+                         (BYTE*)text, hdr->nbytes) &&
+            getAdler32((const BYTE*)text, hdr->nbytes) == hdr->checksum) {
+            *pntext = hdr->nbytes;
+        } else {
+            free(text);
+            text = NULL;
+        }
+    }
+    return text;
+}
+
+// applyTextDelta(arena, base, nbase, bytes, nbytes, &ntext)
+//   Rebuilds the text from the keyframe and the content of a .txd file
+//   into the arena.
+static LPSTR applyTextDelta(Arena* arena, const BYTE* base, DWORD nbase, 
+                            const BYTE* bytes, DWORD nbytes, DWORD* pntext)
+{
+    const TextDeltaHeader* hdr = (const TextDeltaHeader*)bytes;
+    if (nbytes < sizeof(*hdr) || 
+        hdr->signature != TEXTDELTA_SIGNATURE ||
+        MAX_TEXT_FILE_SIZE < hdr->nbytes) return NULL;
+
+    LPSTR text = (LPSTR) allocArena(arena, max(hdr->nbytes, 1));
+    if (text == NULL) return NULL;
+
+    const BYTE* src = &bytes[sizeof(*hdr)];
+    const BYTE* end = &bytes[nbytes];
+    DWORD ntext = 0;
+    BOOL success = TRUE;
+    for (DWORD i = 0; success && i < hdr->nops; i++) {
+        TextDeltaOp op;
+        success = (sizeof(op) <= (SIZE_T)(end-src));
+        if (!success) break;
+        CopyMemory(&op, src, sizeof(op));
+        src += sizeof(op);
+        success = (op.nbytes <= hdr->nbytes-ntext);
+        if (!success) break;
+        if (op.offset == TEXTDELTA_LITERAL) {
+            success = (op.nbytes <= (SIZE_T)(end-src));
+            if (!success) break;
+            CopyMemory(&text[ntext], src, op.nbytes);
+            src += op.nbytes;
+        } else {
+            success = (op.offset <= nbase && op.nbytes <= nbase-op.offset);
+            if (!success) break;
+            CopyMemory(&text[ntext], &base[op.offset], op.nbytes);
+        }
+        ntext += op.nbytes;
+    }
+    if (success && 
+        ntext == hdr->nbytes && 
+        getAdler32((const BYTE*)text, ntext) == hdr->checksum) {
+        *pntext = ntext;
+    } else {
+        text = NULL;
+    }
+    return text;
+}
+
+// readBytes(arena, path, maxbytes, &nbytes)
+//   The bytes are taken from the arena, or malloc'ed if it is NULL.
+static BYTE* readBytes(Arena* arena, LPCWSTR path, DWORD maxbytes, 
+                       DWORD* pnbytes)
+{
+    BYTE* bytes = NULL;
+    HANDLE fp = CreateFile(path, GENERIC_READ, FILE_SHARE_READ,
+			   NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 
+			   NULL);
+    if (fp != INVALID_HANDLE_VALUE) {
+	DWORD nbytes = GetFileSize(fp, NULL);
+        if (logfp != NULL) {
+            fwprintf(logfp, L"read: path=%s, nbytes=%u\n", path, nbytes);
+        }
+        nbytes = min(nbytes, maxbytes);
+        if (arena != NULL) {
+            bytes = (BYTE*) allocArena(arena, max(nbytes, 1));
+        } else {
+            bytes = (BYTE*) malloc(max(nbytes, 1));
+        }
+        if (bytes != NULL) {
+            ReadFile(fp, bytes, nbytes, pnbytes, NULL);
+        }
+	CloseHandle(fp);
+    }
+    return bytes;
+}
+
+// readTextZFile(arena, path, &ntext)
+//   The compressed bytes are read into the arena.
+static LPSTR readTextZFile(Arena* arena, LPCWSTR path, DWORD* pntext)
+{
+    LPSTR text = NULL;
+    DWORD nbytes;
+    BYTE* bytes = readBytes(
+        arena, path, getLZBound(MAX_TEXT_FILE_SIZE)+sizeof(TextZHeader), 
+        &nbytes);
+    if (bytes != NULL) {
+        text = decodeTextZ(bytes, nbytes, pntext);
+    }
+    return text;
+}
+
+// writeTileDelta(watcher, basepath, bmp, nbytes)
+//   Writes only the tiles which differ from the keyframe.
+//   Returns FALSE if a new keyframe has to be written instead.
+static BOOL writeTileDelta(ClipWatcher* watcher, LPCWSTR basepath, 
+                           BITMAPINFO* bmp, SIZE_T nbytes)
+{
+    KeyFrame* key = &(watcher->keyframe);
+    DWORD hdrsize = getBMPHeaderSize(bmp);
+    ULONGLONG* hashes = NULL;
+    DWORD ntiles = 0;
+    if (isTileBitmap(bmp) && checkBMPHeader(bmp, nbytes) &&
+        hdrsize <= sizeof(key->header)) {
+        ntiles = getNumTiles(bmp);
+        hashes = (ULONGLONG*) malloc(sizeof(ULONGLONG)*ntiles);
+    }
+    if (hashes == NULL) {
+        // Not tileable: the next bitmap will be a keyframe.
+        if (key->hashes != NULL) {
+            free(key->hashes);
+            key->hashes = NULL;
+        }
+        key->id++;
+        return FALSE;
+    }
+
+    const BYTE* bits = &(((const BYTE*)bmp)[hdrsize]);
+    SIZE_T stride = getBMPStride(bmp);
+    getTileHashes(bmp, hashes);
+
+    BOOL success = FALSE;
+    if (key->hashes != NULL && 
+        key->ndeltas < DELTA_KEYFRAME_INTERVAL &&
+        key->ntiles == ntiles && key->hdrsize == hdrsize &&
+        memcmp(key->header, bmp, hdrsize) == 0) {
+        DWORD nchanged = 0;
+        SIZE_T ndelta = hdrsize;
+        for (DWORD i = 0; i < ntiles; i++) {
+            if (hashes[i] != key->hashes[i]) {
+                SIZE_T offset;
+                DWORD rowbytes, nrows;
+                getTileGeometry(bmp, i, &offset, &rowbytes, &nrows);
+                ndelta += sizeof(DWORD) + rowbytes*nrows;
+                nchanged++;
+            }
+        }
+        // Write a keyframe when more than half of the tiles changed.
+        BYTE* delta = NULL;
+        if (nchanged*2 <= ntiles) {
+            delta = (BYTE*) allocArena(&(watcher->arena), ndelta);
+        }
+        if (delta != NULL) {
+            BYTE* dst = delta;
+            CopyMemory(dst, bmp, hdrsize);
+            dst += hdrsize;
+            for (DWORD i = 0; i < ntiles; i++) {
+                if (hashes[i] != key->hashes[i]) {
+                    SIZE_T offset;
+                    DWORD rowbytes, nrows;
+                    getTileGeometry(bmp, i, &offset, &rowbytes, &nrows);
+                    CopyMemory(dst, &i, sizeof(i));
+                    dst += sizeof(i);
+                    for (DWORD y = 0; y < nrows; y++) {
+                        CopyMemory(dst, &bits[offset+y*stride], rowbytes);
+                        dst += rowbytes;
+                    }
+                }
+            }
+            TileDeltaHeader hdr;
+            hdr.signature = TILEDELTA_SIGNATURE;
+            hdr.keyframe_id = key->id;
+            hdr.hdrsize = hdrsize;
+            hdr.ntiles = nchanged;
+            hdr.keyframe_hash = key->hash;
+            hdr.image_hash = getImageHash(hashes, ntiles);
+            WCHAR path[MAX_PATH];
+            StringCchPrintf(path, _countof(path), L"%s%s", 
+                            basepath, FILE_EXT_BITMAPDELTA);
+            publishClipFile(watcher, path, &hdr, sizeof(hdr), delta, ndelta);
+            key->ndeltas++;
+            success = TRUE;
+        }
+    }
+
+    if (success) {
+        free(hashes);
+    } else {
+        // The caller writes these tiles as a new keyframe.
+        if (key->hashes != NULL) {
+            free(key->hashes);
+        }
+        key->id++;
+        key->ndeltas = 0;
+        key->hdrsize = hdrsize;
+        CopyMemory(key->header, bmp, hdrsize);
+        key->ntiles = ntiles;
+        key->hashes = hashes;
+        key->hash = getImageHash(hashes, ntiles);
+    }
+    return success;
+}
+
+// writeBMPFile(watcher, basepath, bytes, nbytes)
+//   Returns the file extension used.
+static LPCWSTR writeBMPFile(ClipWatcher* watcher, LPCWSTR basepath, 
+                            LPVOID bytes, SIZE_T nbytes)
+{
+    if (watcher->delta &&
+        writeTileDelta(watcher, basepath, (BITMAPINFO*)bytes, nbytes)) {
+        return FILE_EXT_BITMAPDELTA;
+    }
+
+    // The keyframe id is stored in the reserved fields.
+    BITMAPFILEHEADER filehdr = {0};
+    filehdr.bfType = BMP_SIGNATURE;
+    filehdr.bfSize = sizeof(filehdr)+nbytes;
+    filehdr.bfReserved1 = LOWORD(watcher->keyframe.id);
+    filehdr.bfReserved2 = HIWORD(watcher->keyframe.id);
+    filehdr.bfOffBits = sizeof(filehdr)+getBMPHeaderSize((BITMAPINFO*)bytes);
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s%s", basepath, FILE_EXT_BITMAP);
+    publishClipFile(watcher, path, &filehdr, sizeof(filehdr), bytes, nbytes);
+    return FILE_EXT_BITMAP;
+}
+
+// readBMPFile(path, &keyframe_id)
+//   Reads the DIB directly into the global memory for the clipboard.
+static HANDLE readBMPFile(LPCWSTR path, DWORD* pkeyframe_id)
+{
+    HANDLE data = NULL;
+    HANDLE fp = CreateFile(path, GENERIC_READ, FILE_SHARE_READ,
+			   NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 
+			   NULL);
+    if (fp != INVALID_HANDLE_VALUE) {
+        // Validate the headers against the actual file size
+        // before allocating anything.
+        LARGE_INTEGER filesize;
+        BITMAPFILEHEADER filehdr;
+        BITMAPINFO info;
+        DWORD readbytes;
+        if (GetFileSizeEx(fp, &filesize) &&
+            ReadFile(fp, &filehdr, sizeof(filehdr), &readbytes, NULL) &&
+            readbytes == sizeof(filehdr) &&
+            filehdr.bfType == BMP_SIGNATURE &&
+            ReadFile(fp, &(info.bmiHeader), sizeof(info.bmiHeader), 
+                     &readbytes, NULL) &&
+            readbytes == sizeof(info.bmiHeader) &&
+            checkBMPHeader(&info, filesize.QuadPart-sizeof(filehdr))) {
+            DWORD hdrsize = getBMPHeaderSize(&info);
+            DWORD imagesize = getBMPImageSize(&info);
+            // The pixels may not immediately follow the color table.
+            if (sizeof(filehdr)+hdrsize <= filehdr.bfOffBits &&
+                (ULONGLONG)filehdr.bfOffBits+imagesize <= (ULONGLONG)filesize.QuadPart) {
+                if (logfp != NULL) {
+                    fwprintf(logfp, L"read: path=%s, nbytes=%u\n", 
+                             path, hdrsize+imagesize);
+                }
+                data = GlobalAlloc(GMEM_MOVEABLE, hdrsize+imagesize);
+            }
+            if (data != NULL) {
+                BOOL success = FALSE;
+                BYTE* dst = (BYTE*) GlobalLock(data);
+                if (dst != NULL) {
+                    CopyMemory(dst, &(info.bmiHeader), sizeof(info.bmiHeader));
+                    DWORD n = hdrsize-sizeof(info.bmiHeader);
+                    LARGE_INTEGER offset;
+                    offset.QuadPart = filehdr.bfOffBits;
+                    success = (ReadFile(fp, &(dst[sizeof(info.bmiHeader)]), n,
+                                        &readbytes, NULL) &&
+                               readbytes == n &&
+                               SetFilePointerEx(fp, offset, NULL, FILE_BEGIN) &&
+                               ReadFile(fp, &(dst[hdrsize]), imagesize, 
+                                        &readbytes, NULL) &&
+                               readbytes == imagesize);
+                    GlobalUnlock(data);
+                }
+                if (!success) {
+                    GlobalFree(data);
+                    data = NULL;
+                }
+            }
+            if (pkeyframe_id != NULL) {
+                *pkeyframe_id = MAKELONG(filehdr.bfReserved1, filehdr.bfReserved2);
+            }
+	}
+	CloseHandle(fp);
+    }
+
+    return data;
+}
+
+// readTileDelta(path, bytes, nbytes)
+//   Reconstructs the DIB from the keyframe and the content of a .bmd file.
+//   Both the keyframe and the result are checked against the hashes
+//   of the pixels written, so that a keyframe replaced with the same
+//   id or a torn file is never put on the clipboard.
+static HANDLE readTileDelta(LPCWSTR path, const BYTE* bytes, DWORD nbytes)
+{
+    const TileDeltaHeader* delta = (const TileDeltaHeader*)bytes;
+    if (nbytes < sizeof(*delta) || 
+        delta->signature != TILEDELTA_SIGNATURE ||
+        nbytes-sizeof(*delta) < delta->hdrsize) return NULL;
+
+    // The keyframe is NAME.bmp next to NAME.bmd.
+    WCHAR keypath[MAX_PATH];
+    StringCchPrintf(keypath, _countof(keypath), L"%.*s%s", 
+                    rindex(path, L'.'), path, FILE_EXT_BITMAP);
+    DWORD keyframe_id = 0;
+    HANDLE data = readBMPFile(keypath, &keyframe_id);
+    if (data == NULL) return NULL;
+
+    BOOL success = FALSE;
+    BYTE* dst = (BYTE*) GlobalLock(data);
+    ULONGLONG* hashes = NULL;
+    DWORD ntiles = 0;
+    if (dst != NULL) {
+        BITMAPINFO* bmp = (BITMAPINFO*)dst;
+        const BYTE* src = &bytes[sizeof(*delta)];
+        const BYTE* end = &bytes[nbytes];
+        if (keyframe_id == delta->keyframe_id &&
+            delta->hdrsize == getBMPHeaderSize(bmp) &&
+            memcmp(dst, src, delta->hdrsize) == 0 &&
+            isTileBitmap(bmp)) {
+            ntiles = getNumTiles(bmp);
+            hashes = (ULONGLONG*) malloc(sizeof(ULONGLONG)*ntiles);
+        }
+        if (hashes != NULL) {
+            getTileHashes(bmp, hashes);
+            success = (getImageHash(hashes, ntiles) == delta->keyframe_hash);
+        }
+        if (success) {
+            src += delta->hdrsize;
+            BYTE* bits = &dst[delta->hdrsize];
+            SIZE_T stride = getBMPStride(bmp);
+            for (DWORD i = 0; success && i < delta->ntiles; i++) {
+                DWORD index;
+                success = (sizeof(index) <= (SIZE_T)(end-src));
+                if (!success) break;
+                CopyMemory(&index, src, sizeof(index));
+                src += sizeof(index);
+                SIZE_T offset = 0;
+                DWORD rowbytes = 0, nrows = 0;
+                if (index < ntiles) {
+                    getTileGeometry(bmp, index, &offset, &rowbytes, &nrows);
+                }
+                success = (index < ntiles && 
+                           (SIZE_T)rowbytes*nrows <= (SIZE_T)(end-src));
+                for (DWORD y = 0; success && y < nrows; y++) {
+                    CopyMemory(&bits[offset+y*stride], src, rowbytes);
+                    src += rowbytes;
+                }
+                if (success) {
+                    hashes[index] = getTileHash(&bits[offset], stride, 
+                                                rowbytes, nrows);
+                }
+            }
+            success = (success &&
+                       getImageHash(hashes, ntiles) == delta->image_hash);
+        }
+        GlobalUnlock(data);
+    }
+    if (hashes != NULL) {
+        free(hashes);
+    }
+    if (logfp != NULL) {
+        fwprintf(logfp, L"delta: path=%s, keyframe=%08x, ntiles=%u, success=%d\n",
+                 path, delta->keyframe_id, delta->ntiles, success);
+    }
+    if (!success) {
+        GlobalFree(data);
+        data = NULL;
+    }
+    return data;
+}
+
+// openClipFile(arena)
+static BOOL openClipFile(Arena* arena)
+{
+    const LPCWSTR OP_OPEN = L"open";
+
+    BOOL success = FALSE;
+
+    // Try opening CF_UNICODETEXT.
+    HANDLE data = GetClipboardData(CF_UNICODETEXT);
+    if (data != NULL) {
+        LPWSTR src = (LPWSTR) GlobalLock(data);
+        if (src != NULL) {
+            SIZE_T nbytes = sizeof(WCHAR)*(wcslen(src)+1);
+            LPWSTR text = (LPWSTR) allocArena(arena, nbytes);
+            if (text != NULL) {
+                CopyMemory(text, src, nbytes);
+                rmspace(text);
+                if (istartswith(text, L"http://") ||
+                    istartswith(text, L"https://")) {
+                    if (logfp != NULL) {
+                        fwprintf(logfp, L"open: url=%s\n", text);
+                    }
+                    ShellExecute(NULL, OP_OPEN, text, NULL, NULL, SW_SHOWDEFAULT);
+                    success = TRUE;
+                }
+            }
+            GlobalUnlock(data);
+        }
+    }
+    if (success) return success;
+
+    // Try opening CF_ORIGIN.
+    data = GetClipboardData(CF_ORIGIN);
+    if (data != NULL) {
+        LPWSTR path = (LPWSTR) GlobalLock(data);
+        if (path != NULL) {
+            if (logfp != NULL) {
+                fwprintf(logfp, L"open: path=%s\n", path);
+            }
+            ShellExecute(NULL, OP_OPEN, path, NULL, NULL, SW_SHOWDEFAULT);
+            success = TRUE;
+            GlobalUnlock(data);
+        }
+    }
+    if (success) return success;
+
+    return FALSE;
+}
+
+//  Trace
+//  The events are recorded so that the sync decisions can be
+//  replayed later by replayTrace() without the clipboard and the
+//  shared folder.
+
+// openTrace(watcher, path)
+static BOOL openTrace(ClipWatcher* watcher, LPCWSTR path)
+{
+    FILE* fp = _wfopen(path, L"wb");
+    if (fp == NULL) return FALSE;
+    TraceHeader hdr;
+    ZeroMemory(&hdr, sizeof(hdr));
+    hdr.signature = TRACE_SIGNATURE;
+    hdr.version = TRACE_VERSION;
+    StringCchCopy(hdr.name, _countof(hdr.name), watcher->name);
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    watcher->trace = fp;
+    watcher->trace_start = GetTickCount();
+    return TRUE;
+}
+
+// traceEvent(watcher, type, path, nbytes, clock, hash)
+//   Only the file name of path is recorded. path can be NULL.
+static void traceEvent(ClipWatcher* watcher, WORD type, LPCWSTR path,
+                       ULONGLONG nbytes, ULONGLONG clock, DWORD hash)
+{
+    if (watcher->trace == NULL) return;
+    TraceRecord rec;
+    ZeroMemory(&rec, sizeof(rec));
+    rec.type = type;
+    rec.time = GetTickCount() - watcher->trace_start;
+    rec.nbytes = nbytes;
+    rec.clock = clock;
+    rec.hash = hash;
+    LPCWSTR name = NULL;
+    if (path != NULL) {
+        name = &(path[rindex(path, L'\\')+1]);
+        rec.namelen = (WORD)min(wcslen(name), MAX_PATH-1);
+    }
+    fwrite(&rec, sizeof(rec), 1, watcher->trace);
+    if (name != NULL) {
+        fwrite(name, sizeof(WCHAR), rec.namelen, watcher->trace);
+    }
+    // A scan is written at once when it is done.
+    if (type != TRACE_FILE) {
+        fflush(watcher->trace);
+    }
+}
+
+// traceExportFile(watcher, basepath, ext, bytes, nbytes)
+//   Records a file exported with the fingerprint of the clipboard data.
+static void traceExportFile(ClipWatcher* watcher, LPCWSTR basepath, 
+                            LPCWSTR ext, const BYTE* bytes, SIZE_T nbytes)
+{
+    if (watcher->trace == NULL) return;
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s%s", basepath, ext);
+    traceEvent(watcher, TRACE_WRITE, path, nbytes, watcher->clip_clock,
+               getAdler32(bytes, nbytes));
+}
+
+//  Latency
+//  With latency tracing, each export writes NAME.stm with the time
+//  of the copy by the clock of the shared folder, and the pushes
+//  carry the same stamp. A host which imports the clip counts the
+//  delay since the copy for each host and path. The clock of the
+//  folder is sampled from the time the file server gives NAME.stm.
+
+// getPreciseTime()
+//   Returns the system time with a sub-millisecond resolution
+//   where the system provides it.
+static ULONGLONG getPreciseTime()
+{
+    typedef VOID (WINAPI *GetTimeProc)(LPFILETIME);
+    static GetTimeProc proc = NULL;
+    static BOOL loaded = FALSE;
+    if (!loaded) {
+        // Windows 8 or later.
+        proc = (GetTimeProc) GetProcAddress(GetModuleHandle(L"kernel32.dll"),
+                                            "GetSystemTimePreciseAsFileTime");
+        loaded = TRUE;
+    }
+    FILETIME ft;
+    if (proc != NULL) {
+        proc(&ft);
+    } else {
+        GetSystemTimeAsFileTime(&ft);
+    }
+    return getFileTimeValue(&ft);
+}
+
+// updateShareOffset(watcher, t0, t1, server)
+//   Takes a sample of the clock of the shared folder read between
+//   t0 and t1. A sample with a shorter round trip is more accurate.
+static void updateShareOffset(ClipWatcher* watcher, 
+                              ULONGLONG t0, ULONGLONG t1, ULONGLONG server)
+{
+    ULONGLONG rtt = t1-t0;
+    LONGLONG offset = (LONGLONG)(server - (t0+rtt/2));
+    if (watcher->share_rtt == 0 || rtt <= watcher->share_rtt) {
+        watcher->share_offset = offset;
+        watcher->share_rtt = max(rtt, 1);
+    } else {
+        // Let a slower path replace the estimate eventually.
+        watcher->share_rtt += (rtt - watcher->share_rtt)/8 + 1;
+    }
+    if (logfp != NULL) {
+        fwprintf(logfp, L"share clock: offset=%I64d, rtt=%I64u, "
+                 L"estimate=%I64d\n", 
+                 offset, rtt, watcher->share_offset);
+    }
+}
+
+// setOriginStamp(watcher, clock)
+//   Makes the stamp of the clip being exported. It is sent with
+//   the pushes and the local ring, and written to NAME.stm.
+static void setOriginStamp(ClipWatcher* watcher, ULONGLONG clock)
+{
+    OriginStamp* stamp = &(watcher->stamp);
+    stamp->signature = STAMP_SIGNATURE;
+    stamp->seqno = watcher->seqno;
+    stamp->clock = clock;
+    stamp->origin = watcher->copy_time + watcher->share_offset;
+}
+
+// writeStampFile(path, stamp, &t0, &t1, &server)
+//   Writes the stamp and reads the time the server gave the file
+//   between t0 and t1.
+static BOOL writeStampFile(LPCWSTR path, const OriginStamp* stamp,
+                           ULONGLONG* pt0, ULONGLONG* pt1, 
+                           ULONGLONG* pserver)
+{
+    *pt0 = getPreciseTime();
+    HANDLE fp = CreateFile(path, GENERIC_WRITE, 0,
+                           NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 
+                           NULL);
+    if (fp == INVALID_HANDLE_VALUE) return FALSE;
+    DWORD writtenbytes;
+    WriteFile(fp, stamp, sizeof(*stamp), &writtenbytes, NULL);
+    CloseHandle(fp);
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (!GetFileAttributesEx(path, GetFileExInfoStandard, &attrs)) {
+        return FALSE;
+    }
+    *pt1 = getPreciseTime();
+    *pserver = getFileTimeValue(&(attrs.ftLastWriteTime));
+    return TRUE;
+}
+
+// writeOriginStamp(watcher)
+//   Writes a stamp with no clip and samples the clock of the shared
+//   folder. This waits for the folder and is only done at the start.
+static void writeOriginStamp(ClipWatcher* watcher)
+{
+    setOriginStamp(watcher, 0);
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s\\%s%s", 
+                    watcher->dstdir, watcher->name, FILE_EXT_STAMP);
+    ULONGLONG t0, t1, server;
+    if (writeStampFile(path, &(watcher->stamp), &t0, &t1, &server)) {
+        updateShareOffset(watcher, t0, t1, server);
+    }
+}
+
+// stampWorker(param)
+//   Writes the latest stamp queued until the writer is stopped.
+static DWORD WINAPI stampWorker(LPVOID param)
+{
+    StampWriter* writer = (StampWriter*)param;
+    for (;;) {
+        EnterCriticalSection(&(writer->lock));
+        BOOL queued = writer->queued;
+        OriginStamp stamp = writer->stamp;
+        writer->queued = FALSE;
+        LeaveCriticalSection(&(writer->lock));
+        if (!queued) {
+            // The last stamp is written before quitting.
+            if (writer->quit) break;
+            WaitForSingleObject(writer->event, INFINITE);
+            continue;
+        }
+        ULONGLONG t0, t1, server;
+        if (writeStampFile(writer->path, &stamp, &t0, &t1, &server)) {
+            EnterCriticalSection(&(writer->lock));
+            writer->t0 = t0;
+            writer->t1 = t1;
+            writer->server = server;
+            writer->sampled = TRUE;
+            LeaveCriticalSection(&(writer->lock));
+            PostMessage(writer->hWnd, WM_NOTIFY_STAMP, 0, 0);
+        }
+    }
+    return 0;
+}
+
+// queueOriginStamp(watcher, hWnd)
+//   Has the current stamp written by stampWorker(). A stamp which
+//   has not been written yet is replaced.
+static void queueOriginStamp(ClipWatcher* watcher, HWND hWnd)
+{
+    StampWriter* writer = watcher->stamper;
+    if (writer == NULL) {
+        writer = (StampWriter*) malloc(sizeof(StampWriter));
+        if (writer == NULL) return;
+        ZeroMemory(writer, sizeof(*writer));
+        writer->hWnd = hWnd;
+        StringCchPrintf(writer->path, _countof(writer->path), L"%s\\%s%s", 
+                        watcher->dstdir, watcher->name, FILE_EXT_STAMP);
+        writer->event = CreateEvent(NULL, FALSE, FALSE, NULL);
+        InitializeCriticalSection(&(writer->lock));
+        writer->thread = CreateThread(NULL, 0, stampWorker, writer, 
+                                      0, NULL);
+        if (writer->event == NULL || writer->thread == NULL) {
+            if (writer->thread != NULL) {
+                CloseHandle(writer->thread);
+            }
+            if (writer->event != NULL) {
+                CloseHandle(writer->event);
+            }
+            DeleteCriticalSection(&(writer->lock));
+            free(writer);
+            return;
+        }
+        watcher->stamper = writer;
+    }
+    EnterCriticalSection(&(writer->lock));
+    writer->stamp = watcher->stamp;
+    writer->queued = TRUE;
+    LeaveCriticalSection(&(writer->lock));
+    SetEvent(writer->event);
+}
+
+// takeStampSample(watcher)
+//   Takes the sample of the clock of the shared folder made by
+//   stampWorker().
+static void takeStampSample(ClipWatcher* watcher)
+{
+    StampWriter* writer = watcher->stamper;
+    if (writer == NULL) return;
+    EnterCriticalSection(&(writer->lock));
+    BOOL sampled = writer->sampled;
+    ULONGLONG t0 = writer->t0;
+    ULONGLONG t1 = writer->t1;
+    ULONGLONG server = writer->server;
+    writer->sampled = FALSE;
+    LeaveCriticalSection(&(writer->lock));
+    if (sampled) {
+        updateShareOffset(watcher, t0, t1, server);
+    }
+}
+
+// stopStampWriter(watcher)
+//   Waits until the queued stamp is written.
+static void stopStampWriter(ClipWatcher* watcher)
+{
+    StampWriter* writer = watcher->stamper;
+    if (writer == NULL) return;
+    InterlockedExchange(&(writer->quit), 1);
+    SetEvent(writer->event);
+    WaitForSingleObject(writer->thread, INFINITE);
+    CloseHandle(writer->thread);
+    CloseHandle(writer->event);
+    DeleteCriticalSection(&(writer->lock));
+    free(writer);
+    watcher->stamper = NULL;
+}
+
+// getLatencyBucket(usec)
+//   Bucket i holds the delays from 2^i to 2^(i+1) usec.
+static int getLatencyBucket(ULONGLONG usec)
+{
+    int i = 0;
+    while (i+1 < LATENCY_NBUCKETS && (2ULL << i) <= usec) {
+        i++;
+    }
+    return i;
+}
+
+// getLatencyPercentile(peer, percent)
+//   Returns the upper bound (usec) of the bucket with the percentile.
+static ULONGLONG getLatencyPercentile(const LatencyPeer* peer, DWORD percent)
+{
+    DWORD rank = (peer->nsamples*percent+99)/100;
+    DWORD n = 0;
+    for (int i = 0; i < LATENCY_NBUCKETS; i++) {
+        n += peer->counts[i];
+        if (rank <= n) return (2ULL << i);
+    }
+    return 0;
+}
+
+// dumpLatency(watcher)
+//   Writes the histograms to %TEMP%\ClipWatcherLatency.txt.
+static void dumpLatency(ClipWatcher* watcher)
+{
+    watcher->latency_dump = GetTickCount();
+    WCHAR path[MAX_PATH];
+    GetTempPath(_countof(path), path);
+    StringCchCat(path, _countof(path), L"ClipWatcherLatency.txt");
+    FILE* fp = _wfopen(path, L"w");
+    if (fp == NULL) return;
+    fwprintf(fp, L"# %s: share offset=%I64dus, rtt=%I64uus\n", 
+             watcher->name, watcher->share_offset/10, watcher->share_rtt/10);
+    for (LatencyPeer* peer = watcher->latency_peers; 
+         peer != NULL; peer = peer->next) {
+        fwprintf(fp, L"%s\t%s\tn=%u\tskewed=%u\tmean=%I64uus\t"
+                 L"p50<%I64uus\tp99<%I64uus\n",
+                 peer->host, LATENCY_VIA[peer->via], 
+                 peer->nsamples, peer->nskewed, 
+                 peer->sum/max(peer->nsamples-peer->nskewed, 1),
+                 getLatencyPercentile(peer, 50), 
+                 getLatencyPercentile(peer, 99));
+        for (int i = 0; i < LATENCY_NBUCKETS; i++) {
+            if (peer->counts[i] != 0) {
+                fwprintf(fp, L"\t<%I64uus\t%u\n", 
+                         (2ULL << i), peer->counts[i]);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+// freeLatencyPeers(peer)
+static void freeLatencyPeers(LatencyPeer* peer)
+{
+    while (peer != NULL) {
+        LatencyPeer* next = peer->next;
+        free(peer);
+        peer = next;
+    }
+}
+
+// getLatencyPeer(watcher, host, via)
+static LatencyPeer* getLatencyPeer(ClipWatcher* watcher, LPCWSTR host, 
+                                   int via)
+{
+    LatencyPeer* peer = watcher->latency_peers;
+    while (peer != NULL && 
+           (peer->via != via || _wcsicmp(peer->host, host) != 0)) {
+        peer = peer->next;
+    }
+    if (peer == NULL) {
+        peer = (LatencyPeer*) malloc(sizeof(LatencyPeer));
+        if (peer == NULL) return NULL;
+        ZeroMemory(peer, sizeof(*peer));
+        StringCchCopy(peer->host, _countof(peer->host), host);
+        peer->via = via;
+        peer->next = watcher->latency_peers;
+        watcher->latency_peers = peer;
+    }
+    return peer;
+}
+
+// recordLatency(watcher, host, via, stamp, taken)
+//   Counts the delay from the copy on the host to the time it was
+//   taken here, once per copy.
+static void recordLatency(ClipWatcher* watcher, LPCWSTR host, int via,
+                          const OriginStamp* stamp, ULONGLONG taken)
+{
+    if (stamp->signature != STAMP_SIGNATURE || stamp->clock == 0) return;
+    LatencyPeer* peer = getLatencyPeer(watcher, host, via);
+    if (peer == NULL) return;
+    if (peer->clock == stamp->clock) return;
+    peer->clock = stamp->clock;
+
+    LONGLONG delay = ((LONGLONG)(taken + watcher->share_offset - 
+                                 stamp->origin)) / 10;
+    if (delay < 0) {
+        // The clocks are off by more than the delay.
+        peer->nskewed++;
+        peer->counts[0]++;
+    } else {
+        peer->sum += delay;
+        peer->counts[getLatencyBucket(delay)]++;
+    }
+    peer->nsamples++;
+    if (logfp != NULL) {
+        fwprintf(logfp, L"latency: host=%s, via=%s, seqno=%u, delay=%I64dus\n",
+                 host, LATENCY_VIA[via], stamp->seqno, delay);
+    }
+    if (LATENCY_DUMP_INTERVAL <= GetTickCount()-watcher->latency_dump) {
+        dumpLatency(watcher);
+    }
+}
+
+// readOriginStamp(path, stamp)
+static BOOL readOriginStamp(LPCWSTR path, OriginStamp* stamp)
+{
+    HANDLE fp = CreateFile(path, GENERIC_READ, 
+                           FILE_SHARE_READ | FILE_SHARE_WRITE,
+                           NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                           NULL);
+    if (fp == INVALID_HANDLE_VALUE) return FALSE;
+    DWORD readbytes;
+    BOOL success = (ReadFile(fp, stamp, sizeof(*stamp), &readbytes, NULL) &&
+                    readbytes == sizeof(*stamp));
+    CloseHandle(fp);
+    return success;
+}
+
+// recordFileLatency(watcher, path, clock)
+//   Reads the stamp of the host of a clip imported from the folder.
+//   The stamp is written in the background, so it may come after
+//   the clip; the copy is then counted by checkPendingLatency().
+static void recordFileLatency(ClipWatcher* watcher, LPCWSTR path, 
+                              ULONGLONG clock)
+{
+    ULONGLONG taken = getPreciseTime();
+    // DIR\HOST.ext -> DIR\HOST.stm
+    WCHAR stamppath[MAX_PATH];
+    StringCchCopy(stamppath, _countof(stamppath), path);
+    int index = rindex(stamppath, L'.');
+    if (index < 0) return;
+    stamppath[index] = L'\0';
+    StringCchCat(stamppath, _countof(stamppath), FILE_EXT_STAMP);
+
+    WCHAR host[MAX_PATH];
+    getClipHost(path, host, _countof(host));
+    OriginStamp stamp;
+    BOOL success = readOriginStamp(stamppath, &stamp);
+    if (success && stamp.clock == clock) {
+        recordLatency(watcher, host, LATENCY_FILE, &stamp, taken);
+    } else if (!success || stamp.clock < clock) {
+        // A stamp newer than the clip is for a copy not seen yet.
+        LatencyPeer* peer = getLatencyPeer(watcher, host, LATENCY_FILE);
+        if (peer != NULL) {
+            peer->pending = clock;
+            peer->pending_time = taken;
+        }
+    }
+}
+
+// checkPendingLatency(watcher)
+//   Counts the copies taken from the folder before their stamps
+//   were written, once the stamps are there.
+static void checkPendingLatency(ClipWatcher* watcher)
+{
+    for (LatencyPeer* peer = watcher->latency_peers; 
+         peer != NULL; peer = peer->next) {
+        if (peer->pending == 0) continue;
+        WCHAR path[MAX_PATH];
+        StringCchPrintf(path, _countof(path), L"%s\\%s%s", 
+                        watcher->srcdir, peer->host, FILE_EXT_STAMP);
+        OriginStamp stamp;
+        if (!readOriginStamp(path, &stamp) || 
+            stamp.clock < peer->pending) continue;
+        if (stamp.clock == peer->pending) {
+            recordLatency(watcher, peer->host, peer->via, &stamp, 
+                          peer->pending_time);
+        }
+        peer->pending = 0;
+    }
+}
+
+//  Local ring
+//  Instances on the same machine (e.g. the sessions of a terminal
+//  server) exchange the clips through a ring buffer in a shared file
+//  mapping. Each record is written once and read by every other
+//  instance with its own cursor; a reader which falls behind by more
+//  than the capacity loses the records. The ring functions only touch
+//  the memory so that they can be used with any shared memory.
+
+// initRing(hdr, capacity)
+static void initRing(RingHeader* hdr, DWORD capacity)
+{
+    ZeroMemory(hdr, sizeof(*hdr));
+    hdr->signature = RING_SIGNATURE;
+    hdr->capacity = capacity;
+    hdr->head = 0;
+}
+
+// copyToRing(hdr, capacity, pos, src, n)
+//   The capacity is our own; the one in the header is only checked
+//   when the ring is opened, since any process can change it.
+static void copyToRing(RingHeader* hdr, DWORD capacity, ULONGLONG pos, 
+                       const void* src, SIZE_T n)
+{
+    BYTE* data = (BYTE*)(hdr+1);
+    SIZE_T offset = (SIZE_T)(pos % capacity);
+    SIZE_T n1 = min(n, capacity-offset);
+    CopyMemory(&data[offset], src, n1);
+    CopyMemory(data, &((const BYTE*)src)[n1], n-n1);
+}
+
+// copyFromRing(hdr, capacity, pos, dst, n)
+static void copyFromRing(const RingHeader* hdr, DWORD capacity, ULONGLONG pos, 
+                         void* dst, SIZE_T n)
+{
+    const BYTE* data = (const BYTE*)(hdr+1);
+    SIZE_T offset = (SIZE_T)(pos % capacity);
+    SIZE_T n1 = min(n, capacity-offset);
+    CopyMemory(dst, &data[offset], n1);
+    CopyMemory(&((BYTE*)dst)[n1], data, n-n1);
+}
+
+// putRingRecord(hdr, capacity, rec, head, nhead, body, nbody)
+//   Appends a record. The caller must hold the lock.
+static BOOL putRingRecord(RingHeader* hdr, DWORD capacity, RingRecord* rec, 
+                          LPCVOID head, DWORD nhead,
+                          LPCVOID body, SIZE_T nbody)
+{
+    SIZE_T nbytes = (sizeof(*rec)+nhead+nbody+7) & ~(SIZE_T)7;
+    if (capacity < nbytes) return FALSE;
+    rec->nbytes = (DWORD)nbytes;
+    rec->ndata = (DWORD)(nhead+nbody);
+    ULONGLONG pos = hdr->head;
+    copyToRing(hdr, capacity, pos, rec, sizeof(*rec));
+    copyToRing(hdr, capacity, pos+sizeof(*rec), head, nhead);
+    copyToRing(hdr, capacity, pos+sizeof(*rec)+nhead, body, nbody);
+    hdr->head = pos+nbytes;
+    return TRUE;
+}
+
+// getRingRecord(hdr, capacity, &cursor, rec, &data)
+//   Reads the record at the cursor and advances it. The caller must
+//   hold the lock and free the data. Returns FALSE if there is no more.
+//   The head and the record are read once and checked against our
+//   capacity, so a broken ring only loses its records.
+static BOOL getRingRecord(const RingHeader* hdr, DWORD capacity, 
+                          ULONGLONG* pcursor, RingRecord* rec, BYTE** pdata)
+{
+    ULONGLONG head = hdr->head;
+    ULONGLONG avail = head - *pcursor;
+    if (avail == 0) return FALSE;
+    if (capacity < avail || avail < sizeof(*rec)) {
+        // Overwritten: skip to the latest.
+        *pcursor = head;
+        return FALSE;
+    }
+    copyFromRing(hdr, capacity, *pcursor, rec, sizeof(*rec));
+    if (rec->nbytes < sizeof(*rec)+rec->ndata || avail < rec->nbytes) {
+        *pcursor = head;
+        return FALSE;
+    }
+    rec->name[_countof(rec->name)-1] = L'\0';
+    *pdata = (BYTE*) malloc(max(rec->ndata, 1));
+    if (*pdata != NULL) {
+        copyFromRing(hdr, capacity, *pcursor+sizeof(*rec), *pdata, rec->ndata);
+    }
+    *pcursor += rec->nbytes;
+    return TRUE;
+}
+
+// isProcessAlive(pid)
+static BOOL isProcessAlive(DWORD pid)
+{
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, pid);
+    if (process == NULL) {
+        // Access denied means it exists in another session.
+        return (GetLastError() != ERROR_INVALID_PARAMETER);
+    }
+    DWORD obj = WaitForSingleObject(process, 0);
+    CloseHandle(process);
+    return (obj == WAIT_TIMEOUT);
+}
+
+// closeLocalRing(ring)
+static void closeLocalRing(LocalRing* ring)
+{
+    if (ring->header != NULL) {
+        if (0 <= ring->slot &&
+            WaitForSingleObject(ring->mutex, INFINITE) != WAIT_FAILED) {
+            ring->header->readers[ring->slot] = 0;
+            ReleaseMutex(ring->mutex);
+        }
+        UnmapViewOfFile(ring->header);
+    }
+    if (ring->mapping != NULL) {
+        CloseHandle(ring->mapping);
+    }
+    if (ring->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(ring->file);
+    }
+    if (ring->event != NULL) {
+        CloseHandle(ring->event);
+    }
+    if (ring->mutex != NULL) {
+        CloseHandle(ring->mutex);
+    }
+    free(ring);
+}
+
+// openLocalRing(srcdir)
+//   Opens the ring shared by the instances watching the same folder.
+static LocalRing* openLocalRing(LPCWSTR srcdir)
+{
+    LocalRing* ring = (LocalRing*) malloc(sizeof(LocalRing));
+    if (ring == NULL) return NULL;
+    ring->file = INVALID_HANDLE_VALUE;
+    ring->mapping = NULL;
+    ring->header = NULL;
+    ring->mutex = NULL;
+    ring->event = NULL;
+    ring->slot = -1;
+    ring->cursor = 0;
+    ring->capacity = RING_SIZE;
+
+    // The objects are named after the folder.
+    WCHAR key[MAX_PATH];
+    StringCchCopy(key, _countof(key), srcdir);
+    _wcsupr(key);
+    DWORD hash = getAdler32((const BYTE*)key, sizeof(WCHAR)*wcslen(key));
+    StringCchPrintf(ring->prefix, _countof(ring->prefix), 
+                    L"Global\\ClipWatcher-%08x", hash);
+
+    // Every user on the machine can open them.
+    WCHAR name[MAX_PATH];
+    RingHeader* hdr;
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = FALSE;
+    sa.lpSecurityDescriptor = NULL;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptor(
+            RING_SDDL, SDDL_REVISION_1, &(sa.lpSecurityDescriptor), NULL)) {
+        goto fail;
+    }
+
+    StringCchPrintf(name, _countof(name), L"%s-lock", ring->prefix);
+    ring->mutex = CreateMutex(&sa, FALSE, name);
+    if (ring->mutex == NULL) goto fail;
+
+    // The mapping is backed by a file so that creating it does not
+    // need the privilege to create global objects.
+    SHGetFolderPath(NULL, CSIDL_COMMON_APPDATA, NULL, SHGFP_TYPE_CURRENT, 
+                    ring->spilldir);
+    StringCchCat(ring->spilldir, _countof(ring->spilldir), L"\\ClipWatcher");
+    CreateDirectory(ring->spilldir, &sa);
+    StringCchPrintf(name, _countof(name), L"%s\\ring-%08x.bin", 
+                    ring->spilldir, hash);
+    ring->file = CreateFile(name, GENERIC_READ | GENERIC_WRITE, 
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            &sa, OPEN_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, 
+                            NULL);
+    if (ring->file == INVALID_HANDLE_VALUE) goto fail;
+    ring->mapping = CreateFileMapping(ring->file, NULL, PAGE_READWRITE, 
+                                      0, sizeof(RingHeader)+RING_SIZE, NULL);
+    if (ring->mapping == NULL) goto fail;
+    ring->header = (RingHeader*) MapViewOfFile(
+        ring->mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(RingHeader)+RING_SIZE);
+    if (ring->header == NULL) goto fail;
+
+    if (WaitForSingleObject(ring->mutex, INFINITE) == WAIT_FAILED) goto fail;
+    hdr = ring->header;
+    if (hdr->signature != RING_SIGNATURE) {
+        initRing(hdr, RING_SIZE);
+    }
+    if (hdr->capacity == ring->capacity) {
+        // Take a free slot, or one left by a dead process.
+        for (int i = 0; i < RING_MAX_READERS; i++) {
+            if (hdr->readers[i] == 0 || !isProcessAlive(hdr->readers[i])) {
+                hdr->readers[i] = GetCurrentProcessId();
+                ring->slot = i;
+                break;
+            }
+        }
+    }
+    ring->cursor = hdr->head;
+    ReleaseMutex(ring->mutex);
+    if (ring->slot < 0) goto fail;
+
+    StringCchPrintf(name, _countof(name), L"%s-%d", ring->prefix, ring->slot);
+    ring->event = CreateEvent(&sa, FALSE, FALSE, name);
+    if (ring->event == NULL) goto fail;
+
+    if (logfp != NULL) {
+        fwprintf(logfp, L"ring: prefix=%s, slot=%d\n", ring->prefix, ring->slot);
+    }
+    LocalFree(sa.lpSecurityDescriptor);
+    return ring;
+
+fail:
+    if (logfp != NULL) {
+        fwprintf(logfp, L"ring: failed, error=%u\n", GetLastError());
+    }
+    if (sa.lpSecurityDescriptor != NULL) {
+        LocalFree(sa.lpSecurityDescriptor);
+    }
+    closeLocalRing(ring);
+    return NULL;
+}
+
+// putLocalRing(watcher, rec, head, nhead, body, nbody)
+//   Puts a record to the ring and wakes up the other instances.
+static BOOL putLocalRing(ClipWatcher* watcher, RingRecord* rec, 
+                         LPCVOID head, DWORD nhead,
+                         LPCVOID body, SIZE_T nbody)
+{
+    LocalRing* ring = watcher->ring;
+    if (ring == NULL) return FALSE;
+    DWORD readers[RING_MAX_READERS];
+    if (WaitForSingleObject(ring->mutex, INFINITE) == WAIT_FAILED) return FALSE;
+    BOOL success = putRingRecord(ring->header, ring->capacity, rec, 
+                                 head, nhead, body, nbody);
+    CopyMemory(readers, ring->header->readers, sizeof(readers));
+    ReleaseMutex(ring->mutex);
+    if (logfp != NULL) {
+        fwprintf(logfp, L"ring: name=%s, nbytes=%Iu, spilled=%d, success=%d\n", 
+                 rec->name, nhead+nbody, rec->spilled, success);
+    }
+
+    // Wake up the others.
+    for (int i = 0; success && i < RING_MAX_READERS; i++) {
+        if (readers[i] != 0 && i != ring->slot) {
+            WCHAR evname[MAX_PATH];
+            StringCchPrintf(evname, _countof(evname), L"%s-%d", ring->prefix, i);
+            HANDLE event = OpenEvent(EVENT_MODIFY_STATE, FALSE, evname);
+            if (event != NULL) {
+                SetEvent(event);
+                CloseHandle(event);
+            }
+        }
+    }
+    return success;
+}
+
+// publishLocalRing(watcher, name, head, nhead, body, nbody)
+//   Sends a clip file to the other instances on this machine.
+//   A large one is written to a spill file like the shared folder,
+//   and its name is sent when the file is complete.
+static void publishLocalRing(ClipWatcher* watcher, LPCWSTR name,
+                             LPCVOID head, DWORD nhead,
+                             LPCVOID body, SIZE_T nbody)
+{
+    LocalRing* ring = watcher->ring;
+    RingRecord rec = {0};
+    rec.sender = GetCurrentProcessId();
+    rec.clock = watcher->clip_clock;
+    StringCchCopy(rec.name, _countof(rec.name), name);
+    rec.stamp = watcher->stamp;
+    if (nhead+nbody <= RING_MAX_PAYLOAD) {
+        putLocalRing(watcher, &rec, head, nhead, body, nbody);
+        return;
+    }
+
+    WCHAR spillname[MAX_PATH];
+    StringCchPrintf(spillname, _countof(spillname), L"%u-%s", 
+                    rec.sender, name);
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s\\%s", 
+                    ring->spilldir, spillname);
+    rec.spilled = TRUE;
+    RingRecord* spill = (RingRecord*) malloc(sizeof(RingRecord));
+    if (spill == NULL) return;
+    *spill = rec;
+    WriteJob* job = queueWriteJob(watcher, path, rec.clock, 
+                                  head, nhead, body, nbody, FALSE);
+    if (job != NULL) {
+        job->record = spill;
+    } else {
+        writeBytes(path, rec.clock, head, nhead, body, nbody);
+        putLocalRing(watcher, spill, NULL, 0, 
+                     spillname, sizeof(WCHAR)*(wcslen(spillname)+1));
+        free(spill);
+    }
+}
+
+// publishLocalText(watcher, text, nchars)
+//   The local ring always carries the whole text, never a delta.
+static void publishLocalText(ClipWatcher* watcher, LPCWSTR text, int nchars)
+{
+    int nbytes;
+    LPSTR bytes = getCHARfromWCHAR(&(watcher->arena), text, nchars, &nbytes);
+    if (bytes != NULL) {
+        WCHAR name[MAX_PATH];
+        StringCchPrintf(name, _countof(name), L"%s%s", 
+                        watcher->name, FILE_EXT_TEXT);
+        publishLocalRing(watcher, name, NULL, 0, bytes, nbytes);
+    }
+}
+
+// publishLocalDIB(watcher, bytes, nbytes)
+static void publishLocalDIB(ClipWatcher* watcher, LPVOID bytes, SIZE_T nbytes)
+{
+    BITMAPFILEHEADER filehdr = {0};
+    filehdr.bfType = BMP_SIGNATURE;
+    filehdr.bfSize = sizeof(filehdr)+nbytes;
+    filehdr.bfOffBits = sizeof(filehdr)+getBMPHeaderSize((BITMAPINFO*)bytes);
+    WCHAR name[MAX_PATH];
+    StringCchPrintf(name, _countof(name), L"%s%s", 
+                    watcher->name, FILE_EXT_BITMAP);
+    publishLocalRing(watcher, name, &filehdr, sizeof(filehdr), bytes, nbytes);
+}
+
+//  File drop
+//  The files copied in the Explorer (CF_HDROP) are staged in the
+//  shared folder by a thread before NAME.lst is published. A file
+//  is copied and hashed in chunks by several threads; the chunks
+//  of a partial copy which still match their digests are kept, and
+//  a file staged before is not read again. The staged files which
+//  no NAME.lst refers to any more are removed after a while.
+
+// readChunk(fp, offset, buf, n)
+static BOOL readChunk(HANDLE fp, ULONGLONG offset, BYTE* buf, DWORD n)
+{
+    OVERLAPPED ov = {0};
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD readbytes;
+    return (ReadFile(fp, buf, n, &readbytes, &ov) && readbytes == n);
+}
+
+// writeChunk(fp, offset, buf, n)
+static BOOL writeChunk(HANDLE fp, ULONGLONG offset, const BYTE* buf, DWORD n)
+{
+    OVERLAPPED ov = {0};
+    ov.Offset = (DWORD)offset;
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD writtenbytes;
+    return (WriteFile(fp, buf, n, &writtenbytes, &ov) && writtenbytes == n);
+}
+
+// getSHA256(prov, bytes, nbytes, digest)
+static BOOL getSHA256(HCRYPTPROV prov, const BYTE* bytes, DWORD nbytes, 
+                      BYTE* digest)
+{
+    HCRYPTHASH hash;
+    if (!CryptCreateHash(prov, CALG_SHA_256, 0, 0, &hash)) return FALSE;
+    DWORD ndigest = SHA256_SIZE;
+    BOOL success = (CryptHashData(hash, bytes, nbytes, 0) &&
+                    CryptGetHashParam(hash, HP_HASHVAL, digest, &ndigest, 0));
+    CryptDestroyHash(hash);
+    return success;
+}
+
+// chunkWorker(param)
+//   Copies the chunks which are not in dstpath yet, and records the
+//   state of each chunk after the content so that a copy interrupted
+//   is resumed from the chunks it has. A chunk from an earlier attempt
+//   is kept only if its data still matches its digest.
+static DWORD WINAPI chunkWorker(LPVOID param)
+{
+    ChunkCopy* copy = (ChunkCopy*)param;
+    HANDLE src = CreateFile(copy->srcpath, GENERIC_READ, 
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            NULL);
+    HANDLE dst = CreateFile(copy->dstpath, GENERIC_READ | GENERIC_WRITE, 
+                            FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            NULL);
+    BYTE* buf = (BYTE*) allocBuffer(copy->pool, copy->chunksize);
+    HCRYPTPROV prov = 0;
+    if (src == INVALID_HANDLE_VALUE || dst == INVALID_HANDLE_VALUE ||
+        buf == NULL ||
+        !CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_AES, 
+                             CRYPT_VERIFYCONTEXT)) {
+        InterlockedExchange(&(copy->failed), 1);
+    }
+
+    while (!copy->failed && !*(copy->cancel)) {
+        LONG i = InterlockedIncrement(&(copy->next))-1;
+        if (copy->nchunks <= (DWORD)i) break;
+        ULONGLONG offset = (ULONGLONG)i * copy->chunksize;
+        DWORD n = (DWORD)min(copy->nbytes-offset, copy->chunksize);
+        ChunkState state = {0};
+        if (copy->states[i].done &&
+            readChunk(dst, offset, buf, n) &&
+            getSHA256(prov, buf, n, state.digest) &&
+            memcmp(state.digest, copy->states[i].digest, SHA256_SIZE) == 0) {
+            continue;
+        }
+        if (!readChunk(src, offset, buf, n) ||
+            !getSHA256(prov, buf, n, state.digest)) {
+            InterlockedExchange(&(copy->failed), 1);
+            break;
+        }
+        state.done = TRUE;
+        if (!writeChunk(dst, offset, buf, n) ||
+            !writeChunk(dst, copy->nbytes+sizeof(state)*i, 
+                        (const BYTE*)&state, sizeof(state))) {
+            InterlockedExchange(&(copy->failed), 1);
+            break;
+        }
+        copy->states[i] = state;
+        InterlockedIncrement(&(copy->nwritten));
+    }
+
+    if (prov != 0) {
+        CryptReleaseContext(prov, 0);
+    }
+    if (buf != NULL) {
+        freeBuffer(copy->pool, buf);
+    }
+    if (dst != INVALID_HANDLE_VALUE) {
+        CloseHandle(dst);
+    }
+    if (src != INVALID_HANDLE_VALUE) {
+        CloseHandle(src);
+    }
+    return 0;
+}
+
+// getStageKey(copy, &key)
+//   The key is the first 64 bits of the SHA-256 of the size and
+//   the digests of the chunks.
+static BOOL getStageKey(const ChunkCopy* copy, ULONGLONG* pkey)
+{
+    HCRYPTPROV prov;
+    if (!CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_AES, 
+                             CRYPT_VERIFYCONTEXT)) return FALSE;
+    HCRYPTHASH hash;
+    BOOL success = CryptCreateHash(prov, CALG_SHA_256, 0, 0, &hash);
+    if (success) {
+        success = CryptHashData(hash, (const BYTE*)&(copy->nbytes), 
+                                sizeof(copy->nbytes), 0);
+        for (DWORD i = 0; success && i < copy->nchunks; i++) {
+            success = (copy->states[i].done &&
+                       CryptHashData(hash, copy->states[i].digest, 
+                                     SHA256_SIZE, 0));
+        }
+        BYTE digest[SHA256_SIZE];
+        DWORD ndigest = sizeof(digest);
+        if (success &&
+            CryptGetHashParam(hash, HP_HASHVAL, digest, &ndigest, 0)) {
+            CopyMemory(pkey, digest, sizeof(*pkey));
+        } else {
+            success = FALSE;
+        }
+        CryptDestroyHash(hash);
+    }
+    CryptReleaseContext(prov, 0);
+    return success;
+}
+
+// getStageId(host, srcpath, attrs)
+//   Identifies a source file by the machine, the path, the size and
+//   the time.
+static ULONGLONG getStageId(LPCWSTR host, LPCWSTR srcpath, 
+                            const WIN32_FILE_ATTRIBUTE_DATA* attrs)
+{
+    ULONGLONG nbytes = (((ULONGLONG)attrs->nFileSizeHigh << 32) | 
+                        attrs->nFileSizeLow);
+    WCHAR source[MAX_PATH*2];
+    StringCchPrintf(source, _countof(source), L"%s\t%s\t%I64u\t%08x%08x", 
+                    host, srcpath, nbytes, 
+                    attrs->ftLastWriteTime.dwHighDateTime, 
+                    attrs->ftLastWriteTime.dwLowDateTime);
+    return getHash64((const BYTE*)source, sizeof(WCHAR)*wcslen(source));
+}
+
+// isStaged(path, nbytes)
+static BOOL isStaged(LPCWSTR path, ULONGLONG nbytes)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    return (GetFileAttributesEx(path, GetFileExInfoStandard, &attrs) &&
+            !(attrs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+            (((ULONGLONG)attrs.nFileSizeHigh << 32) | 
+             attrs.nFileSizeLow) == nbytes);
+}
+
+// stageFile(drop, srcpath, name, attrs, &key)
+//   Copies the file to STAGE_DIR\ID.tmp while hashing it, and then
+//   moves it to STAGE_DIR\KEY\NAME unless the content is there already.
+//   ID is the hash of the machine, the path, the size and the time
+//   of the source, so a partial copy of the same file is resumed.
+static BOOL stageFile(FileDrop* drop, LPCWSTR srcpath, LPCWSTR name,
+                      const WIN32_FILE_ATTRIBUTE_DATA* attrs, 
+                      ULONGLONG* pkey)
+{
+    ULONGLONG nbytes = (((ULONGLONG)attrs->nFileSizeHigh << 32) | 
+                        attrs->nFileSizeLow);
+    ULONGLONG id = getStageId(drop->host, srcpath, attrs);
+    WCHAR dirpath[MAX_PATH];
+    WCHAR dstpath[MAX_PATH];
+
+    // A file staged earlier is not read again while its copy is there.
+    StagedFile* staged;
+    for (staged = *(drop->staged); staged != NULL; staged = staged->next) {
+        if (staged->id == id) break;
+    }
+    if (staged != NULL) {
+        StringCchPrintf(dstpath, _countof(dstpath), L"%s\\%016I64x\\%s", 
+                        drop->stagedir, staged->key, name);
+        if (isStaged(dstpath, nbytes)) {
+            if (logfp != NULL) {
+                fwprintf(logfp, L"stage: path=%s, staged\n", dstpath);
+            }
+            *pkey = staged->key;
+            return TRUE;
+        }
+    }
+
+    ChunkCopy copy;
+    ZeroMemory(&copy, sizeof(copy));
+    copy.pool = drop->pool;
+    StringCchCopy(copy.srcpath, _countof(copy.srcpath), srcpath);
+    StringCchPrintf(copy.dstpath, _countof(copy.dstpath), L"%s\\%016I64x%s", 
+                    drop->stagedir, id, FILE_EXT_TEMP);
+    copy.nbytes = nbytes;
+    copy.chunksize = FILEDROP_CHUNK_SIZE;
+    copy.nchunks = (DWORD)((nbytes+copy.chunksize-1) / copy.chunksize);
+    copy.cancel = &(drop->cancel);
+    DWORD nstates = sizeof(ChunkState)*copy.nchunks;
+    copy.states = (ChunkState*) malloc(max(nstates, 1));
+    if (copy.states == NULL) return FALSE;
+    ZeroMemory(copy.states, nstates);
+
+    // The temporary file has the states of the chunks after the
+    // content. It is started over if it is not that large.
+    CreateDirectory(drop->stagedir, NULL);
+    HANDLE fp = CreateFile(copy.dstpath, GENERIC_READ | GENERIC_WRITE, 0,
+                           NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 
+                           NULL);
+    BOOL success = FALSE;
+    if (fp != INVALID_HANDLE_VALUE) {
+        LARGE_INTEGER size;
+        if (GetFileSizeEx(fp, &size) && 
+            (ULONGLONG)size.QuadPart == nbytes+nstates &&
+            readChunk(fp, nbytes, (BYTE*)copy.states, nstates)) {
+            success = TRUE;
+        } else {
+            ZeroMemory(copy.states, nstates);
+            size.QuadPart = 0;
+            if (SetFilePointerEx(fp, size, NULL, FILE_BEGIN) &&
+                SetEndOfFile(fp)) {
+                size.QuadPart = nbytes+nstates;
+                success = (SetFilePointerEx(fp, size, NULL, FILE_BEGIN) &&
+                           SetEndOfFile(fp));
+            }
+        }
+        CloseHandle(fp);
+    }
+    if (success) {
+        runWorkers(chunkWorker, &copy, min(drop->nthreads, (int)copy.nchunks));
+        success = (!copy.failed && !drop->cancel);
+        drop->nchunks += copy.nchunks;
+        drop->ncopied += copy.nwritten;
+    }
+    if (success) {
+        // The copy is thrown away if the source has changed meanwhile.
+        WIN32_FILE_ATTRIBUTE_DATA now;
+        if (!GetFileAttributesEx(srcpath, GetFileExInfoStandard, &now) ||
+            now.nFileSizeHigh != attrs->nFileSizeHigh ||
+            now.nFileSizeLow != attrs->nFileSizeLow ||
+            CompareFileTime(&(now.ftLastWriteTime), 
+                            &(attrs->ftLastWriteTime)) != 0) {
+            if (logfp != NULL) {
+                fwprintf(logfp, L"stage: path=%s, changed\n", srcpath);
+            }
+            DeleteFile(copy.dstpath);
+            success = FALSE;
+        }
+    }
+
+    ULONGLONG key;
+    if (success) {
+        success = getStageKey(&copy, &key);
+    }
+    if (success) {
+        *pkey = key;
+        StringCchPrintf(dirpath, _countof(dirpath), L"%s\\%016I64x", 
+                        drop->stagedir, key);
+        StringCchPrintf(dstpath, _countof(dstpath), L"%s\\%s", 
+                        dirpath, name);
+        if (isStaged(dstpath, nbytes)) {
+            DeleteFile(copy.dstpath);
+        } else {
+            // Cut off the states and put the file in place.
+            fp = CreateFile(copy.dstpath, GENERIC_WRITE, 0,
+                            NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 
+                            NULL);
+            success = (fp != INVALID_HANDLE_VALUE);
+            if (success) {
+                LARGE_INTEGER size;
+                size.QuadPart = nbytes;
+                success = (SetFilePointerEx(fp, size, NULL, FILE_BEGIN) &&
+                           SetEndOfFile(fp));
+                CloseHandle(fp);
+            }
+            CreateDirectory(dirpath, NULL);
+            success = (success &&
+                       MoveFileEx(copy.dstpath, dstpath, 
+                                  MOVEFILE_REPLACE_EXISTING));
+        }
+    }
+    if (success) {
+        if (staged == NULL) {
+            staged = (StagedFile*) malloc(sizeof(StagedFile));
+            if (staged != NULL) {
+                staged->id = id;
+                staged->next = *(drop->staged);
+                *(drop->staged) = staged;
+            }
+        }
+        if (staged != NULL) {
+            staged->key = *pkey;
+        }
+    }
+    if (logfp != NULL) {
+        fwprintf(logfp, L"stage: path=%s, nbytes=%I64u, chunks=%u/%u, "
+                 L"success=%d\n", 
+                 copy.dstpath, nbytes, copy.nwritten, copy.nchunks, success);
+    }
+    free(copy.states);
+    return success;
+}
+
+// readListNumber(&p, end, base, &value)
+//   Reads a number of up to 16 digits followed by a tab.
+static BOOL readListNumber(const BYTE** pp, const BYTE* end, int base, 
+                           ULONGLONG* pvalue)
+{
+    const BYTE* p = *pp;
+    ULONGLONG value = 0;
+    int ndigits = 0;
+    while (p < end && *p != '\t') {
+        int c = *p++;
+        if ('0' <= c && c <= '9') {
+            c -= '0';
+        } else if (base == 16 && 'a' <= c && c <= 'f') {
+            c -= 'a'-10;
+        } else {
+            return FALSE;
+        }
+        if (16 < ++ndigits) return FALSE;
+        value = value*base + c;
+    }
+    if (p == end || ndigits == 0) return FALSE;
+    *pp = p+1;
+    *pvalue = value;
+    return TRUE;
+}
+
+// compareULONGLONG(a, b)
+static int compareULONGLONG(const void* a, const void* b)
+{
+    ULONGLONG x = *(const ULONGLONG*)a;
+    ULONGLONG y = *(const ULONGLONG*)b;
+    return (x < y)? -1 : (y < x)? 1 : 0;
+}
+
+// removeStageDir(dirpath)
+static void removeStageDir(LPCWSTR dirpath)
+{
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s\\*", dirpath);
+    WIN32_FIND_DATA data;
+    HANDLE fft = FindFirstFile(path, &data);
+    if (fft != INVALID_HANDLE_VALUE) {
+        do {
+            if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+            StringCchPrintf(path, _countof(path), L"%s\\%s", 
+                            dirpath, data.cFileName);
+            DeleteFile(path);
+        } while (FindNextFile(fft, &data));
+        FindClose(fft);
+    }
+    RemoveDirectory(dirpath);
+}
+
+// cleanStage(drop)
+//   Removes the staged files which no .lst file in the folder refers
+//   to and the partial copies, once they are older than
+//   STAGE_EXPIRE_AGE so that a drop in progress is left alone.
+//   Nothing is removed unless all the .lst files could be read.
+static void cleanStage(FileDrop* drop)
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    ULONGLONG now = ((ULONGLONG)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+    // DIR\stage -> DIR\*.lst
+    WCHAR dirpath[MAX_PATH];
+    StringCchCopy(dirpath, _countof(dirpath), drop->stagedir);
+    dirpath[rindex(dirpath, L'\\')] = L'\0';
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s\\*%s", 
+                    dirpath, FILE_EXT_LIST);
+
+    ULONGLONG* keys = NULL;
+    UINT nkeys = 0;
+    UINT maxkeys = 0;
+    BOOL success = TRUE;
+    WIN32_FIND_DATA data;
+    HANDLE fft = FindFirstFile(path, &data);
+    if (fft == INVALID_HANDLE_VALUE) {
+        success = (GetLastError() == ERROR_FILE_NOT_FOUND);
+    } else {
+        do {
+            if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+            StringCchPrintf(path, _countof(path), L"%s\\%s", 
+                            dirpath, data.cFileName);
+            DWORD nbytes = 0;
+            BYTE* bytes = readBytes(NULL, path, MAX_LIST_FILE_SIZE, &nbytes);
+            if (bytes == NULL) {
+                success = FALSE;
+                break;
+            }
+            // "KEY\tSIZE\tNAME"
+            const BYTE* end = &(bytes[nbytes]);
+            for (const BYTE* p = bytes; p < end; ) {
+                const BYTE* eol = (const BYTE*) memchr(p, '\n', end-p);
+                if (eol == NULL) {
+                    eol = end;
+                }
+                const BYTE* line = p;
+                p = (eol < end)? eol+1 : end;
+                ULONGLONG key;
+                if (!readListNumber(&line, eol, 16, &key)) continue;
+                if (maxkeys <= nkeys) {
+                    maxkeys = max(64, maxkeys*2);
+                    ULONGLONG* q = (ULONGLONG*) realloc(
+                        keys, sizeof(ULONGLONG)*maxkeys);
+                    if (q == NULL) {
+                        success = FALSE;
+                        break;
+                    }
+                    keys = q;
+                }
+                keys[nkeys++] = key;
+            }
+            free(bytes);
+        } while (success && FindNextFile(fft, &data));
+        FindClose(fft);
+    }
+    if (!success) goto fail;
+    qsort(keys, nkeys, sizeof(ULONGLONG), compareULONGLONG);
+
+    StringCchPrintf(path, _countof(path), L"%s\\*", drop->stagedir);
+    fft = FindFirstFile(path, &data);
+    if (fft == INVALID_HANDLE_VALUE) goto fail;
+    do {
+        if (drop->cancel) break;
+        ULONGLONG mtime = (((ULONGLONG)data.ftLastWriteTime.dwHighDateTime 
+                            << 32) | data.ftLastWriteTime.dwLowDateTime);
+        if (now < mtime+STAGE_EXPIRE_AGE*10000ULL) continue;
+        StringCchPrintf(path, _countof(path), L"%s\\%s", 
+                        drop->stagedir, data.cFileName);
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            // STAGE_DIR\KEY
+            LPWSTR end;
+            ULONGLONG key = _wcstoui64(data.cFileName, &end, 16);
+            if (wcslen(data.cFileName) != 16 || *end != L'\0' ||
+                bsearch(&key, keys, nkeys, sizeof(ULONGLONG), 
+                        compareULONGLONG) != NULL) continue;
+            removeStageDir(path);
+        } else {
+            // STAGE_DIR\ID.tmp
+            int index = rindex(data.cFileName, L'.');
+            if (index < 0 || 
+                _wcsicmp(&(data.cFileName[index]), FILE_EXT_TEMP) != 0) continue;
+            DeleteFile(path);
+        }
+        if (logfp != NULL) {
+            fwprintf(logfp, L"stage: expired: path=%s\n", path);
+        }
+    } while (FindNextFile(fft, &data));
+    FindClose(fft);
+
+fail:
+    if (keys != NULL) {
+        free(keys);
+    }
+}
+
+// fileDropWorker(param)
+//   Stages the files and makes the lines of NAME.lst.
+//   Directories are not taken.
+static DWORD WINAPI fileDropWorker(LPVOID param)
+{
+    FileDrop* drop = (FileDrop*)param;
+    if (drop->clean) {
+        cleanStage(drop);
+    }
+    BOOL success = TRUE;
+    DWORD maxlist = 0;
+    for (LPCWSTR path = drop->files; *path != L'\0'; path += wcslen(path)+1) {
+        WIN32_FILE_ATTRIBUTE_DATA attrs;
+        if (!GetFileAttributesEx(path, GetFileExInfoStandard, &attrs) ||
+            (attrs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) continue;
+        LPCWSTR name = &(path[rindex(path, L'\\')+1]);
+        ULONGLONG nbytes = (((ULONGLONG)attrs.nFileSizeHigh << 32) | 
+                            attrs.nFileSizeLow);
+        ULONGLONG key;
+        if (!stageFile(drop, path, name, &attrs, &key)) {
+            success = FALSE;
+            break;
+        }
+        // "KEY\tSIZE\tNAME\r\n"
+        char head[64];
+        StringCchPrintfA(head, _countof(head), "%016I64x\t%I64u\t", 
+                         key, nbytes);
+        int nhead = strlen(head);
+        int nname = WideCharToMultiByte(CP_UTF8, 0, name, -1, 
+                                        NULL, 0, NULL, NULL);
+        DWORD n = nhead+nname+1;
+        if (MAX_LIST_FILE_SIZE < drop->nlist+n) break;
+        if (maxlist < drop->nlist+n) {
+            maxlist = max(drop->nlist+n, maxlist*2);
+            LPSTR p = (LPSTR) realloc(drop->list, maxlist);
+            if (p == NULL) {
+                success = FALSE;
+                break;
+            }
+            drop->list = p;
+        }
+        CopyMemory(&(drop->list[drop->nlist]), head, nhead);
+        WideCharToMultiByte(CP_UTF8, 0, name, -1, 
+                            &(drop->list[drop->nlist+nhead]), nname, 
+                            NULL, NULL);
+        // Replace the null with CRLF.
+        drop->list[drop->nlist+nhead+nname-1] = '\r';
+        drop->list[drop->nlist+nhead+nname] = '\n';
+        drop->nlist += n;
+    }
+    drop->success = (success && 0 < drop->nlist);
+    InterlockedExchange(&(drop->done), 1);
+    PostMessage(drop->hWnd, WM_NOTIFY_DROP, 0, 0);
+    return 0;
+}
+
+// cancelFileDrop(watcher)
+//   Stops the staging and waits for the thread.
+static void cancelFileDrop(ClipWatcher* watcher)
+{
+    FileDrop* drop = watcher->drop;
+    if (drop == NULL) return;
+    InterlockedExchange(&(drop->cancel), 1);
+    WaitForSingleObject(drop->thread, INFINITE);
+    CloseHandle(drop->thread);
+    if (logfp != NULL && !drop->done) {
+        fwprintf(logfp, L"cancel: drop\n");
+    }
+    free(drop->files);
+    if (drop->list != NULL) {
+        free(drop->list);
+    }
+    free(drop);
+    watcher->drop = NULL;
+}
+
+// startFileDrop(watcher, hWnd, files, nchars)
+//   Starts staging the files of the clip on the clipboard.
+//   files is the paths ending with an empty one.
+static void startFileDrop(ClipWatcher* watcher, HWND hWnd, 
+                          LPCWSTR files, SIZE_T nchars)
+{
+    cancelFileDrop(watcher);
+    FileDrop* drop = (FileDrop*) malloc(sizeof(FileDrop));
+    if (drop == NULL) return;
+    ZeroMemory(drop, sizeof(*drop));
+    drop->files = (LPWSTR) malloc(sizeof(WCHAR)*nchars);
+    if (drop->files == NULL) {
+        free(drop);
+        return;
+    }
+    CopyMemory(drop->files, files, sizeof(WCHAR)*nchars);
+    drop->hWnd = hWnd;
+    drop->pool = &(watcher->pool);
+    drop->nthreads = FILEDROP_MAX_THREADS;
+    drop->host = watcher->name;
+    StringCchPrintf(drop->stagedir, _countof(drop->stagedir), L"%s\\%s", 
+                    watcher->dstdir, STAGE_DIR);
+    drop->staged = &(watcher->staged);
+    // The stage is cleaned up at most once in STAGE_CLEAN_INTERVAL.
+    if (STAGE_CLEAN_INTERVAL <= GetTickCount()-watcher->stage_clean) {
+        watcher->stage_clean = GetTickCount();
+        drop->clean = TRUE;
+    }
+    drop->clock = watcher->clip_clock;
+    drop->thread = CreateThread(NULL, 0, fileDropWorker, drop, 0, NULL);
+    if (drop->thread == NULL) {
+        free(drop->files);
+        free(drop);
+        return;
+    }
+    watcher->drop = drop;
+}
+
+// finishFileDrop(watcher)
+//   Publishes NAME.lst when the files are staged, if the clip is
+//   still the one on the clipboard.
+static void finishFileDrop(ClipWatcher* watcher)
+{
+    FileDrop* drop = watcher->drop;
+    if (drop == NULL || !drop->done) return;
+    if (logfp != NULL) {
+        fwprintf(logfp, L"drop: nbytes=%u, success=%d\n", 
+                 drop->nlist, drop->success);
+    }
+    if (drop->success && drop->clock == watcher->clip_clock) {
+        // The list is a newer clip than the formats exported before.
+        setClipClock(watcher, tickClock(watcher), watcher->clip_path);
+        WCHAR basepath[MAX_PATH];
+        StringCchPrintf(basepath, _countof(basepath), L"%s\\%s", 
+                        watcher->dstdir, watcher->name);
+        WCHAR path[MAX_PATH];
+        StringCchPrintf(path, _countof(path), L"%s%s", 
+                        basepath, FILE_EXT_LIST);
+        publishClipFile(watcher, path, NULL, 0, drop->list, drop->nlist);
+        traceExportFile(watcher, basepath, FILE_EXT_LIST, 
+                        (BYTE*)drop->list, drop->nlist);
+        if (watcher->ring != NULL) {
+            WCHAR name[MAX_PATH];
+            StringCchPrintf(name, _countof(name), L"%s%s", 
+                            watcher->name, FILE_EXT_LIST);
+            publishLocalRing(watcher, name, NULL, 0, drop->list, drop->nlist);
+        }
+        stepWriteJobs(watcher, FALSE);
+    }
+    cancelFileDrop(watcher);
+}
+
+// snapshotClipboard(arena, snap, basepath)
+//   Copies the formats from the clipboard, which must be open,
+//   into the arena and marks it as exported. 
+//   Returns TRUE if anything was copied.
+static BOOL snapshotClipboard(Arena* arena, ClipSnapshot* snap, 
+                              LPCWSTR basepath)
+{
+    ZeroMemory(snap, sizeof(*snap));
+
+    // CF_UNICODETEXT
+    HANDLE data = GetClipboardData(CF_UNICODETEXT);
+    if (data != NULL) {
+        LPWSTR text = (LPWSTR) GlobalLock(data);
+        if (text != NULL) {
+            int nchars = wcslen(text);
+            snap->text = (LPWSTR) allocArena(arena, sizeof(WCHAR)*(nchars+1));
+            if (snap->text != NULL) {
+                CopyMemory(snap->text, text, sizeof(WCHAR)*(nchars+1));
+                snap->nchars = nchars;
+            }
+            GlobalUnlock(data);
+        }
+    }
+
+    // CF_DIB
+    data = GetClipboardData(CF_DIB);
+    if (data != NULL) {
+        LPVOID bytes = GlobalLock(data);
+        if (bytes != NULL) {
+            SIZE_T nbytes = GlobalSize(data);
+            snap->dib = (BYTE*) allocArena(arena, max(nbytes, 1));
+            if (snap->dib != NULL) {
+                CopyMemory(snap->dib, bytes, nbytes);
+                snap->ndib = nbytes;
+            }
+            GlobalUnlock(data);
+        }
+    }
+
+    // CF_HDROP
+    data = GetClipboardData(CF_HDROP);
+    if (data != NULL) {
+        HDROP hdrop = (HDROP)data;
+        UINT nfiles = min(DragQueryFile(hdrop, 0xFFFFFFFF, NULL, 0),
+                          FILEDROP_MAX_FILES);
+        SIZE_T nchars = 1;
+        for (UINT i = 0; i < nfiles; i++) {
+            nchars += DragQueryFile(hdrop, i, NULL, 0)+1;
+        }
+        snap->files = (LPWSTR) allocArena(arena, sizeof(WCHAR)*nchars);
+        if (snap->files != NULL) {
+            LPWSTR p = snap->files;
+            for (UINT i = 0; i < nfiles; i++) {
+                p += DragQueryFile(hdrop, i, p, nchars-(p-snap->files))+1;
+            }
+            *p = L'\0';
+            snap->nfilechars = nchars;
+        }
+    }
+
+    if (snap->text == NULL && snap->dib == NULL && 
+        snap->files == NULL) return FALSE;
+    LPCWSTR ext = FILE_EXT_LIST;
+    if (snap->dib != NULL) {
+        ext = FILE_EXT_BITMAP;
+    } else if (snap->text != NULL) {
+        ext = FILE_EXT_TEXT;
+    }
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s%s", basepath, ext);
+    setClipboardOrigin(path);
+    return TRUE;
+}
+
+// exportClipFile(watcher, basepath, snap)
+//   Publishes the smaller format first. Each format is written to
+//   the shared folder, queued for the peers and then put to the local
+//   ring; the large ones are written in the background.
+//   Returns the size of the clipboard content exported.
+static SIZE_T exportClipFile(ClipWatcher* watcher, LPCWSTR basepath, 
+                             ClipSnapshot* snap)
+{
+    SIZE_T ntext = sizeof(WCHAR)*snap->nchars;
+    BOOL textfirst = (ntext <= snap->ndib);
+    for (int i = 0; i < 2; i++) {
+        if (i == 1) {
+            // Each format is a newer clip than the one before it
+            // so that the peers take the larger one afterwards.
+            setClipClock(watcher, tickClock(watcher), watcher->clip_path);
+        }
+        if ((i == 0) == textfirst) {
+            // CF_UNICODETEXT
+            if (snap->text != NULL) {
+                LPCWSTR ext = writeTextFile(watcher, basepath, 
+                                            snap->text, snap->nchars);
+                traceExportFile(watcher, basepath, ext, (BYTE*)snap->text, 
+                                ntext);
+                if (watcher->ring != NULL) {
+                    publishLocalText(watcher, snap->text, snap->nchars);
+                }
+            }
+        } else {
+            // CF_DIB
+            if (snap->dib != NULL) {
+                LPCWSTR ext = writeBMPFile(watcher, basepath, 
+                                           snap->dib, snap->ndib);
+                traceExportFile(watcher, basepath, ext, snap->dib, 
+                                snap->ndib);
+                if (watcher->ring != NULL) {
+                    publishLocalDIB(watcher, snap->dib, snap->ndib);
+                }
+            }
+        }
+    }
+
+    return ntext + snap->ndib;
+}
+
+// initExportScheduler(sched, min_interval, max_delay, rate, now)
+static void initExportScheduler(ExportScheduler* sched, 
+                                DWORD min_interval, DWORD max_delay, 
+                                DWORD rate, DWORD now)
+{
+    sched->min_interval = min_interval;
+    sched->max_delay = max_delay;
+    sched->rate = rate;
+    sched->pending = FALSE;
+    sched->first_update = now;
+    sched->last_update = now;
+    sched->last_export = now;
+    sched->backoff = 0;
+}
+
+// notifyExportUpdate(sched, now)
+//   Records a clipboard update which is to be exported later.
+static void notifyExportUpdate(ExportScheduler* sched, DWORD now)
+{
+    if (!sched->pending) {
+        sched->pending = TRUE;
+        sched->first_update = now;
+    }
+    sched->last_update = now;
+}
+
+// getExportDelay(sched, now)
+//   Returns the time (msec) until the pending update should be
+//   exported, 0 if it is due, or INFINITE if nothing is pending.
+static DWORD getExportDelay(const ExportScheduler* sched, DWORD now)
+{
+    if (!sched->pending) return INFINITE;
+
+    // Wait until the updates settle, but not longer than max_delay.
+    DWORD due = sched->last_update + sched->min_interval;
+    DWORD deadline = sched->first_update + sched->max_delay;
+    if (0 < (LONG)(due - deadline)) {
+        due = deadline;
+    }
+    // A large export delays the next one to keep within the rate.
+    // The time since the export is unsigned so that an old budget is
+    // not taken for a future one after the tick count wraps around.
+    if (now - sched->last_export < sched->backoff) {
+        DWORD allowed = sched->last_export + sched->backoff;
+        if (0 < (LONG)(allowed - due)) {
+            due = allowed;
+        }
+    }
+    LONG wait = (LONG)(due - now);
+    return (wait < 0)? 0 : (DWORD)wait;
+}
+
+// finishExport(sched, now, nbytes)
+static void finishExport(ExportScheduler* sched, DWORD now, SIZE_T nbytes)
+{
+    sched->pending = FALSE;
+    sched->last_export = now;
+    sched->backoff = 0;
+    if (sched->rate != 0) {
+        ULONGLONG backoff = (ULONGLONG)nbytes*1000 / sched->rate;
+        sched->backoff = (DWORD)min(backoff, EXPORT_MAX_BACKOFF);
+    }
+}
+
+// findFileEntry(files, path)
+static FileEntry* findFileEntry(FileEntry* entry, LPCWSTR path)
+{
+    while (entry != NULL) {
+	if (wcsicmp(entry->path, path) == 0) return entry;
+	entry = entry->next;
+    }
+    return entry;
+}
+
+// freeFileEntries(files)
+static void freeFileEntries(FileEntry* entry)
+{
+    while (entry != NULL) {
+	FileEntry* p = entry;
+	entry = entry->next;
+	if (p->text != NULL) {
+	    free(p->text);
+	}
+	free(p);
+    }
+}
+
+// getFileEntry(watcher, path)
+//   Finds the entry or adds a new one which is reported as changed.
+static FileEntry* getFileEntry(ClipWatcher* watcher, LPCWSTR path)
+{
+    FileEntry* entry = findFileEntry(watcher->files, path);
+    if (entry == NULL) {
+        entry = (FileEntry*) malloc(sizeof(FileEntry));
+        if (entry != NULL) {
+            StringCchCopy(entry->path, _countof(entry->path), path);
+            entry->hash = 0;
+            ZeroMemory(&(entry->mtime), sizeof(entry->mtime));
+            entry->pushed = FALSE;
+            entry->text = NULL;
+            entry->ntext = 0;
+            entry->next = watcher->files;
+            watcher->files = entry;
+        }
+    }
+    return entry;
+}
+
+// cacheFileText(watcher, path, text, ntext)
+//   Keeps a large text so that the later deltas can refer to it.
+//   Takes the ownership of text.
+static void cacheFileText(ClipWatcher* watcher, LPCWSTR path, 
+                          LPSTR text, DWORD ntext)
+{
+    FileEntry* entry = NULL;
+    if (watcher->delta && TEXT_DELTA_THRESHOLD <= ntext) {
+        entry = findFileEntry(watcher->files, path);
+    }
+    if (entry != NULL) {
+        if (entry->text != NULL) {
+            free(entry->text);
+        }
+        entry->text = text;
+        entry->ntext = ntext;
+        entry->text_hash = getHash64((const BYTE*)text, ntext);
+    } else {
+        free(text);
+    }
+}
+
+// importClipDIB(hWnd, path, data)
+//   Gives the DIB in the global memory to the clipboard.
+static BOOL importClipDIB(HWND hWnd, LPCWSTR path, HANDLE data)
+{
+    BOOL success = FALSE;
+    if (OpenClipboard(hWnd)) {
+        EmptyClipboard();
+        setClipboardOrigin(path);
+        if (SetClipboardData(CF_DIB, data) != NULL) {
+            data = NULL;
+        }
+        CloseClipboard();
+        success = TRUE;
+    }
+    if (data != NULL) {
+        GlobalFree(data);
+    }
+    return success;
+}
+
+// importClipUTF8(hWnd, path, text, ntext)
+static BOOL importClipUTF8(HWND hWnd, LPCWSTR path, LPCSTR text, DWORD ntext)
+{
+    BOOL success = FALSE;
+    if (OpenClipboard(hWnd)) {
+        EmptyClipboard();
+        setClipboardOrigin(path);
+        setClipboardUTF8(text, ntext);
+        CloseClipboard();
+        success = TRUE;
+    }
+    return success;
+}
+
+// readTextDelta(watcher, path, bytes, nbytes, &ntext)
+//   Reconstructs the text from the keyframe and the content of a .txd file.
+//   The text is taken from the arena.
+static LPSTR readTextDelta(ClipWatcher* watcher, LPCWSTR path, 
+                           const BYTE* bytes, DWORD nbytes, DWORD* pntext)
+{
+    const TextDeltaHeader* hdr = (const TextDeltaHeader*)bytes;
+    if (nbytes < sizeof(*hdr) || 
+        hdr->signature != TEXTDELTA_SIGNATURE) return NULL;
+
+    // NAME.txd -> NAME.txt or NAME.txz
+    WCHAR basepath[MAX_PATH];
+    StringCchCopy(basepath, _countof(basepath), path);
+    int index = rindex(basepath, L'.');
+    if (index < 0) return NULL;
+    basepath[index] = L'\0';
+    StringCchCat(basepath, _countof(basepath), 
+                 hdr->base_compressed? FILE_EXT_TEXTZ : FILE_EXT_TEXT);
+
+    // Use the cached keyframe if it is still the same one.
+    FileEntry* entry = findFileEntry(watcher->files, basepath);
+    if (entry != NULL && entry->text != NULL &&
+        entry->ntext == hdr->base_nbytes &&
+        entry->text_hash == hdr->base_hash) {
+        return applyTextDelta(&(watcher->arena), 
+                              (const BYTE*)entry->text, entry->ntext,
+                              bytes, nbytes, pntext);
+    }
+
+    LPSTR base = NULL;
+    DWORD nbase = 0;
+    if (hdr->base_compressed) {
+        base = readTextZFile(&(watcher->arena), basepath, &nbase);
+    } else {
+        // The keyframe is kept by cacheFileText().
+        base = (LPSTR) readBytes(NULL, basepath, MAX_TEXT_FILE_SIZE, &nbase);
+    }
+    if (base == NULL) return NULL;
+    if (logfp != NULL) {
+        fwprintf(logfp, L"keyframe: path=%s, nbytes=%u\n", basepath, nbase);
+    }
+    LPSTR text = NULL;
+    if (nbase == hdr->base_nbytes &&
+        getHash64((const BYTE*)base, nbase) == hdr->base_hash) {
+        text = applyTextDelta(&(watcher->arena), (const BYTE*)base, nbase, 
+                              bytes, nbytes, pntext);
+        cacheFileText(watcher, basepath, base, nbase);
+    } else {
+        free(base);
+    }
+    return text;
+}
+
+// importClipList(watcher, hWnd, path, bytes, nbytes)
+//   Puts the staged files listed in a .lst file on the clipboard.
+//   Only the files which are staged with the listed size are taken.
+static BOOL importClipList(ClipWatcher* watcher, HWND hWnd, LPCWSTR path, 
+                           const BYTE* bytes, DWORD nbytes)
+{
+    // DIR\NAME.lst -> DIR\stage
+    WCHAR stagedir[MAX_PATH];
+    StringCchCopy(stagedir, _countof(stagedir), path);
+    stagedir[rindex(stagedir, L'\\')+1] = L'\0';
+    StringCchCat(stagedir, _countof(stagedir), STAGE_DIR);
+
+    SIZE_T maxchars = MAX_PATH*FILEDROP_MAX_FILES+1;
+    LPWSTR files = (LPWSTR) allocArena(&(watcher->arena), 
+                                       sizeof(WCHAR)*maxchars);
+    if (files == NULL) return FALSE;
+    SIZE_T nchars = 0;
+    UINT nfiles = 0;
+    const BYTE* end = &(bytes[nbytes]);
+    for (const BYTE* p = bytes; p < end && nfiles < FILEDROP_MAX_FILES; ) {
+        const BYTE* eol = (const BYTE*) memchr(p, '\n', end-p);
+        if (eol == NULL) {
+            eol = end;
+        }
+        const BYTE* line = p;
+        p = (eol < end)? eol+1 : end;
+        if (line < eol && eol[-1] == '\r') {
+            eol--;
+        }
+        // "KEY\tSIZE\tNAME"
+        ULONGLONG key, size;
+        if (!readListNumber(&line, eol, 16, &key) ||
+            !readListNumber(&line, eol, 10, &size)) continue;
+        WCHAR name[MAX_PATH];
+        int n = MultiByteToWideChar(CP_UTF8, 0, (LPCSTR)line, eol-line, 
+                                    name, _countof(name)-1);
+        if (n <= 0) continue;
+        name[n] = L'\0';
+        // The name must not point out of the directory.
+        if (wcspbrk(name, L"\\/:") != NULL ||
+            wcscmp(name, L".") == 0 || wcscmp(name, L"..") == 0) continue;
+        LPWSTR dst = &(files[nchars]);
+        if (FAILED(StringCchPrintf(dst, maxchars-nchars-1, 
+                                   L"%s\\%016I64x\\%s", 
+                                   stagedir, key, name))) continue;
+        WIN32_FILE_ATTRIBUTE_DATA attrs;
+        if (!GetFileAttributesEx(dst, GetFileExInfoStandard, &attrs) ||
+            (attrs.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+            (((ULONGLONG)attrs.nFileSizeHigh << 32) | 
+             attrs.nFileSizeLow) != size) {
+            if (logfp != NULL) {
+                fwprintf(logfp, L"list: missing: path=%s\n", dst);
+            }
+            continue;
+        }
+        nchars += wcslen(dst)+1;
+        nfiles++;
+    }
+    if (nfiles == 0) return FALSE;
+    files[nchars++] = L'\0';
+
+    BOOL success = FALSE;
+    if (OpenClipboard(hWnd)) {
+        EmptyClipboard();
+        setClipboardOrigin(path);
+        setClipboardHDROP(files, nchars);
+        CloseClipboard();
+        success = TRUE;
+    }
+    return success;
+}
+
+// getFormatExt(ext)
+//   Returns the extension of the format a file is decoded to,
+//   e.g. ".txt" for ".txz" and ".txd".
+static LPCWSTR getFormatExt(LPCWSTR ext)
+{
+    if (_wcsicmp(ext, FILE_EXT_TEXTZ) == 0 ||
+        _wcsicmp(ext, FILE_EXT_TEXTDELTA) == 0) return FILE_EXT_TEXT;
+    if (_wcsicmp(ext, FILE_EXT_BITMAPDELTA) == 0) return FILE_EXT_BITMAP;
+    return ext;
+}
+
+// isWithinSizeLimit(watcher, name, nbytes)
+//   Checks the size of a file against the limit of its format.
+static BOOL isWithinSizeLimit(ClipWatcher* watcher, LPCWSTR name, 
+                              ULONGLONG nbytes)
+{
+    int index = rindex(name, L'.');
+    if (index < 0) return TRUE;
+    LPCWSTR ext = getFormatExt(&(name[index]));
+    for (SizeLimit* limit = watcher->limits; 
+         limit != NULL; limit = limit->next) {
+        if (_wcsicmp(ext, limit->ext) == 0 &&
+            limit->maxbytes < nbytes) return FALSE;
+    }
+    return TRUE;
+}
+
+// getDecodedSize(ext, bytes, nbytes)
+//   Returns the size of the file decoded (and of the keyframe read 
+//   for it) from its header, or 0 if the header is broken.
+static ULONGLONG getDecodedSize(LPCWSTR ext, const BYTE* bytes, DWORD nbytes)
+{
+    if (_wcsicmp(ext, FILE_EXT_TEXTZ) == 0) {
+        const TextZHeader* hdr = (const TextZHeader*)bytes;
+        if (nbytes < sizeof(*hdr)) return 0;
+        return hdr->nbytes;
+    } else if (_wcsicmp(ext, FILE_EXT_TEXTDELTA) == 0) {
+        const TextDeltaHeader* hdr = (const TextDeltaHeader*)bytes;
+        if (nbytes < sizeof(*hdr)) return 0;
+        return max(hdr->nbytes, hdr->base_nbytes);
+    } else if (_wcsicmp(ext, FILE_EXT_BITMAPDELTA) == 0) {
+        const TileDeltaHeader* hdr = (const TileDeltaHeader*)bytes;
+        if (nbytes < sizeof(*hdr) || 
+            nbytes-sizeof(*hdr) < hdr->hdrsize ||
+            hdr->hdrsize < sizeof(BITMAPINFOHEADER)) return 0;
+        BITMAPINFO* bmp = (BITMAPINFO*)&(bytes[sizeof(*hdr)]);
+        return sizeof(BITMAPFILEHEADER)+getBMPSize(bmp);
+    }
+    return nbytes;
+}
+
+// importClipBytes(watcher, hWnd, path, bytes, nbytes)
+//   Copies the content of a clip file to the clipboard.
+//   The size limits apply to the content decoded, and they are
+//   checked before a keyframe is read.
+static BOOL importClipBytes(ClipWatcher* watcher, HWND hWnd, LPCWSTR path, 
+                            const BYTE* bytes, DWORD nbytes)
+{
+    BOOL success = FALSE;
+    int index = rindex(path, L'.');
+    if (index < 0) return success;
+
+    LPCWSTR ext = &(path[index]);
+    ULONGLONG size = getDecodedSize(ext, bytes, nbytes);
+    if (!isWithinSizeLimit(watcher, path, size)) {
+        if (logfp != NULL) {
+            fwprintf(logfp, L"import: too large: path=%s, nbytes=%I64u\n", 
+                     path, size);
+        }
+        return success;
+    }
+    if (_wcsicmp(ext, FILE_EXT_TEXT) == 0) {
+        // CF_UNICODETEXT
+        nbytes = min(nbytes, MAX_TEXT_FILE_SIZE);
+        success = importClipUTF8(hWnd, path, (LPCSTR)bytes, nbytes);
+        if (success && watcher->delta && TEXT_DELTA_THRESHOLD <= nbytes) {
+            LPSTR text = (LPSTR) malloc(nbytes);
+            if (text != NULL) {
+                CopyMemory(text, bytes, nbytes);
+                cacheFileText(watcher, path, text, nbytes);
+            }
+        }
+    } else if (_wcsicmp(ext, FILE_EXT_TEXTZ) == 0) {
+        // CF_UNICODETEXT (compressed)
+        DWORD ntext;
+        LPSTR text = decodeTextZ(bytes, nbytes, &ntext);
+        if (text != NULL) {
+            success = importClipUTF8(hWnd, path, text, ntext);
+            cacheFileText(watcher, path, text, ntext);
+        }
+    } else if (_wcsicmp(ext, FILE_EXT_TEXTDELTA) == 0) {
+        // CF_UNICODETEXT (delta)
+        DWORD ntext;
+        LPSTR text = readTextDelta(watcher, path, bytes, nbytes, &ntext);
+        if (text != NULL) {
+            success = importClipUTF8(hWnd, path, text, ntext);
+        }
+    } else if (_wcsicmp(ext, FILE_EXT_BITMAP) == 0) {
+        // CF_DIB
+        BITMAPFILEHEADER* filehdr = (BITMAPFILEHEADER*)bytes;
+        BITMAPINFO* bmp = (BITMAPINFO*)&(bytes[sizeof(*filehdr)]);
+        if (sizeof(*filehdr)+sizeof(bmp->bmiHeader) <= nbytes &&
+            filehdr->bfType == BMP_SIGNATURE &&
+            checkBMPHeader(bmp, nbytes-sizeof(*filehdr)) &&
+            filehdr->bfOffBits == sizeof(*filehdr)+getBMPHeaderSize(bmp)) {
+            if (OpenClipboard(hWnd)) {
+                EmptyClipboard();
+                setClipboardOrigin(path);
+                setClipboardDIB(bmp);
+                CloseClipboard();
+                success = TRUE;
+            }
+        }
+    } else if (_wcsicmp(ext, FILE_EXT_BITMAPDELTA) == 0) {
+        // CF_DIB (delta)
+        HANDLE data = readTileDelta(path, bytes, nbytes);
+        if (data != NULL) {
+            success = importClipDIB(hWnd, path, data);
+        }
+    } else if (_wcsicmp(ext, FILE_EXT_LIST) == 0) {
+        // CF_HDROP
+        success = importClipList(watcher, hWnd, path, bytes, nbytes);
+    }
+    return success;
+}
+
+// importClipFile(watcher, hWnd, path)
+static BOOL importClipFile(ClipWatcher* watcher, HWND hWnd, LPCWSTR path)
+{
+    BOOL success = FALSE;
+    int index = rindex(path, L'.');
+    if (index < 0) return success;
+
+    LPCWSTR ext = &(path[index]);
+    DWORD maxbytes;
+    if (_wcsicmp(ext, FILE_EXT_BITMAP) == 0) {
+        // CF_DIB (read directly into the clipboard memory)
+        HANDLE data = readBMPFile(path, NULL);
+        if (data != NULL) {
+            success = importClipDIB(hWnd, path, data);
+        }
+        return success;
+    } else if (_wcsicmp(ext, FILE_EXT_TEXT) == 0) {
+        maxbytes = MAX_TEXT_FILE_SIZE;
+    } else if (_wcsicmp(ext, FILE_EXT_TEXTZ) == 0) {
+        maxbytes = getLZBound(MAX_TEXT_FILE_SIZE)+sizeof(TextZHeader);
+    } else if (_wcsicmp(ext, FILE_EXT_TEXTDELTA) == 0) {
+        maxbytes = (sizeof(TextDeltaHeader) + MAX_TEXT_FILE_SIZE +
+                    (MAX_TEXT_FILE_SIZE/CHUNK_MIN_SIZE+1)*sizeof(TextDeltaOp));
+    } else if (_wcsicmp(ext, FILE_EXT_BITMAPDELTA) == 0) {
+        maxbytes = MAX_BITMAP_SIZE;
+    } else if (_wcsicmp(ext, FILE_EXT_LIST) == 0) {
+        maxbytes = MAX_LIST_FILE_SIZE;
+    } else {
+        return success;
+    }
+
+    DWORD nbytes;
+    BYTE* bytes = readBytes(&(watcher->arena), path, maxbytes, &nbytes);
+    if (bytes != NULL) {
+        success = importClipBytes(watcher, hWnd, path, bytes, nbytes);
+    }
+    return success;
+}
+
+// getFileHash(pool, fp, n)
+static DWORD getFileHash(BufferPool* pool, HANDLE fp, DWORD n)
+{
+    DWORD hash = 0;
+    DWORD bufsize = sizeof(DWORD)*n;
+    DWORD* buf = (DWORD*) allocBuffer(pool, bufsize);
+    if (buf != NULL) {
+	DWORD readbytes;
+	ZeroMemory(buf, bufsize);
+	ReadFile(fp, buf, bufsize, &readbytes, NULL);
+	for (int i = 0; i < n; i++) {
+	    hash ^= buf[i];
+	}
+	freeBuffer(pool, buf);
+    }
+    return hash;
+}
+
+// getBytesHash(bytes, nbytes, n)
+//   Computes the same hash as getFileHash() for the bytes in memory.
+static DWORD getBytesHash(const BYTE* bytes, SIZE_T nbytes, DWORD n)
+{
+    DWORD hash = 0;
+    SIZE_T bufsize = min(nbytes, sizeof(DWORD)*n);
+    for (SIZE_T i = 0; i < bufsize; i += sizeof(DWORD)) {
+        DWORD v = 0;
+        CopyMemory(&v, &bytes[i], min(bufsize-i, sizeof(DWORD)));
+        hash ^= v;
+    }
+    return hash;
+}
+
+// addHostFilter(filter, pattern)
+//   pattern is either a host name or a glob with '*' and '?'.
+static void addHostFilter(HostFilter* filter, LPCWSTR pattern)
+{
+    LPWSTR p = _wcsdup(pattern);
+    if (p == NULL) return;
+    _wcsupr(p);
+    if (wcspbrk(p, L"*?") == NULL) {
+        LPWSTR* names = (LPWSTR*) realloc(
+            filter->names, sizeof(LPWSTR)*(filter->nnames+1));
+        if (names != NULL) {
+            filter->names = names;
+            filter->names[filter->nnames++] = p;
+            p = NULL;
+        }
+    } else {
+        LPWSTR* patterns = (LPWSTR*) realloc(
+            filter->patterns, sizeof(LPWSTR)*(filter->npatterns+1));
+        if (patterns != NULL) {
+            filter->patterns = patterns;
+            filter->patterns[filter->npatterns++] = p;
+            p = NULL;
+        }
+    }
+    if (p != NULL) {
+        free(p);
+    }
+}
+
+// compareNames(a, b)
+static int compareNames(const void* a, const void* b)
+{
+    return wcscmp(*(LPCWSTR*)a, *(LPCWSTR*)b);
+}
+
+// compileHostFilter(filter)
+//   Sorts the names for matchHostFilter().
+static void compileHostFilter(HostFilter* filter)
+{
+    if (0 < filter->nnames) {
+        qsort(filter->names, filter->nnames, sizeof(LPWSTR), compareNames);
+    }
+}
+
+// matchGlob(pattern, text)
+static BOOL matchGlob(LPCWSTR pattern, LPCWSTR text)
+{
+    LPCWSTR star = NULL;
+    LPCWSTR retry = NULL;
+    while (*text != 0) {
+        if (*pattern == L'*') {
+            star = pattern++;
+            retry = text;
+        } else if (*pattern == L'?' || *pattern == *text) {
+            pattern++;
+            text++;
+        } else if (star != NULL) {
+            pattern = star+1;
+            text = ++retry;
+        } else {
+            return FALSE;
+        }
+    }
+    while (*pattern == L'*') {
+        pattern++;
+    }
+    return (*pattern == 0);
+}
+
+// matchHostFilter(filter, host)
+//   host must be in upper case.
+static BOOL matchHostFilter(const HostFilter* filter, LPCWSTR host)
+{
+    if (0 < filter->nnames &&
+        bsearch(&host, filter->names, filter->nnames, 
+                sizeof(LPWSTR), compareNames) != NULL) return TRUE;
+    for (int i = 0; i < filter->npatterns; i++) {
+        if (matchGlob(filter->patterns[i], host)) return TRUE;
+    }
+    return FALSE;
+}
+
+// freeHostFilter(filter)
+static void freeHostFilter(HostFilter* filter)
+{
+    for (int i = 0; i < filter->nnames; i++) {
+        free(filter->names[i]);
+    }
+    for (int i = 0; i < filter->npatterns; i++) {
+        free(filter->patterns[i]);
+    }
+    if (filter->names != NULL) {
+        free(filter->names);
+    }
+    if (filter->patterns != NULL) {
+        free(filter->patterns);
+    }
+    ZeroMemory(filter, sizeof(*filter));
+}
+
+// addSizeLimit(watcher, spec)
+//   spec is "ext=size", e.g. "bmp=8M".
+static void addSizeLimit(ClipWatcher* watcher, LPCWSTR spec)
+{
+    LPCWSTR eq = wcschr(spec, L'=');
+    if (eq == NULL) return;
+    SizeLimit* limit = (SizeLimit*) malloc(sizeof(SizeLimit));
+    if (limit == NULL) return;
+
+    // Store the extension of the format with its dot.
+    if (*spec == L'.') {
+        spec++;
+    }
+    WCHAR ext[16] = L".";
+    StringCchCatN(ext, _countof(ext), spec, eq-spec);
+    StringCchCopy(limit->ext, _countof(limit->ext), getFormatExt(ext));
+    LPWSTR end;
+    limit->maxbytes = _wcstoui64(eq+1, &end, 10);
+    switch (*end) {
+    case L'k': case L'K':
+        limit->maxbytes *= 1024;
+        break;
+    case L'm': case L'M':
+        limit->maxbytes *= 1024*1024;
+        break;
+    }
+    limit->next = watcher->limits;
+    watcher->limits = limit;
+}
+
+// freeSizeLimits(limits)
+static void freeSizeLimits(SizeLimit* limit)
+{
+    while (limit != NULL) {
+	void* p = limit;
+	limit = limit->next;
+	free(p);
+    }
+}
+
+// isSubscribed(watcher, name, nbytes)
+//   Decides whether to take a file only from its name and size.
+static BOOL isSubscribed(ClipWatcher* watcher, LPCWSTR name, ULONGLONG nbytes)
+{
+    WCHAR host[MAX_PATH];
+    getClipHost(name, host, _countof(host));
+    _wcsupr(host);
+    if (matchHostFilter(&(watcher->deny), host)) return FALSE;
+    if ((0 < watcher->allow.nnames || 0 < watcher->allow.npatterns) &&
+        !matchHostFilter(&(watcher->allow), host)) return FALSE;
+
+    // A compressed file or a delta is never larger than its content,
+    // which is checked when it is read.
+    return isWithinSizeLimit(watcher, name, nbytes);
+}
+
+// getNewerEntry(entry1, entry2)
+static FileEntry* getNewerEntry(FileEntry* entry1, FileEntry* entry2)
+{
+    if (entry1 == NULL) return entry2;
+    int c = compareClips(getFileTimeValue(&(entry1->mtime)), entry1->path,
+                         getFileTimeValue(&(entry2->mtime)), entry2->path);
+    return (c < 0)? entry2 : entry1;
+}
+
+// fingerprintFile(pool, item)
+static void fingerprintFile(BufferPool* pool, ScanItem* item)
+{
+    HANDLE fp = CreateFile(item->path, GENERIC_READ, FILE_SHARE_READ,
+                           NULL, OPEN_EXISTING, 
+                           (FILE_ATTRIBUTE_NORMAL | 
+                            FILE_FLAG_NO_BUFFERING),
+                           NULL);
+    item->opened = (fp != INVALID_HANDLE_VALUE);
+    if (item->opened) {
+        item->hash = getFileHash(pool, fp, 256);
+        GetFileTime(fp, NULL, NULL, &(item->mtime));
+        CloseHandle(fp);
+    }
+}
+
+// scanWorker(param)
+static DWORD WINAPI scanWorker(LPVOID param)
+{
+    ScanJob* job = (ScanJob*)param;
+    for (;;) {
+        LONG i = InterlockedIncrement(&(job->next))-1;
+        if (job->nitems <= i) break;
+        if (job->delays != NULL) {
+            Sleep(job->delays[i]);
+        }
+        fingerprintFile(job->pool, &(job->items[i]));
+    }
+    return 0;
+}
+
+// fingerprintFiles(pool, items, nitems, nthreads)
+//   Fingerprints the files with up to nthreads requests in flight,
+//   so that the round trips to a remote folder overlap.
+//   The calling thread works too and returns when all are done.
+static void fingerprintFiles(BufferPool* pool, 
+                             ScanItem* items, int nitems, int nthreads)
+{
+    ScanJob job;
+    job.pool = pool;
+    job.items = items;
+    job.nitems = nitems;
+    job.next = 0;
+    job.delays = NULL;
+    runWorkers(scanWorker, &job, min(nthreads, nitems));
+}
+
+// mergeScanItems(watcher, items, nitems)
+//   Updates the entries in the listed order and returns the newest
+//   file changed.
+static FileEntry* mergeScanItems(ClipWatcher* watcher, 
+                                 ScanItem* items, int nitems)
+{
+    FileEntry* found = NULL;
+    for (int i = 0; i < nitems; i++) {
+        ScanItem* item = &(items[i]);
+        if (!item->opened) continue;
+        LPCWSTR path = item->path;
+        LPCWSTR name = &(path[rindex(path, L'\\')+1]);
+        DWORD hash = item->hash;
+        FILETIME mtime = item->mtime;
+        if (logfp != NULL) {
+            fwprintf(logfp, L"check: name=%s (%08x, %08x)\n", 
+                     name, hash, mtime.dwLowDateTime);
+        }
+        FileEntry* entry = findFileEntry(watcher->files, path);
+        if (entry == NULL) {
+            if (logfp != NULL) {
+                fwprintf(logfp, L"added: name=%s\n", name);
+            }
+            entry = (FileEntry*) malloc(sizeof(FileEntry));
+            StringCchCopy(entry->path, _countof(entry->path), path);
+            entry->hash = hash;
+            entry->mtime = mtime;
+            entry->pushed = FALSE;
+            entry->text = NULL;
+            entry->ntext = 0;
+            entry->next = watcher->files;
+            watcher->files = entry;
+            found = getNewerEntry(found, entry);
+        } else if (entry->pushed && hash == entry->hash) {
+            // The content has already been pushed by the peer.
+            if (logfp != NULL) {
+                fwprintf(logfp, L"pushed: name=%s\n", name);
+            }
+            entry->mtime = mtime;
+            entry->pushed = FALSE;
+        } else if (hash != entry->hash ||
+                   CompareFileTime(&mtime, &(entry->mtime)) != 0) {
+            if (logfp != NULL) {
+                fwprintf(logfp, L"updated: name=%s\n", name);
+            }
+            entry->hash = hash;
+            entry->mtime = mtime;
+            entry->pushed = FALSE;
+            found = getNewerEntry(found, entry);
+        }
+    }
+    return found;
+}
+
+// checkFileChanges(watcher)
+//   Returns the newest file changed.
+static FileEntry* checkFileChanges(ClipWatcher* watcher)
+{
+    WCHAR dirpath[MAX_PATH];
+    StringCchPrintf(dirpath, _countof(dirpath), L"%s\\*.*", watcher->srcdir);
+
+    WIN32_FIND_DATA data;
+    FileEntry* found = NULL;
+    ScanItem* items = NULL;
+    int nitems = 0;
+    int maxitems = 0;
+    DWORD start = GetTickCount();
+
+    HANDLE fft = FindFirstFile(dirpath, &data);
+    if (fft == INVALID_HANDLE_VALUE) goto fail;
+    
+    // List the files to take.
+    for (;;) {
+        LPWSTR name = data.cFileName;
+        int index = rindex(name, L'.');
+        ULONGLONG nbytes = (((ULONGLONG)data.nFileSizeHigh << 32) | 
+                            data.nFileSizeLow);
+        // Only the name and the size are used to skip a file.
+        if (0 <= index && wcsnicmp(name, watcher->name, index) != 0 &&
+            _wcsicmp(&(name[index]), FILE_EXT_TEMP) != 0 &&
+            _wcsicmp(&(name[index]), FILE_EXT_STAMP) != 0 &&
+            (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) == 0 &&
+            isSubscribed(watcher, name, nbytes)) {
+            if (maxitems <= nitems) {
+                int n = max(16, maxitems*2);
+                ScanItem* p = (ScanItem*) realloc(items, sizeof(ScanItem)*n);
+                if (p == NULL) break;
+                items = p;
+                maxitems = n;
+            }
+            StringCchPrintf(items[nitems].path, 
+                            _countof(items[nitems].path), L"%s\\%s", 
+                            watcher->srcdir, name);
+            items[nitems].nbytes = nbytes;
+            nitems++;
+        }
+	if (!FindNextFile(fft, &data)) break;
+    }
+    FindClose(fft);
+
+    // Open and hash them concurrently.
+    fingerprintFiles(&(watcher->pool), items, nitems, watcher->scan_threads);
+    for (int i = 0; i < nitems; i++) {
+        if (items[i].opened) {
+            traceEvent(watcher, TRACE_FILE, items[i].path, items[i].nbytes, 
+                       getFileTimeValue(&(items[i].mtime)), items[i].hash);
+        }
+    }
+    traceEvent(watcher, TRACE_SCAN, NULL, nitems, 0, GetTickCount()-start);
+
+    found = mergeScanItems(watcher, items, nitems);
+    if (items != NULL) {
+        free(items);
+    }
+
+fail:
+    return found;
+}
+
+// addPushPeer(watcher, spec)
+//   spec is either "host" or "host:port".
+static void addPushPeer(ClipWatcher* watcher, LPCWSTR spec)
+{
+    PushPeer* peer = (PushPeer*) malloc(sizeof(PushPeer));
+    if (peer == NULL) return;
+
+    WCHAR port[16];
+    StringCchPrintf(port, _countof(port), L"%u", watcher->port);
+    StringCchCopy(peer->host, _countof(peer->host), spec);
+    WCHAR* sep = wcschr(peer->host, L':');
+    if (sep != NULL && wcschr(sep+1, L':') == NULL) {
+        *sep = L'\0';
+        StringCchCopy(port, _countof(port), sep+1);
+    }
+
+    ADDRINFOW hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    ADDRINFOW* info = NULL;
+    if (GetAddrInfoW(peer->host, port, &hints, &info) == 0 && info != NULL) {
+        CopyMemory(&(peer->addr), info->ai_addr, info->ai_addrlen);
+        peer->addrlen = (int)info->ai_addrlen;
+        FreeAddrInfoW(info);
+        if (logfp != NULL) {
+            fwprintf(logfp, L"peer: host=%s, port=%s\n", peer->host, port);
+        }
+        peer->next = watcher->peers;
+        watcher->peers = peer;
+    } else {
+        if (logfp != NULL) {
+            fwprintf(logfp, L"peer: unknown host=%s\n", peer->host);
+        }
+        free(peer);
+    }
+}
+
+// isPushPeer(watcher, addr)
+static BOOL isPushPeer(ClipWatcher* watcher, const SOCKADDR_IN6* addr)
+{
+    for (PushPeer* peer = watcher->peers; peer != NULL; peer = peer->next) {
+        if (peer->addr.ss_family == AF_INET6) {
+            const SOCKADDR_IN6* a = (const SOCKADDR_IN6*)&(peer->addr);
+            if (memcmp(&(a->sin6_addr), &(addr->sin6_addr), 
+                       sizeof(IN6_ADDR)) == 0) return TRUE;
+        } else if (peer->addr.ss_family == AF_INET) {
+            // IPv4 peers are seen as IPv4-mapped addresses.
+            const SOCKADDR_IN* a = (const SOCKADDR_IN*)&(peer->addr);
+            if (IN6_IS_ADDR_V4MAPPED(&(addr->sin6_addr)) &&
+                memcmp(&(a->sin_addr), &(addr->sin6_addr.s6_addr[12]), 
+                       sizeof(IN_ADDR)) == 0) return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// freePushPeers(peers)
+static void freePushPeers(PushPeer* peer)
+{
+    while (peer != NULL) {
+	void* p = peer;
+	peer = peer->next;
+	free(p);
+    }
+}
+
+// freePushReceiver(watcher, rcv)
+static void freePushReceiver(ClipWatcher* watcher, PushReceiver* rcv)
+{
+    closesocket(rcv->s);
+    if (rcv->bytes != NULL) {
+        freeBuffer(&(watcher->pool), rcv->bytes);
+    }
+    free(rcv);
+}
+
+// removePushReceiver(watcher, rcv)
+static void removePushReceiver(ClipWatcher* watcher, PushReceiver* rcv)
+{
+    PushReceiver** prev = &(watcher->receivers);
+    while (*prev != NULL) {
+        if (*prev == rcv) {
+            *prev = rcv->next;
+            break;
+        }
+        prev = &((*prev)->next);
+    }
+    freePushReceiver(watcher, rcv);
+}
+
+// expirePushReceivers(watcher)
+//   Drops the pushes which have not completed in PUSH_RECV_TIMEOUT.
+static void expirePushReceivers(ClipWatcher* watcher)
+{
+    DWORD now = GetTickCount();
+    PushReceiver** prev = &(watcher->receivers);
+    while (*prev != NULL) {
+        PushReceiver* rcv = *prev;
+        if (PUSH_RECV_TIMEOUT < now - rcv->start) {
+            if (logfp != NULL) {
+                fwprintf(logfp, L"pushed: name=%s, nbytes=%u/%u, expired\n", 
+                         rcv->hdr.name, rcv->nbytes, rcv->hdr.nbytes);
+            }
+            *prev = rcv->next;
+            freePushReceiver(watcher, rcv);
+        } else {
+            prev = &(rcv->next);
+        }
+    }
+}
+
+// checkPushHeader(watcher, rcv)
+//   Checks the header of a push and allocates the buffer for the content.
+static BOOL checkPushHeader(ClipWatcher* watcher, PushReceiver* rcv)
+{
+    PushHeader* hdr = &(rcv->hdr);
+    if (hdr->signature != PUSH_SIGNATURE) return FALSE;
+    if (hdr->version != PUSH_VERSION) {
+        if (logfp != NULL) {
+            fwprintf(logfp, L"push: rejected, version=%u (expected %u)\n",
+                     hdr->version, PUSH_VERSION);
+        }
+        return FALSE;
+    }
+    if (PUSH_MAX_SIZE < hdr->nbytes) return FALSE;
+    hdr->name[_countof(hdr->name)-1] = L'\0';
+    LPCWSTR name = hdr->name;
+    int index = rindex(name, L'.');
+    // Reject anything that is not a plain file name of a peer.
+    if (index <= 0 || 
+        wcspbrk(name, L"\\/:") != NULL ||
+        wcsnicmp(name, watcher->name, index) == 0 ||
+        !isSubscribed(watcher, name, hdr->nbytes)) return FALSE;
+    rcv->bytes = (BYTE*) allocBuffer(&(watcher->pool), max(hdr->nbytes, 1));
+    return (rcv->bytes != NULL);
+}
+
+// readPushReceiver(watcher, rcv)
+//   Reads what has arrived so far. Returns 1 when the whole file 
+//   is received, 0 when more is to come and -1 on error.
+static int readPushReceiver(ClipWatcher* watcher, PushReceiver* rcv)
+{
+    for (;;) {
+        if (!rcv->inframe && 
+            rcv->bytes != NULL && rcv->nbytes == rcv->hdr.nbytes) return 1;
+        BYTE* dst;
+        DWORD n;
+        if (!rcv->inframe) {
+            dst = &(((BYTE*)&(rcv->framelen))[rcv->framepos]);
+            n = sizeof(rcv->framelen) - rcv->framepos;
+        } else if (rcv->bytes == NULL) {
+            dst = &(((BYTE*)&(rcv->hdr))[rcv->framepos]);
+            n = rcv->framelen - rcv->framepos;
+        } else {
+            dst = &(rcv->bytes[rcv->nbytes + rcv->framepos]);
+            n = rcv->framelen - rcv->framepos;
+        }
+        if (0 < n) {
+            int r = recv(rcv->s, (char*)dst, n, 0);
+            if (r == 0) return -1;
+            if (r < 0) {
+                return (WSAGetLastError() == WSAEWOULDBLOCK)? 0 : -1;
+            }
+            rcv->framepos += r;
+            if ((DWORD)r < n) continue;
+        }
+        if (!rcv->inframe) {
+            // The length of a frame is read.
+            if (rcv->bytes == NULL) {
+                if (rcv->framelen != sizeof(rcv->hdr)) {
+                    // A peer running another version.
+                    if (logfp != NULL) {
+                        fwprintf(logfp, L"push: rejected, header size=%u "
+                                 L"(expected %u)\n", 
+                                 rcv->framelen, (DWORD)sizeof(rcv->hdr));
+                    }
+                    return -1;
+                }
+            } else {
+                if (rcv->hdr.nbytes - rcv->nbytes < rcv->framelen) return -1;
+            }
+            rcv->inframe = TRUE;
+        } else if (rcv->bytes == NULL) {
+            // The header is read.
+            if (!checkPushHeader(watcher, rcv)) return -1;
+            rcv->inframe = FALSE;
+        } else {
+            rcv->nbytes += rcv->framelen;
+            rcv->inframe = FALSE;
+        }
+        rcv->framepos = 0;
+    }
+}
+
+// importPushedFile(watcher, hWnd, rcv)
+//   Copies a received file to the clipboard.
+static void importPushedFile(ClipWatcher* watcher, HWND hWnd, 
+                             PushReceiver* rcv)
+{
+    PushHeader* hdr = &(rcv->hdr);
+    BYTE* bytes = rcv->bytes;
+    DWORD nbytes = rcv->nbytes;
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s\\%s", 
+                    watcher->srcdir, hdr->name);
+    DWORD hash = getBytesHash(bytes, nbytes, 256);
+    traceEvent(watcher, TRACE_PUSH, path, nbytes, hdr->clock, hash);
+    // An older clip is dropped as if it were imported.
+    BOOL done = !isNewerClip(watcher, hdr->clock, path);
+    if (!done &&
+        importClipBytes(watcher, hWnd, path, bytes, nbytes)) {
+        mergeClock(watcher, hdr->clock);
+        setClipClock(watcher, hdr->clock, path);
+        traceEvent(watcher, TRACE_IMPORT, path, 0, hdr->clock, 0);
+        if (watcher->latency) {
+            WCHAR host[MAX_PATH];
+            getClipHost(path, host, _countof(host));
+            recordLatency(watcher, host, LATENCY_PUSH, &(hdr->stamp), 
+                          getPreciseTime());
+        }
+        done = TRUE;
+    }
+    FileEntry* entry = NULL;
+    if (done) {
+        entry = getFileEntry(watcher, path);
+    }
+    if (entry != NULL) {
+        // Remember the content so that the file
+        // arriving later is not imported twice.
+        entry->hash = hash;
+        entry->pushed = TRUE;
+    }
+}
+
+// acceptPushedFile(watcher, hWnd)
+//   Accepts a push from a peer. The content is read by
+//   receivePushedFile() as it arrives.
+static void acceptPushedFile(ClipWatcher* watcher, HWND hWnd)
+{
+    SOCKADDR_IN6 addr;
+    int addrlen = sizeof(addr);
+    SOCKET s = accept(watcher->listener, (SOCKADDR*)&addr, &addrlen);
+    if (s == INVALID_SOCKET) return;
+    expirePushReceivers(watcher);
+    int n = 0;
+    for (PushReceiver* rcv = watcher->receivers; rcv != NULL; rcv = rcv->next) {
+        n++;
+    }
+    if (!isPushPeer(watcher, &addr) || PUSH_MAX_RECEIVERS <= n) {
+        closesocket(s);
+        return;
+    }
+    PushReceiver* rcv = (PushReceiver*) malloc(sizeof(PushReceiver));
+    if (rcv == NULL) {
+        closesocket(s);
+        return;
+    }
+    ZeroMemory(rcv, sizeof(PushReceiver));
+    rcv->s = s;
+    rcv->start = GetTickCount();
+    // The accepted socket is non-blocking and inherits 
+    // WSAAsyncSelect(); wait for the data instead.
+    if (WSAAsyncSelect(s, hWnd, WM_NOTIFY_SOCKET, FD_READ | FD_CLOSE) != 0) {
+        freePushReceiver(watcher, rcv);
+        return;
+    }
+    rcv->next = watcher->receivers;
+    watcher->receivers = rcv;
+}
+
+// receivePushedFile(watcher, hWnd, s)
+//   Reads a push in progress and imports it when it is complete.
+static void receivePushedFile(ClipWatcher* watcher, HWND hWnd, SOCKET s)
+{
+    PushReceiver* rcv = watcher->receivers;
+    while (rcv != NULL && rcv->s != s) {
+        rcv = rcv->next;
+    }
+    if (rcv == NULL) return;
+    int status = readPushReceiver(watcher, rcv);
+    if (status == 0) return;
+    if (logfp != NULL) {
+        fwprintf(logfp, L"pushed: name=%s, nbytes=%u/%u\n", 
+                 rcv->hdr.name, rcv->nbytes, rcv->hdr.nbytes);
+    }
+    if (0 < status) {
+        importPushedFile(watcher, hWnd, rcv);
+    }
+    removePushReceiver(watcher, rcv);
+}
+
+// getSpillPath(spilldir, rec, data, path, pathlen)
+//   Builds the path of the spill file of a record. The ring can be
+//   written by any session, so only the name this sender would have
+//   used is accepted, and the directory is always our own.
+static BOOL getSpillPath(LPCWSTR spilldir, const RingRecord* rec, 
+                         const BYTE* data, LPWSTR path, int pathlen)
+{
+    WCHAR expected[MAX_PATH];
+    StringCchPrintf(expected, _countof(expected), L"%u-%s", 
+                    rec->sender, rec->name);
+    DWORD nchars = rec->ndata / sizeof(WCHAR);
+    if (nchars == 0 || _countof(expected) < nchars) return FALSE;
+    WCHAR name[MAX_PATH];
+    CopyMemory(name, data, sizeof(WCHAR)*nchars);
+    name[nchars-1] = L'\0';
+    if (wcspbrk(name, L"\\/:") != NULL ||
+        wcscmp(name, expected) != 0) return FALSE;
+    StringCchPrintf(path, pathlen, L"%s\\%s", spilldir, name);
+    return TRUE;
+}
+
+// acceptLocalRing(watcher, hWnd)
+//   Takes the latest clip sent by another instance on this machine.
+static void acceptLocalRing(ClipWatcher* watcher, HWND hWnd)
+{
+    LocalRing* ring = watcher->ring;
+    RingRecord last;
+    BYTE* lastdata = NULL;
+    if (WaitForSingleObject(ring->mutex, INFINITE) == WAIT_FAILED) return;
+    for (;;) {
+        RingRecord rec;
+        BYTE* data = NULL;
+        if (!getRingRecord(ring->header, ring->capacity, &(ring->cursor), 
+                           &rec, &data)) break;
+        if (rec.sender != GetCurrentProcessId() && data != NULL) {
+            if (lastdata != NULL) {
+                free(lastdata);
+            }
+            last = rec;
+            lastdata = data;
+        } else if (data != NULL) {
+            free(data);
+        }
+    }
+    ReleaseMutex(ring->mutex);
+    if (lastdata == NULL) return;
+
+    BYTE* bytes = lastdata;
+    DWORD nbytes = last.ndata;
+    last.name[_countof(last.name)-1] = L'\0';
+    if (wcspbrk(last.name, L"\\/:") != NULL) {
+        bytes = NULL;
+    } else if (last.spilled) {
+        // The content is in the spill file.
+        WCHAR spillpath[MAX_PATH];
+        bytes = NULL;
+        if (getSpillPath(ring->spilldir, &last, lastdata, 
+                         spillpath, _countof(spillpath))) {
+            bytes = readBytes(&(watcher->arena), spillpath, 
+                              sizeof(BITMAPFILEHEADER)+MAX_BITMAP_SIZE, 
+                              &nbytes);
+        } else if (logfp != NULL) {
+            fwprintf(logfp, L"ring: rejected spill: name=%s\n", last.name);
+        }
+    }
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s\\%s", 
+                    watcher->srcdir, last.name);
+    if (logfp != NULL) {
+        fwprintf(logfp, L"ring: accept name=%s, nbytes=%u\n", last.name, nbytes);
+    }
+    traceEvent(watcher, TRACE_RING, path, nbytes, last.clock, 0);
+    if (bytes != NULL &&
+        isNewerClip(watcher, last.clock, path) &&
+        importClipBytes(watcher, hWnd, path, bytes, nbytes)) {
+        mergeClock(watcher, last.clock);
+        setClipClock(watcher, last.clock, path);
+        traceEvent(watcher, TRACE_IMPORT, path, 0, last.clock, 0);
+        if (watcher->latency) {
+            WCHAR host[MAX_PATH];
+            getClipHost(path, host, _countof(host));
+            recordLatency(watcher, host, LATENCY_RING, &(last.stamp), 
+                          getPreciseTime());
+        }
+    }
+    free(lastdata);
+}
+
+//  CreateClipWatcher
+// 
+ClipWatcher* CreateClipWatcher(
+    LPCWSTR dstdir, LPCWSTR srcdir, LPCWSTR name)
+{
+    ClipWatcher* watcher = (ClipWatcher*) malloc(sizeof(ClipWatcher));
+    if (watcher == NULL) return NULL;
+
+    watcher->dstdir = wcsdup(dstdir);
+    watcher->srcdir = wcsdup(srcdir);
+    watcher->notifier = INVALID_HANDLE_VALUE;
+    watcher->name = wcsdup(name);
+    watcher->files = NULL;
+    watcher->seqno = 0;
+    watcher->listener = INVALID_SOCKET;
+    watcher->port = PUSH_DEFAULT_PORT;
+    watcher->peers = NULL;
+    watcher->push_thread = NULL;
+    watcher->push_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    InitializeCriticalSection(&(watcher->push_lock));
+    watcher->pushes = NULL;
+    watcher->push_generation = 0;
+    watcher->push_quit = 0;
+    watcher->receivers = NULL;
+    ZeroMemory(&(watcher->allow), sizeof(watcher->allow));
+    ZeroMemory(&(watcher->deny), sizeof(watcher->deny));
+    watcher->limits = NULL;
+    watcher->scan_threads = SCAN_MAX_THREADS;
+    watcher->compress = FALSE;
+    watcher->delta = FALSE;
+    watcher->keyframe.id = GetTickCount();
+    watcher->keyframe.ndeltas = 0;
+    watcher->keyframe.hdrsize = 0;
+    watcher->keyframe.ntiles = 0;
+    watcher->keyframe.hashes = NULL;
+    watcher->keyframe.hash = 0;
+    watcher->textkey.nbytes = 0;
+    watcher->textkey.ndeltas = 0;
+    watcher->textkey.nchunks = 0;
+    watcher->textkey.chunks = NULL;
+    watcher->clock = 0;
+    watcher->clip_clock = 0;
+    watcher->clip_path[0] = L'\0';
+    watcher->jobs = NULL;
+    watcher->write_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    watcher->drop = NULL;
+    watcher->staged = NULL;
+    watcher->stage_clean = GetTickCount()-STAGE_CLEAN_INTERVAL;
+    watcher->ring = NULL;
+    initExportScheduler(&(watcher->scheduler), 
+                        EXPORT_MIN_INTERVAL, EXPORT_MAX_DELAY, 0, 
+                        GetTickCount());
+
+    watcher->icon_id = 1;
+    watcher->blink_timer_id = 1;
+    watcher->check_timer_id = 2;
+    watcher->export_timer_id = 3;
+    watcher->icon_blinking = NULL;
+    watcher->icon_blink_count = 0;
+    watcher->show_balloon = 0;
+    watcher->locked = FALSE;
+    watcher->on_battery = FALSE;
+    watcher->trace = NULL;
+    watcher->trace_start = 0;
+    watcher->latency = FALSE;
+    watcher->share_offset = 0;
+    watcher->share_rtt = 0;
+    watcher->copy_time = 0;
+    ZeroMemory(&(watcher->stamp), sizeof(watcher->stamp));
+    watcher->stamper = NULL;
+    watcher->latency_peers = NULL;
+    watcher->latency_dump = GetTickCount();
+    initBufferPool(&(watcher->pool), POOL_MAX_RETAINED);
+    watcher->arena.pool = &(watcher->pool);
+    watcher->arena.blocks = NULL;
+    return watcher;
+}
+
+//  StartClipWatcher
+// 
+void StartClipWatcher(ClipWatcher* watcher)
+{
+    if (watcher->notifier == INVALID_HANDLE_VALUE) {
+        watcher->notifier = FindFirstChangeNotification(
+            watcher->srcdir, FALSE, 
+            (FILE_NOTIFY_CHANGE_FILE_NAME |
+             FILE_NOTIFY_CHANGE_SIZE |
+             FILE_NOTIFY_CHANGE_ATTRIBUTES |
+             FILE_NOTIFY_CHANGE_LAST_WRITE));
+        if (logfp != NULL) {
+            fwprintf(logfp, L"register: srcdir=%s, notifier=%p\n", 
+                     watcher->srcdir, watcher->notifier);
+        }
+    }
+}
+
+//  StopClipWatcher
+// 
+void StopClipWatcher(ClipWatcher* watcher)
+{
+    if (watcher->notifier != INVALID_HANDLE_VALUE) {
+        FindCloseChangeNotification(watcher->notifier);
+        watcher->notifier = INVALID_HANDLE_VALUE;
+    }
+}
+
+//  StartPushListener
+// 
+void StartPushListener(ClipWatcher* watcher, HWND hWnd)
+{
+    // Pushing is enabled only when peers are given.
+    if (watcher->peers == NULL) return;
+    if (watcher->listener != INVALID_SOCKET) return;
+
+    SOCKET s = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+    if (s == INVALID_SOCKET) return;
+    // Accept both IPv4 and IPv6.
+    DWORD v6only = 0;
+    setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6only, sizeof(v6only));
+    SOCKADDR_IN6 addr = {0};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(watcher->port);
+    addr.sin6_addr = in6addr_any;
+    if (bind(s, (SOCKADDR*)&addr, sizeof(addr)) == 0 &&
+        listen(s, SOMAXCONN) == 0 &&
+        WSAAsyncSelect(s, hWnd, WM_NOTIFY_SOCKET, FD_ACCEPT) == 0) {
+        watcher->listener = s;
+    } else {
+        closesocket(s);
+    }
+    if (logfp != NULL) {
+        fwprintf(logfp, L"listen: port=%u, listener=%p\n", 
+                 watcher->port, (void*)watcher->listener);
+    }
+}
+
+//  StopPushListener
+// 
+void StopPushListener(ClipWatcher* watcher)
+{
+    if (watcher->listener != INVALID_SOCKET) {
+        closesocket(watcher->listener);
+        watcher->listener = INVALID_SOCKET;
+    }
+}
+
+//  DestroyClipWatcher
+// 
+void DestroyClipWatcher(ClipWatcher* watcher)
+{
+    if (watcher->srcdir != NULL) {
+	free(watcher->srcdir);
+    }
+    if (watcher->dstdir != NULL) {
+	free(watcher->dstdir);
+    }
+    if (watcher->name != NULL) {
+	free(watcher->name);
+    }
+
+    freeFileEntries(watcher->files);
+    // The queued pushes are sent before the peers are freed.
+    stopPushWorker(watcher);
+    stopStampWriter(watcher);
+    if (watcher->push_event != NULL) {
+        CloseHandle(watcher->push_event);
+    }
+    DeleteCriticalSection(&(watcher->push_lock));
+    while (watcher->receivers != NULL) {
+        PushReceiver* rcv = watcher->receivers;
+        watcher->receivers = rcv->next;
+        freePushReceiver(watcher, rcv);
+    }
+    freePushPeers(watcher->peers);
+    freeHostFilter(&(watcher->allow));
+    freeHostFilter(&(watcher->deny));
+    freeSizeLimits(watcher->limits);
+    if (watcher->keyframe.hashes != NULL) {
+        free(watcher->keyframe.hashes);
+    }
+    if (watcher->textkey.chunks != NULL) {
+        free(watcher->textkey.chunks);
+    }
+    cancelWriteJobs(watcher);
+    if (watcher->write_event != NULL) {
+        CloseHandle(watcher->write_event);
+    }
+    cancelFileDrop(watcher);
+    while (watcher->staged != NULL) {
+        StagedFile* staged = watcher->staged;
+        watcher->staged = staged->next;
+        free(staged);
+    }
+    if (watcher->ring != NULL) {
+        closeLocalRing(watcher->ring);
+    }
+    if (watcher->trace != NULL) {
+        fclose(watcher->trace);
+    }
+    if (watcher->latency_peers != NULL) {
+        dumpLatency(watcher);
+        freeLatencyPeers(watcher->latency_peers);
+    }
+    resetArena(&(watcher->arena));
+    if (logfp != NULL) {
+        fwprintf(logfp, L"pool: requests=%u, allocs=%u, retained=%Iu\n",
+                 watcher->pool.nrequests, watcher->pool.nallocs, 
+                 watcher->pool.retained);
+    }
+    freeBufferPool(&(watcher->pool));
+
+    free(watcher);
+}
+
+
+// startBlinking(watcher, hWnd, icon)
+//   The timer runs only while the icon blinks.
+static void startBlinking(ClipWatcher* watcher, HWND hWnd, HICON icon)
+{
+    watcher->icon_blinking = icon;
+    watcher->icon_blink_count = ICON_BLINK_COUNT;
+    SetTimer(hWnd, watcher->blink_timer_id, ICON_BLINK_INTERVAL, NULL);
+}
+
+// isOnBattery()
+static BOOL isOnBattery()
+{
+    SYSTEM_POWER_STATUS status;
+    return (GetSystemPowerStatus(&status) && status.ACLineStatus == 0);
+}
+
+// watchFolder(watcher, hWnd)
+//   Registers the notifier. The timer retries it only while it fails.
+static void watchFolder(ClipWatcher* watcher, HWND hWnd)
+{
+    StartClipWatcher(watcher);
+    if (watcher->notifier != INVALID_HANDLE_VALUE || watcher->locked) {
+        KillTimer(hWnd, watcher->check_timer_id);
+    } else {
+        SetTimer(hWnd, watcher->check_timer_id, 
+                 (watcher->on_battery? 
+                  FILESYSTEM_BATTERY_INTERVAL : FILESYSTEM_INTERVAL), 
+                 NULL);
+    }
+}
+
+// exportSnapshot(watcher, hWnd, basepath, snap)
+//   Exports the formats copied from the clipboard and starts writing
+//   the large ones. Returns the size of the content exported.
+static SIZE_T exportSnapshot(ClipWatcher* watcher, HWND hWnd, 
+                             LPCWSTR basepath, ClipSnapshot* snap)
+{
+    // A newer clip pre-empts what is left of the last one.
+    cancelWriteJobs(watcher);
+    cancelPushJobs(watcher);
+    cancelFileDrop(watcher);
+    if (watcher->latency) {
+        // The pushes and the local ring carry the stamp with the
+        // clip; NAME.stm is written in the background.
+        setOriginStamp(watcher, watcher->clip_clock);
+        queueOriginStamp(watcher, hWnd);
+    }
+    SIZE_T nbytes = exportClipFile(watcher, basepath, snap);
+    if (snap->files != NULL) {
+        startFileDrop(watcher, hWnd, snap->files, snap->nfilechars);
+    }
+    stepWriteJobs(watcher, FALSE);
+    return nbytes;
+}
+
+// exportClipboard(watcher, hWnd)
+//   Exports the current clipboard content and notifies the user.
+//   Returns the size of the content exported.
+static SIZE_T exportClipboard(ClipWatcher* watcher, HWND hWnd)
+{
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s\\%s", 
+                    watcher->dstdir, watcher->name);
+    ClipSnapshot snap;
+    BOOL exported = FALSE;
+    for (int i = 0; i < CLIPBOARD_RETRY; i++) {
+        // The update has settled already; wait only before a retry.
+        if (0 < i) {
+            Sleep(CLIPBOARD_DELAY);
+        }
+        if (OpenClipboard(hWnd)) {
+            if (GetClipboardData(CF_ORIGIN) == NULL) {
+                exported = snapshotClipboard(&(watcher->arena), &snap, path);
+            }
+            WCHAR text[256];
+            int filetype = getClipboardText(text, _countof(text));
+            if (0 <= filetype) {
+                if (watcher->show_balloon) {
+                    NOTIFYICONDATA nidata = {0};
+                    nidata.cbSize = sizeof(nidata);
+                    nidata.hWnd = hWnd;
+                    nidata.uID = watcher->icon_id;
+                    nidata.uFlags = NIF_INFO;
+                    nidata.dwInfoFlags = NIIF_INFO;
+                    nidata.uTimeout = 1000;
+                    StringCchCopy(nidata.szInfoTitle, 
+                                  _countof(nidata.szInfoTitle), 
+                                  MESSAGE_UPDATED);
+                    StringCchCopy(nidata.szInfo, 
+                                  _countof(nidata.szInfo),
+                                  text);
+                    Shell_NotifyIcon(NIM_MODIFY, &nidata);
+                }
+                startBlinking(watcher, hWnd, HICON_FILETYPE[filetype]);
+            }
+            CloseClipboard();
+            break;
+        }
+    }
+
+    // The clipboard is released before anything is written.
+    SIZE_T nbytes = 0;
+    if (exported) {
+        nbytes = exportSnapshot(watcher, hWnd, path, &snap);
+    }
+    return nbytes;
+}
+
+// scheduleExport(watcher, hWnd)
+//   Sets the timer for the next export.
+static void scheduleExport(ClipWatcher* watcher, HWND hWnd)
+{
+    DWORD delay = getExportDelay(&(watcher->scheduler), GetTickCount());
+    if (delay == INFINITE) {
+        KillTimer(hWnd, watcher->export_timer_id);
+    } else {
+        SetTimer(hWnd, watcher->export_timer_id, delay, NULL);
+    }
+}
+
+//  clipWatcherWndProc
+//
+static LRESULT CALLBACK clipWatcherWndProc(
+    HWND hWnd,
+    UINT uMsg,
+    WPARAM wParam,
+    LPARAM lParam)
+{
+    //fwprintf(stderr, L"msg: %x, hWnd=%p, wParam=%p\n", uMsg, hWnd, wParam);
+
+    switch (uMsg) {
+    case WM_CREATE:
+    {
+        // Initialization.
+	CREATESTRUCT* cs = (CREATESTRUCT*)lParam;
+	ClipWatcher* watcher = (ClipWatcher*)(cs->lpCreateParams);
+	if (watcher != NULL) {
+	    SetWindowLongPtr(hWnd, GWLP_USERDATA, (LONG_PTR)watcher);
+            if (logfp != NULL) {
+                fwprintf(logfp, L"watcher: %s\n", watcher->name);
+            }
+	    // Start watching the clipboard content.
+            AddClipboardFormatListener(hWnd);
+            WTSRegisterSessionNotification(hWnd, NOTIFY_FOR_THIS_SESSION);
+            watcher->on_battery = isOnBattery();
+            watchFolder(watcher, hWnd);
+            StartPushListener(watcher, hWnd);
+	    SendMessage(hWnd, WM_TASKBAR_CREATED, 0, 0);
+	}
+	return FALSE;
+    }
+    
+    case WM_DESTROY:
+    {
+        // Clean up.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL) {
+            KillTimer(hWnd, watcher->blink_timer_id);
+            KillTimer(hWnd, watcher->check_timer_id);
+            KillTimer(hWnd, watcher->export_timer_id);
+            // Abandon the files being staged.
+            cancelFileDrop(watcher);
+            // Finish writing the last clip.
+            while (stepWriteJobs(watcher, TRUE));
+            StopPushListener(watcher);
+            WTSUnRegisterSessionNotification(hWnd);
+	    // Stop watching the clipboard content.
+            RemoveClipboardFormatListener(hWnd);
+	    // Unregister the icon.
+	    NOTIFYICONDATA nidata = {0};
+	    nidata.cbSize = sizeof(nidata);
+	    nidata.hWnd = hWnd;
+	    nidata.uID = watcher->icon_id;
+	    Shell_NotifyIcon(NIM_DELETE, &nidata);
+	}
+	PostQuitMessage(0);
+	return FALSE;
+    }
+
+    case WM_CLIPBOARDUPDATE:
+    {
+        // Clipboard change detected.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL) {
+            DWORD seqno = GetClipboardSequenceNumber();
+	    if (watcher->seqno < seqno) {
+                watcher->seqno = seqno;
+                if (logfp != NULL) {
+                    fwprintf(logfp, L"updated clipboard: seqno=%d\n", seqno);
+                }
+                ULONGLONG clock = 0;
+                if (!IsClipboardFormatAvailable(CF_ORIGIN)) {
+                    // A local copy: stamp it now rather than at export.
+                    WCHAR path[MAX_PATH];
+                    StringCchPrintf(path, _countof(path), L"%s\\%s", 
+                                    watcher->dstdir, watcher->name);
+                    clock = tickClock(watcher);
+                    setClipClock(watcher, clock, path);
+                    watcher->copy_time = getPreciseTime();
+                }
+                traceEvent(watcher, TRACE_CLIPBOARD, NULL, 0, clock, seqno);
+                notifyExportUpdate(&(watcher->scheduler), GetTickCount());
+                scheduleExport(watcher, hWnd);
+	    }
+	}
+	return FALSE;
+    }
+
+    case WM_NOTIFY_FILE:
+    {
+        // File change detected.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL) {
+            traceEvent(watcher, TRACE_NOTIFY, NULL, 0, 0, 0);
+            if (watcher->latency) {
+                // The stamps written after their clips.
+                checkPendingLatency(watcher);
+            }
+	    FileEntry* entry = checkFileChanges(watcher);
+	    if (entry != NULL) {
+                if (logfp != NULL) {
+                    fwprintf(logfp, L"updated file: path=%s\n", entry->path);
+                }
+                // Take it only if it is newer than the clipboard
+                // so that every host settles on the same clip.
+                ULONGLONG clock = getFileTimeValue(&(entry->mtime));
+                if (isNewerClip(watcher, clock, entry->path) &&
+                    importClipFile(watcher, hWnd, entry->path)) {
+                    mergeClock(watcher, clock);
+                    setClipClock(watcher, clock, entry->path);
+                    traceEvent(watcher, TRACE_IMPORT, entry->path, 0, clock, 0);
+                    if (watcher->latency) {
+                        recordFileLatency(watcher, entry->path, clock);
+                    }
+                }
+	    }
+            if (watcher->notifier == INVALID_HANDLE_VALUE) {
+                // The notifier has failed.
+                watchFolder(watcher, hWnd);
+            }
+	}
+	return FALSE;
+    }
+
+    case WM_NOTIFY_SOCKET:
+    {
+        // Push from a peer detected.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL) {
+            switch (WSAGETSELECTEVENT(lParam)) {
+            case FD_ACCEPT:
+                acceptPushedFile(watcher, hWnd);
+                break;
+            case FD_READ:
+            case FD_CLOSE:
+                receivePushedFile(watcher, hWnd, (SOCKET)wParam);
+                break;
+            }
+	}
+	return FALSE;
+    }
+
+    case WM_NOTIFY_RING:
+    {
+        // Clip from another instance on this machine.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL && watcher->ring != NULL) {
+            acceptLocalRing(watcher, hWnd);
+	}
+	return FALSE;
+    }
+
+    case WM_NOTIFY_DROP:
+    {
+        // Files staged.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL) {
+            finishFileDrop(watcher);
+	}
+	return FALSE;
+    }
+
+    case WM_NOTIFY_STAMP:
+    {
+        // NAME.stm written.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL) {
+            takeStampSample(watcher);
+	}
+	return FALSE;
+    }
+
+    case WM_COMMAND:
+    {
+        // Command specified.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	switch (LOWORD(wParam)) {
+	case IDM_OPEN:
+	    if (watcher != NULL) {
+		if (OpenClipboard(hWnd)) {
+                    openClipFile(&(watcher->arena));
+		    CloseClipboard();
+		}
+	    }
+	    break;
+	case IDM_EXIT:
+	    SendMessage(hWnd, WM_CLOSE, 0, 0);
+	    break;
+	}
+	return FALSE;
+    }
+
+    case WM_TIMECHANGE:
+    {
+        // Filesytem/Network share change detected.
+        // NOTICE: We wanted to check if wParam is DBT_DEVICEARRIVAL.
+        //   But it doesn't work when the system is suspended.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL) {
+            // Re-initialize the watcher object.
+            StopClipWatcher(watcher);
+            watchFolder(watcher, hWnd);
+        }
+        return TRUE;
+    }
+
+    case WM_WTSSESSION_CHANGE:
+    {
+        // Session lock/unlock.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL && 
+            (wParam == WTS_SESSION_LOCK || wParam == WTS_SESSION_UNLOCK)) {
+            watcher->locked = (wParam == WTS_SESSION_LOCK);
+            if (logfp != NULL) {
+                fwprintf(logfp, L"session: locked=%d\n", watcher->locked);
+            }
+            watchFolder(watcher, hWnd);
+        }
+        return FALSE;
+    }
+
+    case WM_POWERBROADCAST:
+    {
+        // AC/battery change.
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL && wParam == PBT_APMPOWERSTATUSCHANGE) {
+            watcher->on_battery = isOnBattery();
+            if (logfp != NULL) {
+                fwprintf(logfp, L"power: battery=%d\n", watcher->on_battery);
+            }
+            watchFolder(watcher, hWnd);
+        }
+        return TRUE;
+    }
+
+    case WM_NOTIFY_ICON:
+    {
+        // UI event handling.
+	POINT pt;
+        HMENU menu = GetMenu(hWnd);
+        if (menu != NULL) {
+            menu = GetSubMenu(menu, 0);
+        }
+	switch (lParam) {
+	case WM_LBUTTONDBLCLK:
+            if (menu != NULL) {
+                UINT item = GetMenuDefaultItem(menu, FALSE, 0);
+                SendMessage(hWnd, WM_COMMAND, MAKEWPARAM(item, 1), NULL);
+            }
+	    break;
+	case WM_LBUTTONUP:
+	    break;
+	case WM_RBUTTONUP:
+	    if (GetCursorPos(&pt)) {
+                SetForegroundWindow(hWnd);
+                if (menu != NULL) {
+                    TrackPopupMenu(menu, TPM_LEFTALIGN, 
+                                   pt.x, pt.y, 0, hWnd, NULL);
+                }
+		PostMessage(hWnd, WM_NULL, 0, 0);
+	    }
+	    break;
+	}
+	return FALSE;
+    }
+
+    case WM_TIMER:
+    {
+	LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+	ClipWatcher* watcher = (ClipWatcher*)lp;
+	if (watcher != NULL) {
+            UINT_PTR timer_id = wParam;
+            if (timer_id == watcher->blink_timer_id) {
+                // Blink the icon.
+                if (watcher->icon_blink_count) {
+                    watcher->icon_blink_count--;
+                    if (watcher->icon_blink_count == 0) {
+                        KillTimer(hWnd, watcher->blink_timer_id);
+                    }
+                    BOOL on = (watcher->icon_blink_count % 2);
+                    NOTIFYICONDATA nidata = {0};
+                    nidata.cbSize = sizeof(nidata);
+                    nidata.hWnd = hWnd;
+                    nidata.uID = watcher->icon_id;
+                    nidata.uFlags = NIF_ICON;
+                    nidata.hIcon = (on? watcher->icon_blinking : HICON_EMPTY);
+                    Shell_NotifyIcon(NIM_MODIFY, &nidata);
+                }
+            } else if (timer_id == watcher->check_timer_id) {
+                // Retry the filesystem.
+                watchFolder(watcher, hWnd);
+            } else if (timer_id == watcher->export_timer_id) {
+                // Export the last clipboard update.
+                KillTimer(hWnd, watcher->export_timer_id);
+                ExportScheduler* sched = &(watcher->scheduler);
+                if (getExportDelay(sched, GetTickCount()) == 0) {
+                    SIZE_T nbytes = exportClipboard(watcher, hWnd);
+                    if (logfp != NULL) {
+                        fwprintf(logfp, L"exported: nbytes=%Iu\n", nbytes);
+                    }
+                    traceEvent(watcher, TRACE_EXPORT, NULL, nbytes, 
+                               watcher->clip_clock, 0);
+                    finishExport(sched, GetTickCount(), nbytes);
+                }
+                scheduleExport(watcher, hWnd);
+            }
+        }
+        return FALSE;
+    }
+
+    case WM_CLOSE:
+	DestroyWindow(hWnd);
+	return FALSE;
+
+    default:
+        if (uMsg == WM_TASKBAR_CREATED) {
+            LONG_PTR lp = GetWindowLongPtr(hWnd, GWLP_USERDATA);
+            ClipWatcher* watcher = (ClipWatcher*)lp;
+            if (watcher != NULL) {
+                // Register the icon.
+                NOTIFYICONDATA nidata = {0};
+                nidata.cbSize = sizeof(nidata);
+                nidata.hWnd = hWnd;
+                nidata.uID = watcher->icon_id;
+                nidata.uFlags = NIF_ICON | NIF_MESSAGE | NIF_TIP;
+                nidata.uCallbackMessage = WM_NOTIFY_ICON;
+                nidata.hIcon = HICON_EMPTY;
+                StringCchPrintf(nidata.szTip, _countof(nidata.szTip),
+                                MESSAGE_WATCHING, watcher->srcdir);
+                Shell_NotifyIcon(NIM_ADD, &nidata);
+            }
+        }
+	return DefWindowProc(hWnd, uMsg, wParam, lParam);
+    }
+}
+
+
+// replayImport(watcher, now, path, clock)
+//   Takes the clip as importClipFile() would, without reading it:
+//   a trace does not record the content. The import itself is run
+//   by testImportExport().
+static BOOL replayImport(ClipWatcher* watcher, DWORD now, 
+                         LPCWSTR path, ULONGLONG clock)
+{
+    if (!isNewerClip(watcher, clock, path)) return FALSE;
+    wprintf(L"%8u import: name=%s\n", now, &(path[rindex(path, L'\\')+1]));
+    mergeClock(watcher, clock);
+    setClipClock(watcher, clock, path);
+    return TRUE;
+}
+
+// readTraceRecord(fp, rec, name)
+//   Reads a record and its file name. Returns FALSE at the end.
+static BOOL readTraceRecord(FILE* fp, TraceRecord* rec, WCHAR name[MAX_PATH])
+{
+    name[0] = L'\0';
+    if (fread(rec, sizeof(*rec), 1, fp) != 1) return FALSE;
+    if (0 < rec->namelen) {
+        if (MAX_PATH <= rec->namelen ||
+            fread(name, sizeof(WCHAR), rec->namelen, fp) != rec->namelen) {
+            return FALSE;
+        }
+        name[rec->namelen] = L'\0';
+    }
+    return TRUE;
+}
+
+// loadTraceExports(fp, &exports, &nexports, &writes)
+//   Collects what each recorded export wrote. The files written
+//   for an export are recorded just before it.
+static BOOL loadTraceExports(FILE* fp, ReplayExport** pexports, 
+                             int* pnexports, ReplayWrite** pwrites)
+{
+    ReplayExport* exports = NULL;
+    int nexports = 0, maxexports = 0;
+    ReplayWrite* writes = NULL;
+    int nwrites = 0, maxwrites = 0;
+    int first = 0;
+    TraceRecord rec;
+    WCHAR name[MAX_PATH];
+    while (readTraceRecord(fp, &rec, name)) {
+        if (rec.type == TRACE_WRITE) {
+            if (maxwrites <= nwrites) {
+                int n = max(16, maxwrites*2);
+                ReplayWrite* p = (ReplayWrite*) 
+                    realloc(writes, sizeof(ReplayWrite)*n);
+                if (p == NULL) goto fail;
+                writes = p;
+                maxwrites = n;
+            }
+            StringCchCopy(writes[nwrites].name, 
+                          _countof(writes[nwrites].name), name);
+            writes[nwrites].hash = rec.hash;
+            nwrites++;
+        } else if (rec.type == TRACE_EXPORT) {
+            if (maxexports <= nexports) {
+                int n = max(16, maxexports*2);
+                ReplayExport* p = (ReplayExport*) 
+                    realloc(exports, sizeof(ReplayExport)*n);
+                if (p == NULL) goto fail;
+                exports = p;
+                maxexports = n;
+            }
+            exports[nexports].nbytes = rec.nbytes;
+            exports[nexports].first = first;
+            exports[nexports].nwrites = nwrites - first;
+            nexports++;
+            first = nwrites;
+        }
+    }
+    *pexports = exports;
+    *pnexports = nexports;
+    *pwrites = writes;
+    return TRUE;
+
+fail:
+    if (exports != NULL) {
+        free(exports);
+    }
+    if (writes != NULL) {
+        free(writes);
+    }
+    return FALSE;
+}
+
+// replayWrite(pwrites, path, hash)
+//   Remembers a file written and returns TRUE if it has the same
+//   content as the last time.
+static BOOL replayWrite(FileEntry** pwrites, LPCWSTR path, DWORD hash)
+{
+    FileEntry* entry = findFileEntry(*pwrites, path);
+    if (entry == NULL) {
+        entry = (FileEntry*) malloc(sizeof(FileEntry));
+        if (entry == NULL) return FALSE;
+        ZeroMemory(entry, sizeof(FileEntry));
+        StringCchCopy(entry->path, _countof(entry->path), path);
+        entry->hash = ~hash;
+        entry->next = *pwrites;
+        *pwrites = entry;
+    }
+    BOOL same = (entry->hash == hash);
+    entry->hash = hash;
+    return same;
+}
+
+// replayTrace(path, interval, rate, realtime)
+//   Runs the sync decisions on the recorded events without the
+//   clipboard or the shared folder and prints them, so that the
+//   outputs of two builds for the same trace can be compared.
+//   The export timer is simulated on the recorded time line.
+//   The content of the clipboard is not recorded, so an export is
+//   taken to write what the recorded export following the last
+//   update wrote: its size is used for the rate limit and its files
+//   for the rewrites. The recorded counts are shown alongside.
+static int replayTrace(LPCWSTR path, DWORD interval, DWORD rate, 
+                       BOOL realtime)
+{
+    FILE* fp = _wfopen(path, L"rb");
+    if (fp == NULL) return 1;
+    TraceHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+        hdr.signature != TRACE_SIGNATURE || 
+        hdr.version != TRACE_VERSION) {
+        fclose(fp);
+        return 1;
+    }
+    hdr.name[_countof(hdr.name)-1] = L'\0';
+
+    // Read the exports first, then replay from the beginning.
+    ReplayExport* exps = NULL;
+    int nexps = 0;
+    ReplayWrite* expwrites = NULL;
+    long top = ftell(fp);
+    if (!loadTraceExports(fp, &exps, &nexps, &expwrites) ||
+        fseek(fp, top, SEEK_SET) != 0) {
+        fclose(fp);
+        return 1;
+    }
+
+    // Nothing is read or written in this directory.
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherReplay");
+    ClipWatcher* watcher = CreateClipWatcher(dirpath, dirpath, hdr.name);
+    if (watcher == NULL) {
+        free(exps);
+        free(expwrites);
+        fclose(fp);
+        return 1;
+    }
+    ExportScheduler* sched = &(watcher->scheduler);
+    initExportScheduler(sched, interval, max(interval, EXPORT_MAX_DELAY), 
+                        rate, 0);
+
+    ScanItem* items = NULL;
+    int nitems = 0;
+    int maxitems = 0;
+    FileEntry* writes = NULL;
+    FileEntry* recwrites = NULL;
+    int group = -1;             // the recorded export of the clipboard.
+    DWORD now = 0;
+    DWORD start = GetTickCount();
+    DWORD nupdates = 0, nexports = 0, nrecexports = 0;
+    DWORD delay_sum = 0, delay_max = 0;
+    DWORD nscans = 0, nfiles = 0, scan_sum = 0, scan_max = 0;
+    DWORD nimports = 0, nrecimports = 0;
+    DWORD nwrites = 0, nrewrites = 0;
+    DWORD nrecwrites = 0, nrecrewrites = 0;
+    BOOL eof = FALSE;
+    while (!eof || sched->pending) {
+        TraceRecord rec;
+        WCHAR name[MAX_PATH] = L"";
+        if (!eof) {
+            eof = !readTraceRecord(fp, &rec, name);
+        }
+        if (eof) {
+            // Export what is left.
+            if (!sched->pending) break;
+            rec.type = 0;
+            rec.time = now + getExportDelay(sched, now);
+        }
+        if (realtime && (LONG)(rec.time - (GetTickCount()-start)) > 0) {
+            Sleep(rec.time - (GetTickCount()-start));
+        }
+
+        // Fire the export timer up to the time of the event.
+        for (;;) {
+            DWORD delay = getExportDelay(sched, now);
+            if (delay == INFINITE || rec.time < now+delay) break;
+            now += delay;
+            DWORD latency = now - sched->first_update;
+            wprintf(L"%8u export: delay=%u\n", now, latency);
+            nexports++;
+            delay_sum += latency;
+            delay_max = max(delay_max, latency);
+            SIZE_T size = 0;
+            if (0 <= group && group < nexps) {
+                ReplayExport* exp = &exps[group];
+                size = (SIZE_T)exp->nbytes;
+                for (int k = 0; k < exp->nwrites; k++) {
+                    ReplayWrite* w = &expwrites[exp->first+k];
+                    WCHAR wpath[MAX_PATH];
+                    StringCchPrintf(wpath, _countof(wpath), L"%s\\%s", 
+                                    watcher->srcdir, w->name);
+                    nwrites++;
+                    if (replayWrite(&writes, wpath, w->hash)) {
+                        wprintf(L"%8u rewrite: name=%s\n", now, w->name);
+                        nrewrites++;
+                    }
+                }
+            }
+            finishExport(sched, now, size);
+        }
+        now = rec.time;
+
+        WCHAR filepath[MAX_PATH];
+        StringCchPrintf(filepath, _countof(filepath), L"%s\\%s", 
+                        watcher->srcdir, name);
+        switch (rec.type) {
+        case TRACE_CLIPBOARD:
+            nupdates++;
+            group = nrecexports;
+            if (rec.clock != 0) {
+                // A local copy.
+                StringCchPrintf(filepath, _countof(filepath), L"%s\\%s", 
+                                watcher->dstdir, watcher->name);
+                watcher->clock = max(watcher->clock, rec.clock);
+                setClipClock(watcher, rec.clock, filepath);
+            }
+            notifyExportUpdate(sched, now);
+            break;
+        case TRACE_EXPORT:
+            nrecexports++;
+            break;
+        case TRACE_WRITE:
+            // The same content written again under the same name.
+            nrecwrites++;
+            if (replayWrite(&recwrites, filepath, rec.hash)) {
+                nrecrewrites++;
+            }
+            break;
+        case TRACE_FILE:
+            if (maxitems <= nitems) {
+                int n = max(16, maxitems*2);
+                ScanItem* p = (ScanItem*) realloc(items, sizeof(ScanItem)*n);
+                if (p == NULL) break;
+                items = p;
+                maxitems = n;
+            }
+            StringCchCopy(items[nitems].path, _countof(items[nitems].path), 
+                          filepath);
+            items[nitems].nbytes = rec.nbytes;
+            items[nitems].opened = TRUE;
+            items[nitems].hash = rec.hash;
+            items[nitems].mtime.dwLowDateTime = (DWORD)rec.clock;
+            items[nitems].mtime.dwHighDateTime = (DWORD)(rec.clock >> 32);
+            nitems++;
+            break;
+        case TRACE_SCAN:
+        {
+            nscans++;
+            nfiles += nitems;
+            scan_sum += rec.hash;
+            scan_max = max(scan_max, rec.hash);
+            FileEntry* entry = mergeScanItems(watcher, items, nitems);
+            nitems = 0;
+            if (entry != NULL &&
+                replayImport(watcher, now, entry->path,
+                             getFileTimeValue(&(entry->mtime)))) {
+                nimports++;
+            }
+            break;
+        }
+        case TRACE_PUSH:
+        {
+            if (replayImport(watcher, now, filepath, rec.clock)) {
+                nimports++;
+            }
+            FileEntry* entry = getFileEntry(watcher, filepath);
+            if (entry != NULL) {
+                entry->hash = rec.hash;
+                entry->pushed = TRUE;
+            }
+            break;
+        }
+        case TRACE_RING:
+            if (replayImport(watcher, now, filepath, rec.clock)) {
+                nimports++;
+            }
+            break;
+        case TRACE_IMPORT:
+            nrecimports++;
+            break;
+        }
+    }
+
+    wprintf(L"updates: %u, exports: %u (recorded %u), "
+            L"delay: avg %u, max %u msec\n",
+            nupdates, nexports, nrecexports,
+            (0 < nexports)? delay_sum/nexports : 0, delay_max);
+    wprintf(L"writes: %u, rewrites: %u (recorded %u, %u)\n", 
+            nwrites, nrewrites, nrecwrites, nrecrewrites);
+    wprintf(L"scans: %u, files: %u, time: avg %u, max %u msec\n",
+            nscans, nfiles, (0 < nscans)? scan_sum/nscans : 0, scan_max);
+    wprintf(L"imports: %u (recorded %u)\n", nimports, nrecimports);
+
+    if (items != NULL) {
+        free(items);
+    }
+    freeFileEntries(writes);
+    freeFileEntries(recwrites);
+    if (exps != NULL) {
+        free(exps);
+    }
+    if (expwrites != NULL) {
+        free(expwrites);
+    }
+    DestroyClipWatcher(watcher);
+    fclose(fp);
+    return 0;
+}
+
+
+// dumpWakeups(counter, now)
+//   Logs the wakeups since the start and the rate since the last dump.
+static void dumpWakeups(WakeupCounter* counter, DWORD now)
+{
+    DWORD total = (counter->nnotify + counter->nwrite + 
+                   counter->nring + counter->nmessage);
+    DWORD elapsed = now - counter->dump;
+    if (logfp != NULL) {
+        fwprintf(logfp, L"wakeup: total=%u in %u sec, %u/min since the "
+                 L"last (notify=%u, write=%u, ring=%u, message=%u, timer=%u)\n",
+                 total, (now - counter->start)/1000,
+                 (0 < elapsed)? 
+                 (DWORD)((ULONGLONG)(total - counter->ndumped)*60000/elapsed) : 0,
+                 counter->nnotify, counter->nwrite, counter->nring, 
+                 counter->nmessage, counter->ntimer);
+    }
+    counter->dump = now;
+    counter->ndumped = total;
+}
+
+// testRing()
+//   Runs records of various sizes through a small ring so that they
+//   wrap around its end, lets a reader fall behind, breaks the shared
+//   header, and checks which spill file names are accepted. Then it
+//   prints how fast records of each size go through a full size ring.
+static int testRing()
+{
+    const DWORD capacity = 4096;
+    RingHeader* hdr = (RingHeader*) calloc(1, sizeof(RingHeader)+capacity);
+    if (hdr == NULL) return 1;
+    initRing(hdr, capacity);
+    BYTE src[1000];
+    for (DWORD i = 0; i < sizeof(src); i++) {
+        src[i] = (BYTE)((i * 2654435761U) >> 24);
+    }
+
+    int nfailed = 0;
+    ULONGLONG cursor = 0;
+    for (DWORD i = 0; i < 1000; i++) {
+        RingRecord rec = {0};
+        rec.sender = i;
+        DWORD n = (i*37) % sizeof(src);
+        RingRecord got;
+        BYTE* data = NULL;
+        if (!putRingRecord(hdr, capacity, &rec, &i, sizeof(i), src, n) ||
+            !getRingRecord(hdr, capacity, &cursor, &got, &data) ||
+            data == NULL || got.sender != i || got.ndata != sizeof(i)+n ||
+            memcmp(data, &i, sizeof(i)) != 0 ||
+            memcmp(&(data[sizeof(i)]), src, n) != 0) {
+            wprintf(L"ring: record %u: FAILED\n", i);
+            nfailed++;
+        }
+        if (data != NULL) {
+            free(data);
+        }
+    }
+
+    // A reader overtaken by the writer skips to the latest record,
+    // and a record larger than the ring is refused.
+    ULONGLONG behind = cursor;
+    for (int i = 0; i < 4; i++) {
+        RingRecord rec = {0};
+        putRingRecord(hdr, capacity, &rec, NULL, 0, src, sizeof(src));
+    }
+    RingRecord got;
+    BYTE* data = NULL;
+    RingRecord big = {0};
+    if (getRingRecord(hdr, capacity, &behind, &got, &data) || behind != hdr->head ||
+        putRingRecord(hdr, capacity, &big, NULL, 0, src, capacity)) {
+        wprintf(L"ring: overrun: FAILED\n");
+        nfailed++;
+    }
+
+    // Another process may write anything to the header; our own
+    // capacity keeps every access within the ring.
+    const DWORD capacities[] = { 0, 1, capacity*2, 0xffffffff };
+    for (int i = 0; i < _countof(capacities); i++) {
+        RingRecord rec = {0};
+        ULONGLONG reader = hdr->head;
+        putRingRecord(hdr, capacity, &rec, NULL, 0, src, 100);
+        hdr->capacity = capacities[i];
+        data = NULL;
+        if (!getRingRecord(hdr, capacity, &reader, &got, &data) ||
+            data == NULL || got.ndata != 100) {
+            wprintf(L"ring: capacity=%u: FAILED\n", capacities[i]);
+            nfailed++;
+        }
+        if (data != NULL) {
+            free(data);
+        }
+        hdr->capacity = capacity;
+    }
+    // A record claiming more than was written is skipped.
+    {
+        RingRecord rec = {0};
+        ULONGLONG reader = hdr->head;
+        putRingRecord(hdr, capacity, &rec, NULL, 0, src, 100);
+        copyFromRing(hdr, capacity, reader, &rec, sizeof(rec));
+        rec.ndata = 0xffffff00;
+        copyToRing(hdr, capacity, reader, &rec, sizeof(rec));
+        data = NULL;
+        if (getRingRecord(hdr, capacity, &reader, &got, &data) ||
+            reader != hdr->head) {
+            wprintf(L"ring: broken record: FAILED\n");
+            nfailed++;
+        }
+    }
+
+    // Only the name the sender would use is taken as a spill file.
+    const struct { LPCWSTR name; BOOL accepted; } spills[] = {
+        { L"1234-PEER.bmp", TRUE },
+        { L"999-PEER.bmp", FALSE },
+        { L"..\\..\\Windows\\win.ini", FALSE },
+        { L"C:\\Users\\Public\\secret.txt", FALSE },
+        { L"\\\\server\\share\\1234-PEER.bmp", FALSE },
+        { L"", FALSE },
+    };
+    RingRecord rec = {0};
+    rec.sender = 1234;
+    StringCchCopy(rec.name, _countof(rec.name), L"PEER.bmp");
+    for (int i = 0; i < _countof(spills); i++) {
+        WCHAR path[MAX_PATH];
+        rec.ndata = sizeof(WCHAR)*(wcslen(spills[i].name)+1);
+        BOOL accepted = getSpillPath(L"C:\\ProgramData\\ClipWatcher", &rec,
+                                     (const BYTE*)spills[i].name, 
+                                     path, _countof(path));
+        if (accepted != spills[i].accepted) {
+            wprintf(L"ring: spill %s: FAILED\n", spills[i].name);
+            nfailed++;
+        }
+    }
+
+    free(hdr);
+
+    // Throughput of a writer and a reader taking turns, as with the
+    // lock held, through the ring in the shared mapping.
+    const DWORD sizes[] = { 4*1024, 256*1024, RING_MAX_PAYLOAD };
+    const SIZE_T TOTAL = 1024*1024*1024;
+    hdr = (RingHeader*) calloc(1, sizeof(RingHeader)+RING_SIZE);
+    BYTE* body = (BYTE*) malloc(RING_MAX_PAYLOAD);
+    if (hdr == NULL || body == NULL) return 1;
+    initRing(hdr, RING_SIZE);
+    for (DWORD i = 0; i < RING_MAX_PAYLOAD; i++) {
+        body[i] = (BYTE)((i * 2654435761U) >> 24);
+    }
+    cursor = 0;
+    for (int k = 0; k < _countof(sizes); k++) {
+        DWORD nrecords = (DWORD)(TOTAL / sizes[k]);
+        ULONGLONG t0 = getPreciseTime();
+        for (DWORD i = 0; i < nrecords; i++) {
+            RingRecord rec = {0};
+            data = NULL;
+            if (!putRingRecord(hdr, RING_SIZE, &rec, NULL, 0, body, sizes[k]) ||
+                !getRingRecord(hdr, RING_SIZE, &cursor, &got, &data) ||
+                data == NULL || got.ndata != sizes[k]) {
+                wprintf(L"ring: nbytes=%u: FAILED\n", sizes[k]);
+                nfailed++;
+                break;
+            }
+            free(data);
+        }
+        ULONGLONG usec = (getPreciseTime() - t0)/10;
+        wprintf(L"ring: nbytes=%u, %u records, %I64u usec, %I64u MB/s\n",
+                sizes[k], nrecords, usec, 
+                (0 < usec)? (ULONGLONG)nrecords*sizes[k]/usec : 0);
+    }
+    free(body);
+    free(hdr);
+
+    wprintf(L"ring: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+    return (nfailed == 0)? 0 : 1;
+}
+
+// testLatency()
+//   Simulates copies between peers whose clocks are off from the
+//   clock of the shared folder by up to seconds, with uneven round
+//   trips to the folder, and checks that every delay counted is within
+//   the error of the two estimates (half their round trips).
+static int testLatency()
+{
+    const int NPEERS = 4;
+    // Offsets of the local clocks (100ns) and the one-way trips to
+    // the folder (100ns), which vary up to twice as long.
+    const LONGLONG skews[NPEERS] = { 0, 30000000, -25000000, 400000 };
+    const ULONGLONG trips[NPEERS] = { 10000, 50000, 200000, 2000 };
+    const ULONGLONG DELAY = 500000;
+    ULONGLONG now = 130000000000000000ULL;
+    DWORD seed = 1;
+
+    ClipWatcher* peers[NPEERS];
+    for (int i = 0; i < NPEERS; i++) {
+        peers[i] = (ClipWatcher*) calloc(1, sizeof(ClipWatcher));
+        if (peers[i] == NULL) return 1;
+        peers[i]->latency_dump = GetTickCount();
+        for (int j = 0; j < 8; j++) {
+            seed = seed*1103515245 + 12345;
+            ULONGLONG up = trips[i] + trips[i]*((seed >> 16) % 100)/100;
+            seed = seed*1103515245 + 12345;
+            ULONGLONG down = trips[i] + trips[i]*((seed >> 16) % 100)/100;
+            ULONGLONG t0 = now + skews[i];
+            updateShareOffset(peers[i], t0, t0+up+down, now+up);
+            now += 10000000;
+        }
+    }
+
+    int nfailed = 0;
+    LONGLONG maxerror = 0;
+    for (int i = 0; i < NPEERS; i++) {
+        for (int j = 0; j < NPEERS; j++) {
+            if (i == j) continue;
+            WCHAR host[64];
+            StringCchPrintf(host, _countof(host), L"PEER%d", i);
+            peers[i]->copy_time = now + skews[i];
+            setOriginStamp(peers[i], now);
+            LatencyPeer* peer = getLatencyPeer(peers[j], host, LATENCY_PUSH);
+            if (peer == NULL) return 1;
+            ULONGLONG sum = peer->sum;
+            DWORD nskewed = peer->nskewed;
+            recordLatency(peers[j], host, LATENCY_PUSH, &(peers[i]->stamp), 
+                          now+DELAY+skews[j]);
+            LONGLONG error = (LONGLONG)(peer->sum-sum) - (LONGLONG)DELAY/10;
+            LONGLONG bound = (peers[i]->share_rtt + peers[j]->share_rtt)/20 + 1;
+            maxerror = max(maxerror, _abs64(error));
+            if (peer->nskewed != nskewed || bound < _abs64(error)) {
+                wprintf(L"latency: PEER%d -> PEER%d: error=%I64dus, "
+                        L"bound=%I64dus: FAILED\n", i, j, error, bound);
+                nfailed++;
+            }
+            now += 10000000;
+        }
+    }
+
+    wprintf(L"latency: %d peers, max error=%I64dus: %s\n", NPEERS, maxerror,
+            (nfailed == 0)? L"OK" : L"FAILED");
+    for (int i = 0; i < NPEERS; i++) {
+        freeLatencyPeers(peers[i]->latency_peers);
+        free(peers[i]);
+    }
+    return (nfailed == 0)? 0 : 1;
+}
+
+// simulateExports(sched, start, updates, nupdates, nbytes, exports, maxexports)
+//   Runs the export timer of the window on a virtual clock from start.
+//   The updates and the exports are msec after start. Returns the
+//   number of exports.
+static int simulateExports(ExportScheduler* sched, DWORD start, 
+                           const DWORD* updates, int nupdates, SIZE_T nbytes,
+                           DWORD* exports, int maxexports)
+{
+    int nexports = 0;
+    int i = 0;
+    DWORD now = start;
+    for (;;) {
+        DWORD delay = getExportDelay(sched, now);
+        if (i < nupdates && 
+            (delay == INFINITE || updates[i] <= (now - start) + delay)) {
+            // An update comes before the timer.
+            now = start + updates[i++];
+            notifyExportUpdate(sched, now);
+        } else if (delay != INFINITE) {
+            now += delay;
+            if (nexports < maxexports) {
+                exports[nexports] = now - start;
+            }
+            nexports++;
+            finishExport(sched, now, nbytes);
+        } else {
+            break;
+        }
+    }
+    return nexports;
+}
+
+// testScheduler()
+//   Feeds bursts of clipboard updates to the export scheduler on a
+//   virtual clock and checks when they are exported: after the burst
+//   settles, no later than the max delay, and no sooner than the
+//   rate allows. Every case also runs across the wraparound of the
+//   tick count, and an update after weeks of idle is not held back
+//   by an old budget.
+static int testScheduler()
+{
+    const DWORD INTERVAL = 200;
+    const DWORD MAX_DELAY = 1000;
+    DWORD burst[] = { 0, 50, 100, 150 };
+    DWORD steady[30];
+    for (int i = 0; i < _countof(steady); i++) {
+        steady[i] = i*100;
+    }
+    DWORD spaced[] = { 0, 500, 5000 };
+    DWORD pair[] = { 0, 500 };
+    const struct {
+        LPCWSTR name;
+        const DWORD* updates;
+        int nupdates;
+        DWORD rate;
+        SIZE_T nbytes;
+        DWORD expected[4];
+        int nexpected;
+    } cases[] = {
+        // Only the last update of a burst is exported.
+        { L"trailing edge", burst, _countof(burst), 0, 1000, 
+          { 350 }, 1 },
+        // Steady updates are exported every MAX_DELAY.
+        { L"max delay", steady, _countof(steady), 0, 1000, 
+          { 1000, 2100, 3100 }, 3 },
+        // 4MB at 1MB/s holds the next export for 4 sec.
+        { L"rate", spaced, _countof(spaced), 1000000, 4000000, 
+          { 200, 4200, 8200 }, 3 },
+        // But never for longer than EXPORT_MAX_BACKOFF.
+        { L"max backoff", pair, _countof(pair), 1000, 0xffffffff, 
+          { 200, 200+EXPORT_MAX_BACKOFF }, 2 },
+    };
+    const DWORD starts[] = { 12345, 0xffffff00, 0xffffffff };
+
+    int nfailed = 0;
+    for (int k = 0; k < _countof(starts); k++) {
+        for (int i = 0; i < _countof(cases); i++) {
+            ExportScheduler sched;
+            initExportScheduler(&sched, INTERVAL, MAX_DELAY, cases[i].rate, 
+                                starts[k]);
+            DWORD exports[8];
+            int nexports = simulateExports(&sched, starts[k], 
+                                           cases[i].updates, cases[i].nupdates,
+                                           cases[i].nbytes, 
+                                           exports, _countof(exports));
+            BOOL ok = (nexports == cases[i].nexpected);
+            for (int j = 0; ok && j < nexports; j++) {
+                ok = (exports[j] == cases[i].expected[j]);
+            }
+            if (!ok) {
+                wprintf(L"scheduler: %s, start=%u: %d exports, first at %u: "
+                        L"FAILED\n", cases[i].name, starts[k], nexports, 
+                        (0 < nexports)? exports[0] : 0);
+                nfailed++;
+            }
+        }
+    }
+
+    // A budget left before the tick count went half way around (about
+    // 25 days) must not look like it is still ahead.
+    ExportScheduler sched;
+    initExportScheduler(&sched, INTERVAL, MAX_DELAY, 1000000, 0);
+    DWORD updates[] = { 0, 0x80000000+5000 };
+    DWORD exports[4];
+    int nexports = simulateExports(&sched, 0, updates, _countof(updates), 
+                                   4000000, exports, _countof(exports));
+    if (nexports != 2 || exports[1] != updates[1]+INTERVAL) {
+        wprintf(L"scheduler: long idle: %d exports, last at %u: FAILED\n",
+                nexports, (0 < nexports)? exports[nexports-1] : 0);
+        nfailed++;
+    }
+
+    wprintf(L"scheduler: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+    return (nfailed == 0)? 0 : 1;
+}
+
+// receiveClip(watcher, clock, path)
+//   Takes a clip from another host as the imports do. Returns TRUE
+//   if the clipboard is rewritten.
+static BOOL receiveClip(ClipWatcher* watcher, ULONGLONG clock, LPCWSTR path)
+{
+    if (!isNewerClip(watcher, clock, path)) return FALSE;
+    mergeClock(watcher, clock);
+    setClipClock(watcher, clock, path);
+    return TRUE;
+}
+
+// testConvergence()
+//   Simulates hosts which copy in turn and exchange the clips in any
+//   order and with delays, some of them with their clocks seconds
+//   ahead. Every host must end with the same clip, a copy made after
+//   taking a clip must be newer than it, and two hosts copying in the
+//   same tick must agree after one exchange (by the host names).
+//   It prints how many times the clipboards were rewritten.
+static int testConvergence()
+{
+    const int NHOSTS = 5;
+    const int NCOPIES = 500;
+    const LONGLONG skews[NHOSTS] = { 0, 50000000, 0, 0, 3000000 };
+    typedef struct { int to; ULONGLONG clock; int from; } Message;
+    Message* queue = (Message*) malloc(sizeof(Message)*NCOPIES*2*NHOSTS);
+    if (queue == NULL) return 1;
+    ClipWatcher* hosts[NHOSTS];
+    WCHAR paths[NHOSTS][MAX_PATH];
+    ULONGLONG wall = getWallClock();
+    for (int i = 0; i < NHOSTS; i++) {
+        hosts[i] = (ClipWatcher*) calloc(1, sizeof(ClipWatcher));
+        if (hosts[i] == NULL) return 1;
+        // A clock ahead runs ahead of the others until they take
+        // a clip from it.
+        hosts[i]->clock = wall + skews[i];
+        StringCchPrintf(paths[i], _countof(paths[i]), 
+                        L"\\\\server\\clip\\PEER%d.txt", i);
+    }
+
+    int nfailed = 0;
+    int nqueued = 0;
+    int nrewrites = 0;
+    DWORD seed = 1;
+    for (int k = 0; k < NCOPIES; k++) {
+        // One host copies, or two in the same tick.
+        seed = seed*1103515245 + 12345;
+        int i = (seed >> 16) % NHOSTS;
+        int j = (((seed >> 8) & 7) == 0)? (i+1) % NHOSTS : i;
+        if (i != j) {
+            hosts[j]->clock = hosts[i]->clock = max(hosts[i]->clock, 
+                                                    hosts[j]->clock);
+        }
+        for (int c = 0; c < ((i == j)? 1 : 2); c++) {
+            int h = (c == 0)? i : j;
+            ULONGLONG prev = hosts[h]->clip_clock;
+            LPCWSTR prevpath = hosts[h]->clip_path;
+            ULONGLONG clock = tickClock(hosts[h]);
+            if (prev != 0 && compareClips(clock, paths[h], prev, prevpath) <= 0) {
+                wprintf(L"clock: copy %d on PEER%d is not newer than "
+                        L"the clip it replaces: FAILED\n", k, h);
+                nfailed++;
+            }
+            setClipClock(hosts[h], clock, paths[h]);
+            for (int to = 0; to < NHOSTS; to++) {
+                if (to != h) {
+                    queue[nqueued].to = to;
+                    queue[nqueued].clock = clock;
+                    queue[nqueued].from = h;
+                    nqueued++;
+                }
+            }
+        }
+        // Deliver some of the clips in the queue in a random order.
+        seed = seed*1103515245 + 12345;
+        int ndeliver = (k == NCOPIES-1)? nqueued : (seed >> 16) % (nqueued+1);
+        for (int n = 0; n < ndeliver; n++) {
+            seed = seed*1103515245 + 12345;
+            int m = (seed >> 16) % nqueued;
+            Message msg = queue[m];
+            queue[m] = queue[--nqueued];
+            nrewrites += receiveClip(hosts[msg.to], msg.clock, paths[msg.from]);
+        }
+    }
+    for (int i = 1; i < NHOSTS; i++) {
+        if (hosts[i]->clip_clock != hosts[0]->clip_clock ||
+            wcscmp(hosts[i]->clip_path, hosts[0]->clip_path) != 0) {
+            wprintf(L"clock: PEER%d has not converged: FAILED\n", i);
+            nfailed++;
+        }
+    }
+
+    // Two hosts copying in the same tick agree after one exchange:
+    // the one with the lower name takes the other.
+    for (int i = 0; i < 2; i++) {
+        hosts[i]->clock = hosts[0]->clock;
+    }
+    ULONGLONG clock0 = tickClock(hosts[0]);
+    ULONGLONG clock1 = tickClock(hosts[1]);
+    setClipClock(hosts[0], clock0, paths[0]);
+    setClipClock(hosts[1], clock1, paths[1]);
+    BOOL rewritten0 = receiveClip(hosts[0], clock1, paths[1]);
+    BOOL rewritten1 = receiveClip(hosts[1], clock0, paths[0]);
+    if (clock0 != clock1 || !rewritten0 || rewritten1 ||
+        wcscmp(hosts[0]->clip_path, paths[1]) != 0) {
+        wprintf(L"clock: same tick: FAILED\n");
+        nfailed++;
+    }
+
+    wprintf(L"clock: %d hosts, %d copies, %d rewrites: %s\n", 
+            NHOSTS, NCOPIES, nrewrites, (nfailed == 0)? L"OK" : L"FAILED");
+    for (int i = 0; i < NHOSTS; i++) {
+        free(hosts[i]);
+    }
+    free(queue);
+    return (nfailed == 0)? 0 : 1;
+}
+
+// isSameFile(path1, path2, nbytes)
+static BOOL isSameFile(LPCWSTR path1, LPCWSTR path2, ULONGLONG nbytes)
+{
+    HANDLE fp1 = CreateFile(path1, GENERIC_READ, FILE_SHARE_READ, NULL, 
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    HANDLE fp2 = CreateFile(path2, GENERIC_READ, FILE_SHARE_READ, NULL, 
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    BYTE* buf1 = (BYTE*) malloc(FILEDROP_CHUNK_SIZE);
+    BYTE* buf2 = (BYTE*) malloc(FILEDROP_CHUNK_SIZE);
+    LARGE_INTEGER size;
+    BOOL same = (fp1 != INVALID_HANDLE_VALUE && fp2 != INVALID_HANDLE_VALUE &&
+                 buf1 != NULL && buf2 != NULL &&
+                 GetFileSizeEx(fp2, &size) && 
+                 (ULONGLONG)size.QuadPart == nbytes);
+    for (ULONGLONG offset = 0; same && offset < nbytes; 
+         offset += FILEDROP_CHUNK_SIZE) {
+        DWORD n = (DWORD)min(nbytes-offset, FILEDROP_CHUNK_SIZE);
+        same = (readChunk(fp1, offset, buf1, n) &&
+                readChunk(fp2, offset, buf2, n) &&
+                memcmp(buf1, buf2, n) == 0);
+    }
+    if (buf1 != NULL) {
+        free(buf1);
+    }
+    if (buf2 != NULL) {
+        free(buf2);
+    }
+    if (fp1 != INVALID_HANDLE_VALUE) {
+        CloseHandle(fp1);
+    }
+    if (fp2 != INVALID_HANDLE_VALUE) {
+        CloseHandle(fp2);
+    }
+    return same;
+}
+
+// testReadBMP()
+//   Writes an 8K screenshot to a file in a temporary directory a row
+//   at a time, and imports it with readBMPFile(). It prints how long
+//   that takes against a plain read of the same file, and how much
+//   the peak memory of the process grew. The DIB is read once into
+//   the memory given to the clipboard, so the peak must not grow by
+//   much more than the DIB itself; a copy through another buffer
+//   would double it. Run it before the other tests raise the peak.
+static int testReadBMP()
+{
+    const LONG WIDTH = 7680, HEIGHT = 4320;
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherTest");
+    CreateDirectory(dirpath, NULL);
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s\\BMPTEST%s", 
+                    dirpath, FILE_EXT_BITMAP);
+    DWORD stride = WIDTH*4;
+    DWORD ndib = sizeof(BITMAPINFOHEADER) + stride*HEIGHT;
+    DWORD* row = (DWORD*) malloc(stride);
+    if (row == NULL) return 1;
+
+    int nfailed = 0;
+    BITMAPFILEHEADER filehdr = {0};
+    filehdr.bfType = BMP_SIGNATURE;
+    filehdr.bfSize = sizeof(filehdr)+ndib;
+    filehdr.bfOffBits = sizeof(filehdr)+sizeof(BITMAPINFOHEADER);
+    BITMAPINFOHEADER infohdr = {0};
+    infohdr.biSize = sizeof(infohdr);
+    infohdr.biWidth = WIDTH;
+    infohdr.biHeight = HEIGHT;
+    infohdr.biPlanes = 1;
+    infohdr.biBitCount = 32;
+    infohdr.biCompression = BI_RGB;
+    HANDLE fp = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD writtenbytes;
+    if (fp == INVALID_HANDLE_VALUE ||
+        !WriteFile(fp, &filehdr, sizeof(filehdr), &writtenbytes, NULL) ||
+        !WriteFile(fp, &infohdr, sizeof(infohdr), &writtenbytes, NULL)) {
+        nfailed++;
+    }
+    for (LONG y = 0; nfailed == 0 && y < HEIGHT; y++) {
+        for (LONG x = 0; x < WIDTH; x++) {
+            row[x] = 0xff000000 | (x*255/WIDTH << 16) | (y*255/HEIGHT << 8);
+        }
+        if (!WriteFile(fp, row, stride, &writtenbytes, NULL)) {
+            nfailed++;
+        }
+    }
+    if (fp != INVALID_HANDLE_VALUE) {
+        CloseHandle(fp);
+    }
+    if (nfailed != 0) {
+        wprintf(L"bmp: cannot write %s\n", path);
+        free(row);
+        return 1;
+    }
+
+    PROCESS_MEMORY_COUNTERS pmc0, pmc1;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc0, sizeof(pmc0));
+    ULONGLONG t0 = getPreciseTime();
+    HANDLE data = readBMPFile(path, NULL);
+    ULONGLONG usec = (getPreciseTime()-t0)/10;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc1, sizeof(pmc1));
+    SIZE_T peak = pmc1.PeakPagefileUsage - pmc0.PagefileUsage;
+    if (data == NULL || GlobalSize(data) < ndib) {
+        wprintf(L"bmp: read: FAILED\n");
+        nfailed++;
+    } else {
+        BYTE* bytes = (BYTE*) GlobalLock(data);
+        if (bytes == NULL ||
+            memcmp(bytes, &infohdr, sizeof(infohdr)) != 0 ||
+            memcmp(&bytes[ndib-stride], row, stride) != 0) {
+            wprintf(L"bmp: content: FAILED\n");
+            nfailed++;
+        }
+        if (bytes != NULL) {
+            GlobalUnlock(data);
+        }
+    }
+    // Only a peak above the one before is seen.
+    if (pmc0.PeakPagefileUsage < pmc1.PeakPagefileUsage &&
+        ndib + ndib/4 < peak) {
+        wprintf(L"bmp: peak: FAILED\n");
+        nfailed++;
+    }
+    if (data != NULL) {
+        GlobalFree(data);
+    }
+
+    // A plain read of the file for comparison.
+    BYTE* buf = (BYTE*) malloc(filehdr.bfSize);
+    ULONGLONG usec0 = 0;
+    fp = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, 
+                    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (buf != NULL && fp != INVALID_HANDLE_VALUE) {
+        DWORD readbytes;
+        t0 = getPreciseTime();
+        ReadFile(fp, buf, filehdr.bfSize, &readbytes, NULL);
+        usec0 = (getPreciseTime()-t0)/10;
+    }
+    if (fp != INVALID_HANDLE_VALUE) {
+        CloseHandle(fp);
+    }
+    if (buf != NULL) {
+        free(buf);
+    }
+
+    wprintf(L"bmp: %dx%d, %u bytes, read %I64u usec (plain read %I64u usec), "
+            L"peak +%Iu bytes (%.2fx)\n", WIDTH, HEIGHT, ndib, usec, usec0, 
+            peak, (double)peak/ndib);
+    wprintf(L"bmp: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+    DeleteFile(path);
+    free(row);
+    return (nfailed == 0)? 0 : 1;
+}
+
+// testTileDelta()
+//   Writes a series of screenshots in which a few lines are typed one
+//   after another, at full HD and 8K, and reconstructs each delta from
+//   the keyframe. It prints the bytes written against those of the
+//   bitmaps in full, and how long the reconstruction takes (including
+//   the keyframe read). A delta must not be reconstructed when a pixel
+//   of it or of the keyframe has been changed.
+static int testTileDelta()
+{
+    const LONG sizes[][2] = { { 1920, 1080 }, { 7680, 4320 } };
+    const int NFRAMES = 8;
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherTest");
+    CreateDirectory(dirpath, NULL);
+    ClipWatcher* watcher = CreateClipWatcher(dirpath, dirpath, L"TILETEST");
+    if (watcher == NULL) return 1;
+    watcher->delta = TRUE;
+    WCHAR basepath[MAX_PATH];
+    StringCchPrintf(basepath, _countof(basepath), L"%s\\%s", 
+                    dirpath, watcher->name);
+    WCHAR keypath[MAX_PATH];
+    StringCchPrintf(keypath, _countof(keypath), L"%s%s", 
+                    basepath, FILE_EXT_BITMAP);
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s%s", 
+                    basepath, FILE_EXT_BITMAPDELTA);
+
+    int nfailed = 0;
+    for (int k = 0; k < _countof(sizes); k++) {
+        LONG width = sizes[k][0];
+        LONG height = sizes[k][1];
+        SIZE_T stride = width*4;
+        SIZE_T nbytes = sizeof(BITMAPINFOHEADER) + stride*height;
+        BITMAPINFO* bmp = (BITMAPINFO*) malloc(nbytes);
+        if (bmp == NULL) return 1;
+        ZeroMemory(bmp, sizeof(BITMAPINFOHEADER));
+        bmp->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        bmp->bmiHeader.biWidth = width;
+        bmp->bmiHeader.biHeight = height;
+        bmp->bmiHeader.biPlanes = 1;
+        bmp->bmiHeader.biBitCount = 32;
+        bmp->bmiHeader.biCompression = BI_RGB;
+        BYTE* bits = &(((BYTE*)bmp)[sizeof(BITMAPINFOHEADER)]);
+        for (LONG y = 0; y < height; y++) {
+            DWORD* row = (DWORD*)&bits[y*stride];
+            for (LONG x = 0; x < width; x++) {
+                // Windows on a plain desktop.
+                row[x] = (((x/200 + y/150) % 2)? 0xffe0e0e0 : 0xffc0c0c0);
+            }
+        }
+
+        ULONGLONG nfull = 0, nwritten = 0;
+        ULONGLONG maxusec = 0, sumusec = 0;
+        int ndeltas = 0;
+        BYTE* delta = NULL;
+        DWORD ndelta = 0;
+        DWORD seed = 1;
+        for (int i = 0; i < NFRAMES; i++) {
+            // A line of text typed.
+            LONG y0 = height/4 + i*24;
+            for (LONG y = y0; y < y0+16; y++) {
+                DWORD* row = (DWORD*)&bits[y*stride];
+                for (LONG x = width/8; x < width/2; x++) {
+                    seed = seed*1103515245 + 12345;
+                    row[x] = 0xff000000 | ((seed >> 16) & 0x00ffffff);
+                }
+            }
+            LPCWSTR ext = writeBMPFile(watcher, basepath, bmp, nbytes);
+            while (stepWriteJobs(watcher, TRUE));
+            resetArena(&(watcher->arena));
+            WCHAR extpath[MAX_PATH];
+            StringCchPrintf(extpath, _countof(extpath), L"%s%s", 
+                            basepath, ext);
+            WIN32_FILE_ATTRIBUTE_DATA attrs;
+            if (!GetFileAttributesEx(extpath, GetFileExInfoStandard, &attrs)) {
+                nfailed++;
+                break;
+            }
+            nfull += sizeof(BITMAPFILEHEADER)+nbytes;
+            nwritten += attrs.nFileSizeLow;
+            if (_wcsicmp(ext, FILE_EXT_BITMAPDELTA) != 0) continue;
+
+            if (delta != NULL) {
+                free(delta);
+            }
+            delta = readBytes(NULL, path, MAX_BITMAP_SIZE, &ndelta);
+            if (delta == NULL) {
+                nfailed++;
+                break;
+            }
+            ULONGLONG t0 = getPreciseTime();
+            HANDLE data = readTileDelta(path, delta, ndelta);
+            ULONGLONG usec = (getPreciseTime()-t0)/10;
+            maxusec = max(maxusec, usec);
+            sumusec += usec;
+            ndeltas++;
+            BYTE* dst = (data != NULL)? (BYTE*) GlobalLock(data) : NULL;
+            if (dst == NULL || memcmp(dst, bmp, nbytes) != 0) {
+                wprintf(L"tiledelta: %dx%d: frame %d: FAILED\n", 
+                        width, height, i);
+                nfailed++;
+            }
+            if (dst != NULL) {
+                GlobalUnlock(data);
+            }
+            if (data != NULL) {
+                GlobalFree(data);
+            }
+        }
+        wprintf(L"tiledelta: %dx%d, %d frames, %d deltas, "
+                L"%I64u of %I64u bytes written, "
+                L"reconstruct %I64u usec (max %I64u usec)\n",
+                width, height, NFRAMES, ndeltas, nwritten, nfull, 
+                (0 < ndeltas)? sumusec/ndeltas : 0, maxusec);
+        if (ndeltas != NFRAMES-1) {
+            nfailed++;
+        }
+
+        if (delta != NULL) {
+            // A pixel of the last delta changed.
+            delta[ndelta-1] ^= 1;
+            HANDLE data = readTileDelta(path, delta, ndelta);
+            delta[ndelta-1] ^= 1;
+            // A pixel of the keyframe, away from the tiles typed, changed
+            // with its id kept.
+            HANDLE fp = CreateFile(keypath, GENERIC_WRITE, 0, NULL, 
+                                   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 
+                                   NULL);
+            BYTE b = 0;
+            if (fp != INVALID_HANDLE_VALUE) {
+                writeChunk(fp, sizeof(BITMAPFILEHEADER)+nbytes-1, &b, 1);
+                CloseHandle(fp);
+            }
+            HANDLE data2 = readTileDelta(path, delta, ndelta);
+            if (data != NULL || data2 != NULL) {
+                wprintf(L"tiledelta: %dx%d: corrupted: FAILED\n", 
+                        width, height);
+                nfailed++;
+            }
+            if (data != NULL) {
+                GlobalFree(data);
+            }
+            if (data2 != NULL) {
+                GlobalFree(data2);
+            }
+            free(delta);
+        }
+        free(bmp);
+    }
+
+    wprintf(L"tiledelta: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+    DeleteFile(keypath);
+    DeleteFile(path);
+    DestroyClipWatcher(watcher);
+    return (nfailed == 0)? 0 : 1;
+}
+
+// testLZ()
+//   Compresses 4MB of prose, of a log and of random bytes as -z does,
+//   and prints the ratio and the median speed of the compression and
+//   of the decompression. Each must expand back to the same bytes,
+//   and a stream cut short or with an offset out of the text is
+//   refused.
+static int testLZ()
+{
+    const DWORD NBYTES = 4*1024*1024;
+    const int NRUNS = 5;
+    const LPCSTR words[] = { "the ", "clip ", "board ", "is ", 
+                             "shared ", "with ", "a ", "folder.\r\n" };
+    BYTE* src = (BYTE*) malloc(NBYTES+64);
+    BYTE* dst = (BYTE*) malloc(getLZBound(NBYTES));
+    BYTE* out = (BYTE*) malloc(NBYTES);
+    BufferPool pool;
+    initBufferPool(&pool, POOL_MAX_RETAINED);
+    Arena arena = {0};
+    arena.pool = &pool;
+    if (src == NULL || dst == NULL || out == NULL) return 1;
+
+    int nfailed = 0;
+    const LPCWSTR kinds[] = { L"prose", L"log", L"random" };
+    for (int k = 0; k < _countof(kinds); k++) {
+        DWORD n = 0;
+        DWORD seed = 1;
+        while (n < NBYTES) {
+            seed = seed*1103515245 + 12345;
+            DWORD r = seed >> 16;
+            if (k == 0) {
+                LPCSTR word = words[r % _countof(words)];
+                while (*word != '\0') {
+                    src[n++] = *(word++);
+                }
+            } else if (k == 1) {
+                LPSTR line = (LPSTR)&src[n];
+                StringCchPrintfA(line, 64, 
+                                 "08:%02u:%02u.%03u INFO request %u done\r\n",
+                                 n/1000000 % 60, n/10000 % 60, r % 1000, r);
+                n += strlen(line);
+            } else {
+                src[n++] = (BYTE)r;
+            }
+        }
+        n = NBYTES;
+
+        ULONGLONG cusecs[NRUNS], dusecs[NRUNS];
+        DWORD nz = 0;
+        BOOL same = TRUE;
+        for (int i = 0; i < NRUNS; i++) {
+            ULONGLONG t0 = getPreciseTime();
+            nz = compressLZ(&arena, src, n, dst);
+            ULONGLONG t1 = getPreciseTime();
+            same = (same && 0 < nz && decompressLZ(dst, nz, out, n) &&
+                    memcmp(src, out, n) == 0);
+            ULONGLONG t2 = getPreciseTime();
+            cusecs[i] = max((t1-t0)/10, 1);
+            dusecs[i] = max((t2-t1)/10, 1);
+            resetArena(&arena);
+        }
+        qsort(cusecs, NRUNS, sizeof(ULONGLONG), compareULONGLONG);
+        qsort(dusecs, NRUNS, sizeof(ULONGLONG), compareULONGLONG);
+        wprintf(L"lz: %s %u -> %u bytes (%u%%), compress %I64u MB/s, "
+                L"decompress %I64u MB/s\n", 
+                kinds[k], n, nz, (DWORD)((ULONGLONG)nz*100/n),
+                n/cusecs[NRUNS/2], n/dusecs[NRUNS/2]);
+        if (!same) {
+            wprintf(L"lz: %s: FAILED\n", kinds[k]);
+            nfailed++;
+        }
+
+        // Cut short.
+        if (decompressLZ(dst, nz-1, out, n)) {
+            wprintf(L"lz: %s: cut: FAILED\n", kinds[k]);
+            nfailed++;
+        }
+    }
+
+    // "clip" repeated from 4 bytes back, and from before the start.
+    BYTE seq[] = { 0x40, 'c', 'l', 'i', 'p', 4, 0, 0x10, '.' };
+    if (!decompressLZ(seq, sizeof(seq), out, 9) ||
+        memcmp(out, "clipclip.", 9) != 0) {
+        wprintf(L"lz: match: FAILED\n");
+        nfailed++;
+    }
+    seq[5] = 5;
+    if (decompressLZ(seq, sizeof(seq), out, 9)) {
+        wprintf(L"lz: offset: FAILED\n");
+        nfailed++;
+    }
+    wprintf(L"lz: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+
+    freeBufferPool(&pool);
+    free(out);
+    free(dst);
+    free(src);
+    return (nfailed == 0)? 0 : 1;
+}
+
+// testExportEvents()
+//   Exports a text of 200K characters with -z as the window does for
+//   each clipboard update, and prints how many buffers each event takes
+//   from the pool and how many of them had to be allocated, with the
+//   median and the 99th percentile of the time an event takes.
+static int testExportEvents()
+{
+    const int NCHARS = 200*1000;
+    const int NEVENTS = 200;
+    const LPCWSTR words[] = { L"the ", L"clip ", L"board ", L"is ", 
+                              L"shared ", L"with ", L"a ", L"folder.\r\n" };
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherTest");
+    CreateDirectory(dirpath, NULL);
+    ClipWatcher* watcher = CreateClipWatcher(dirpath, dirpath, L"EXPORTTEST");
+    LPWSTR text = (LPWSTR) malloc(sizeof(WCHAR)*(NCHARS+16));
+    ULONGLONG* usecs = (ULONGLONG*) malloc(sizeof(ULONGLONG)*NEVENTS);
+    if (watcher == NULL || text == NULL || usecs == NULL) return 1;
+    watcher->compress = TRUE;
+    int nchars = 0;
+    DWORD seed = 1;
+    while (nchars < NCHARS) {
+        seed = seed*1103515245 + 12345;
+        LPCWSTR word = words[(seed >> 16) % _countof(words)];
+        while (*word != L'\0') {
+            text[nchars++] = *(word++);
+        }
+    }
+    WCHAR basepath[MAX_PATH];
+    StringCchPrintf(basepath, _countof(basepath), L"%s\\%s", 
+                    dirpath, watcher->name);
+
+    DWORD nrequests = 0, nallocs = 0;
+    for (int i = -1; i < NEVENTS; i++) {
+        // The first event fills the pool.
+        if (i == 0) {
+            nrequests = watcher->pool.nrequests;
+            nallocs = watcher->pool.nallocs;
+        }
+        text[(i+1)*997 % nchars] = L'A' + (i+1) % 26;
+        ClipSnapshot snap;
+        ZeroMemory(&snap, sizeof(snap));
+        snap.text = text;
+        snap.nchars = nchars;
+        ULONGLONG t0 = getPreciseTime();
+        exportClipFile(watcher, basepath, &snap);
+        while (stepWriteJobs(watcher, TRUE));
+        resetArena(&(watcher->arena));
+        if (0 <= i) {
+            usecs[i] = (getPreciseTime()-t0)/10;
+        }
+    }
+    nrequests = watcher->pool.nrequests - nrequests;
+    nallocs = watcher->pool.nallocs - nallocs;
+    qsort(usecs, NEVENTS, sizeof(ULONGLONG), compareULONGLONG);
+    wprintf(L"export: %d events, %.2f buffers (%.2f allocated) per event, "
+            L"p50 %I64u usec, p99 %I64u usec\n",
+            NEVENTS, (double)nrequests/NEVENTS, (double)nallocs/NEVENTS, 
+            usecs[NEVENTS/2], usecs[NEVENTS*99/100]);
+    int nfailed = (nallocs == 0)? 0 : 1;
+    wprintf(L"export: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s%s", basepath, FILE_EXT_TEXTZ);
+    DeleteFile(path);
+    free(usecs);
+    free(text);
+    DestroyClipWatcher(watcher);
+    return nfailed;
+}
+
+// exportTestClip(watcher, basepath)
+//   Exports the clipboard as the window does for an update.
+static void exportTestClip(ClipWatcher* watcher, LPCWSTR basepath)
+{
+    ClipSnapshot snap;
+    if (OpenClipboard(NULL)) {
+        BOOL success = snapshotClipboard(&(watcher->arena), &snap, basepath);
+        CloseClipboard();
+        if (success) {
+            exportSnapshot(watcher, NULL, basepath, &snap);
+            while (stepWriteJobs(watcher, TRUE));
+        }
+    }
+    resetArena(&(watcher->arena));
+}
+
+// isClipboardData(format, bytes, nbytes)
+//   Checks that the clipboard has the bytes in the format.
+static BOOL isClipboardData(UINT format, const BYTE* bytes, SIZE_T nbytes)
+{
+    BOOL same = FALSE;
+    if (OpenClipboard(NULL)) {
+        HANDLE data = GetClipboardData(format);
+        if (data != NULL && nbytes <= GlobalSize(data)) {
+            LPVOID p = GlobalLock(data);
+            if (p != NULL) {
+                same = (memcmp(p, bytes, nbytes) == 0);
+                GlobalUnlock(data);
+            }
+        }
+        CloseClipboard();
+    }
+    return same;
+}
+
+// testImportExport()
+//   Puts clips on the clipboard, exports them from one watcher into a
+//   temporary directory and imports the files written with another
+//   one, as two machines sharing the folder do. For a short text, a
+//   large text written as it is transcoded, a large text with -z, an
+//   edited one with -d, a screenshot and an edited one with -d, the
+//   clipboard must get back the same content from the file of the
+//   expected type. It prints how long each export and import takes.
+static int testImportExport()
+{
+    const int NCHARS = 1024*1024;
+    const LONG WIDTH = 1920, HEIGHT = 1080;
+    // Some characters take 3 bytes in UTF-8, and a pair of surrogates 4.
+    const LPCWSTR words[] = { L"the ", L"clip ", L"board ", L"\x00e9t\x00e9 ",
+                              L"\x30af\x30ea\x30c3\x30d7 ", L"\xd83d\xdccb ", 
+                              L"folder.\r\n" };
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherTest");
+    CreateDirectory(dirpath, NULL);
+    ClipWatcher* exporter = CreateClipWatcher(dirpath, dirpath, L"EXPORTTEST");
+    ClipWatcher* importer = CreateClipWatcher(dirpath, dirpath, L"IMPORTTEST");
+    LPWSTR text = (LPWSTR) malloc(sizeof(WCHAR)*(NCHARS+16));
+    SIZE_T stride = WIDTH*4;
+    SIZE_T ndib = sizeof(BITMAPINFOHEADER) + stride*HEIGHT;
+    BITMAPINFO* bmp = (BITMAPINFO*) malloc(ndib);
+    if (exporter == NULL || importer == NULL || 
+        text == NULL || bmp == NULL) return 1;
+    int nchars = 0;
+    DWORD seed = 1;
+    while (nchars < NCHARS) {
+        seed = seed*1103515245 + 12345;
+        LPCWSTR word = words[(seed >> 16) % _countof(words)];
+        while (*word != L'\0') {
+            text[nchars++] = *(word++);
+        }
+    }
+    text[nchars] = L'\0';
+    ZeroMemory(bmp, sizeof(BITMAPINFOHEADER));
+    bmp->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmp->bmiHeader.biWidth = WIDTH;
+    bmp->bmiHeader.biHeight = HEIGHT;
+    bmp->bmiHeader.biPlanes = 1;
+    bmp->bmiHeader.biBitCount = 32;
+    bmp->bmiHeader.biCompression = BI_RGB;
+    BYTE* bits = &(((BYTE*)bmp)[sizeof(BITMAPINFOHEADER)]);
+    for (LONG y = 0; y < HEIGHT; y++) {
+        DWORD* row = (DWORD*)&bits[y*stride];
+        for (LONG x = 0; x < WIDTH; x++) {
+            row[x] = (((x/200 + y/150) % 2)? 0xffe0e0e0 : 0xffc0c0c0);
+        }
+    }
+    WCHAR basepath[MAX_PATH];
+    StringCchPrintf(basepath, _countof(basepath), L"%s\\%s", 
+                    dirpath, exporter->name);
+
+    const struct {
+        LPCWSTR name;
+        int nchars;             // 0 for the screenshot.
+        BOOL compress;
+        BOOL delta;
+        LPCWSTR ext;
+    } clips[] = {
+        { L"text", 100, FALSE, FALSE, FILE_EXT_TEXT },
+        { L"large text", NCHARS, FALSE, FALSE, FILE_EXT_TEXT },
+        { L"large text -z", NCHARS, TRUE, FALSE, FILE_EXT_TEXTZ },
+        { L"keyframe -d", NCHARS, FALSE, TRUE, FILE_EXT_TEXT },
+        { L"edited -d", NCHARS, FALSE, TRUE, FILE_EXT_TEXTDELTA },
+        { L"screenshot", 0, FALSE, FALSE, FILE_EXT_BITMAP },
+        { L"keyframe -d", 0, FALSE, TRUE, FILE_EXT_BITMAP },
+        { L"edited -d", 0, FALSE, TRUE, FILE_EXT_BITMAPDELTA },
+    };
+    int nfailed = 0;
+    for (int i = 0; i < _countof(clips); i++) {
+        exporter->compress = clips[i].compress;
+        exporter->delta = clips[i].delta;
+        importer->delta = clips[i].delta;
+        int n = clips[i].nchars;
+        WCHAR c = L'\0';
+        if (0 < n) {
+            // A letter typed in the middle, not splitting a pair.
+            if (IS_HIGH_SURROGATE(text[n-1])) {
+                n--;
+            }
+            int k = n/2;
+            while (IS_LOW_SURROGATE(text[k]) || IS_HIGH_SURROGATE(text[k])) {
+                k++;
+            }
+            text[k] = L'A' + i;
+            c = text[n];
+            text[n] = L'\0';
+        } else {
+            // A line of text typed.
+            LONG y0 = HEIGHT/4 + i*24;
+            for (LONG y = y0; y < y0+16; y++) {
+                DWORD* row = (DWORD*)&bits[y*stride];
+                for (LONG x = WIDTH/8; x < WIDTH/2; x++) {
+                    seed = seed*1103515245 + 12345;
+                    row[x] = 0xff000000 | ((seed >> 16) & 0x00ffffff);
+                }
+            }
+        }
+        if (OpenClipboard(NULL)) {
+            EmptyClipboard();
+            if (0 < n) {
+                setClipboardText(text, n);
+            } else {
+                setClipboardDIB(bmp);
+            }
+            CloseClipboard();
+        }
+        ULONGLONG t0 = getPreciseTime();
+        exportTestClip(exporter, basepath);
+        ULONGLONG t1 = getPreciseTime();
+
+        // Nothing is left on the clipboard to be taken for the clip.
+        if (OpenClipboard(NULL)) {
+            EmptyClipboard();
+            CloseClipboard();
+        }
+        WCHAR path[MAX_PATH];
+        StringCchPrintf(path, _countof(path), L"%s%s", 
+                        basepath, clips[i].ext);
+        BOOL success = importClipFile(importer, NULL, path);
+        resetArena(&(importer->arena));
+        ULONGLONG t2 = getPreciseTime();
+        if (0 < n) {
+            success = (success &&
+                       isClipboardData(CF_UNICODETEXT, (const BYTE*)text, 
+                                       sizeof(WCHAR)*(n+1)));
+            text[n] = c;
+        } else {
+            success = (success && 
+                       isClipboardData(CF_DIB, (const BYTE*)bmp, ndib));
+        }
+        wprintf(L"import: %s (%s), export %I64u usec, import %I64u usec: %s\n",
+                clips[i].name, &(clips[i].ext[1]), (t1-t0)/10, (t2-t1)/10,
+                success? L"OK" : L"FAILED");
+        if (!success) {
+            nfailed++;
+        }
+    }
+    wprintf(L"import: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+
+    const LPCWSTR exts[] = { FILE_EXT_TEXT, FILE_EXT_TEXTZ, FILE_EXT_TEXTDELTA,
+                             FILE_EXT_BITMAP, FILE_EXT_BITMAPDELTA };
+    for (int i = 0; i < _countof(exts); i++) {
+        WCHAR path[MAX_PATH];
+        StringCchPrintf(path, _countof(path), L"%s%s", basepath, exts[i]);
+        DeleteFile(path);
+    }
+    if (OpenClipboard(NULL)) {
+        EmptyClipboard();
+        CloseClipboard();
+    }
+    free(bmp);
+    free(text);
+    DestroyClipWatcher(importer);
+    DestroyClipWatcher(exporter);
+    return (nfailed == 0)? 0 : 1;
+}
+
+// testMixedExport()
+//   Exports a clip of a text and an 8K screenshot as the window does,
+//   and prints how long it takes from the copy until another watcher
+//   has imported the text, while the screenshot is still written, and
+//   until it has imported the screenshot. Then a newer clip is copied
+//   while the screenshot is written: the write must be cancelled,
+//   leaving neither NAME.bmp nor its temporary file, and the newer
+//   text must be imported.
+static int testMixedExport()
+{
+    const LONG WIDTH = 7680, HEIGHT = 4320;
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherTest");
+    CreateDirectory(dirpath, NULL);
+    ClipWatcher* exporter = CreateClipWatcher(dirpath, dirpath, L"EXPORTTEST");
+    ClipWatcher* importer = CreateClipWatcher(dirpath, dirpath, L"IMPORTTEST");
+    SIZE_T stride = WIDTH*4;
+    SIZE_T ndib = sizeof(BITMAPINFOHEADER) + stride*HEIGHT;
+    BITMAPINFO* bmp = (BITMAPINFO*) malloc(ndib);
+    if (exporter == NULL || importer == NULL || bmp == NULL) return 1;
+    ZeroMemory(bmp, sizeof(BITMAPINFOHEADER));
+    bmp->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmp->bmiHeader.biWidth = WIDTH;
+    bmp->bmiHeader.biHeight = HEIGHT;
+    bmp->bmiHeader.biPlanes = 1;
+    bmp->bmiHeader.biBitCount = 32;
+    bmp->bmiHeader.biCompression = BI_RGB;
+    BYTE* bits = &(((BYTE*)bmp)[sizeof(BITMAPINFOHEADER)]);
+    for (LONG y = 0; y < HEIGHT; y++) {
+        DWORD* row = (DWORD*)&bits[y*stride];
+        for (LONG x = 0; x < WIDTH; x++) {
+            row[x] = (((x/200 + y/150) % 2)? 0xffe0e0e0 : 0xffc0c0c0);
+        }
+    }
+    const LPCWSTR texts[] = { L"A table copied from a spreadsheet.",
+                              L"A newer clip." };
+    WCHAR basepath[MAX_PATH];
+    StringCchPrintf(basepath, _countof(basepath), L"%s\\%s", 
+                    dirpath, exporter->name);
+    WCHAR textpath[MAX_PATH];
+    StringCchPrintf(textpath, _countof(textpath), L"%s%s", 
+                    basepath, FILE_EXT_TEXT);
+    WCHAR bmppath[MAX_PATH];
+    StringCchPrintf(bmppath, _countof(bmppath), L"%s%s", 
+                    basepath, FILE_EXT_BITMAP);
+    WCHAR tmppath[MAX_PATH];
+    StringCchPrintf(tmppath, _countof(tmppath), L"%s%s", 
+                    bmppath, FILE_EXT_TEMP);
+    DeleteFile(bmppath);
+
+    int nfailed = 0;
+    for (int i = 0; i < _countof(texts); i++) {
+        // Copied with the screenshot, the first one.
+        if (OpenClipboard(NULL)) {
+            EmptyClipboard();
+            setClipboardText(texts[i], wcslen(texts[i]));
+            if (i == 0) {
+                setClipboardDIB(bmp);
+            }
+            CloseClipboard();
+        }
+        ULONGLONG t0 = getPreciseTime();
+        ClipSnapshot snap;
+        BOOL success = FALSE;
+        if (OpenClipboard(NULL)) {
+            success = snapshotClipboard(&(exporter->arena), &snap, basepath);
+            CloseClipboard();
+        }
+        ULONGLONG usec0 = (getPreciseTime()-t0)/10;
+        if (success) {
+            exportSnapshot(exporter, NULL, basepath, &snap);
+        }
+        resetArena(&(exporter->arena));
+        success = (success && importClipFile(importer, NULL, textpath) &&
+                   isClipboardData(CF_UNICODETEXT, (const BYTE*)texts[i], 
+                                   sizeof(WCHAR)*(wcslen(texts[i])+1)));
+        resetArena(&(importer->arena));
+        ULONGLONG usec = (getPreciseTime()-t0)/10;
+
+        if (i == 0) {
+            // The screenshot is being written.
+            stepWriteJobs(exporter, FALSE);
+            WIN32_FILE_ATTRIBUTE_DATA attrs;
+            BOOL writing = (exporter->jobs != NULL &&
+                            GetFileAttributesEx(tmppath, GetFileExInfoStandard,
+                                                &attrs) &&
+                            !GetFileAttributesEx(bmppath, GetFileExInfoStandard,
+                                                 &attrs));
+            wprintf(L"mixed: text imported in %I64u usec (snapshot %I64u usec), "
+                    L"screenshot %s\n", 
+                    usec, usec0, writing? L"being written" : L"written");
+            if (!success || !writing) {
+                wprintf(L"mixed: text: FAILED\n");
+                nfailed++;
+            }
+        } else {
+            // The screenshot of the last clip is not written.
+            while (stepWriteJobs(exporter, TRUE));
+            WIN32_FILE_ATTRIBUTE_DATA attrs;
+            BOOL cancelled = (!GetFileAttributesEx(bmppath, 
+                                                   GetFileExInfoStandard, 
+                                                   &attrs) &&
+                              !GetFileAttributesEx(tmppath, 
+                                                   GetFileExInfoStandard, 
+                                                   &attrs));
+            wprintf(L"mixed: newer text imported in %I64u usec "
+                    L"(snapshot %I64u usec), screenshot %s\n",
+                    usec, usec0, cancelled? L"cancelled" : L"written");
+            if (!success || !cancelled) {
+                wprintf(L"mixed: cancel: FAILED\n");
+                nfailed++;
+            }
+        }
+    }
+
+    // Written in full, the screenshot can be imported.
+    if (OpenClipboard(NULL)) {
+        EmptyClipboard();
+        setClipboardText(texts[0], wcslen(texts[0]));
+        setClipboardDIB(bmp);
+        CloseClipboard();
+    }
+    ULONGLONG t0 = getPreciseTime();
+    ClipSnapshot snap;
+    BOOL success = FALSE;
+    if (OpenClipboard(NULL)) {
+        success = snapshotClipboard(&(exporter->arena), &snap, basepath);
+        CloseClipboard();
+    }
+    if (success) {
+        exportSnapshot(exporter, NULL, basepath, &snap);
+    }
+    while (stepWriteJobs(exporter, TRUE));
+    resetArena(&(exporter->arena));
+    success = (success && importClipFile(importer, NULL, bmppath) &&
+               isClipboardData(CF_DIB, (const BYTE*)bmp, ndib));
+    resetArena(&(importer->arena));
+    ULONGLONG usec = (getPreciseTime()-t0)/10;
+    wprintf(L"mixed: screenshot imported in %I64u usec\n", usec);
+    if (!success) {
+        wprintf(L"mixed: screenshot: FAILED\n");
+        nfailed++;
+    }
+    wprintf(L"mixed: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+
+    DeleteFile(textpath);
+    DeleteFile(bmppath);
+    if (OpenClipboard(NULL)) {
+        EmptyClipboard();
+        CloseClipboard();
+    }
+    free(bmp);
+    DestroyClipWatcher(importer);
+    DestroyClipWatcher(exporter);
+    return (nfailed == 0)? 0 : 1;
+}
+
+//  TestPeer
+//  A peer which receives one push on a thread of the test.
+typedef struct _TestPeer {
+    SOCKET listener;
+    ClipWatcher* receiver;
+    PushReceiver rcv;
+    int status;
+    ULONGLONG received;
+} TestPeer;
+
+// receiveTestPush(param)
+static DWORD WINAPI receiveTestPush(LPVOID param)
+{
+    TestPeer* peer = (TestPeer*)param;
+    ZeroMemory(&(peer->rcv), sizeof(peer->rcv));
+    peer->status = -1;
+    peer->rcv.s = accept(peer->listener, NULL, NULL);
+    if (peer->rcv.s != INVALID_SOCKET) {
+        DWORD timeout = PUSH_RECV_TIMEOUT;
+        setsockopt(peer->rcv.s, SOL_SOCKET, SO_RCVTIMEO, 
+                   (const char*)&timeout, sizeof(timeout));
+        // The socket blocks until the whole file is read.
+        peer->status = readPushReceiver(peer->receiver, &(peer->rcv));
+        closesocket(peer->rcv.s);
+    }
+    peer->received = getPreciseTime();
+    return 0;
+}
+
+// testStreamExport(port)
+//   Exports a text of 100MB (as UTF-16 on the clipboard) and an 8K
+//   screenshot as the window does. For each, it prints how long the
+//   clipboard is held open, how long the window thread takes to
+//   export the snapshot, and how long until the file is written,
+//   with the throughput. The text is exported again with a peer on
+//   the loopback, which must receive it as it is written. The files
+//   and the push must hold the UTF-8 text and the DIB. The
+//   screenshot is larger than PUSH_MAX_SIZE and is never pushed.
+static int testStreamExport(WORD port)
+{
+    const int NCHARS = 50*1024*1024;
+    const LONG WIDTH = 7680, HEIGHT = 4320;
+    WSADATA wsadata;
+    WSAStartup(MAKEWORD(2, 2), &wsadata);
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherTest");
+    CreateDirectory(dirpath, NULL);
+    ClipWatcher* exporter = CreateClipWatcher(dirpath, dirpath, L"STREAMTEST");
+    TestPeer peer = {0};
+    peer.receiver = CreateClipWatcher(dirpath, dirpath, L"STREAMPEER");
+    peer.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    SOCKADDR_IN addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    LPWSTR text = (LPWSTR) malloc(sizeof(WCHAR)*(NCHARS+1));
+    SIZE_T ndib = sizeof(BITMAPINFOHEADER) + WIDTH*4*HEIGHT;
+    BITMAPINFO* bmp = (BITMAPINFO*) malloc(ndib);
+    if (exporter == NULL || peer.receiver == NULL || 
+        text == NULL || bmp == NULL ||
+        peer.listener == INVALID_SOCKET ||
+        bind(peer.listener, (SOCKADDR*)&addr, sizeof(addr)) != 0 ||
+        listen(peer.listener, SOMAXCONN) != 0) {
+        wprintf(L"stream: cannot listen on port %u\n", port);
+        return 1;
+    }
+
+    // Rows of a table with Japanese and an emoji in each.
+    int nchars = 0;
+    for (int row = 0; nchars < NCHARS; row++) {
+        WCHAR line[128];
+        StringCchPrintf(line, _countof(line), 
+                        L"%d\t\x6771\x4eac\t\xd83d\xde00\t"
+                        L"The quick brown fox jumps over the lazy dog.\r\n",
+                        row);
+        int n = min((int)wcslen(line), NCHARS-nchars);
+        CopyMemory(&(text[nchars]), line, sizeof(WCHAR)*n);
+        nchars += n;
+    }
+    // Not to end with half a surrogate pair.
+    text[NCHARS-1] = L'.';
+    text[NCHARS] = L'\0';
+    ZeroMemory(bmp, sizeof(BITMAPINFOHEADER));
+    bmp->bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmp->bmiHeader.biWidth = WIDTH;
+    bmp->bmiHeader.biHeight = HEIGHT;
+    bmp->bmiHeader.biPlanes = 1;
+    bmp->bmiHeader.biBitCount = 32;
+    bmp->bmiHeader.biCompression = BI_RGB;
+    DWORD* bits = (DWORD*)&(((BYTE*)bmp)[sizeof(BITMAPINFOHEADER)]);
+    for (LONG i = 0; i < WIDTH*HEIGHT; i++) {
+        bits[i] = 0xff000000 | (i * 2654435761U >> 8);
+    }
+    WCHAR basepath[MAX_PATH];
+    StringCchPrintf(basepath, _countof(basepath), L"%s\\%s", 
+                    dirpath, exporter->name);
+    WCHAR spec[64];
+    StringCchPrintf(spec, _countof(spec), L"127.0.0.1:%u", port);
+
+    int nfailed = 0;
+    const LPCWSTR names[] = { L"text", L"text -p", L"screenshot" };
+    for (int k = 0; k < _countof(names); k++) {
+        BOOL isbmp = (k == 2);
+        BOOL pushed = (k == 1);
+        if (pushed) {
+            addPushPeer(exporter, spec);
+        }
+        if (OpenClipboard(NULL)) {
+            EmptyClipboard();
+            if (isbmp) {
+                setClipboardDIB(bmp);
+            } else {
+                setClipboardText(text, NCHARS);
+            }
+            CloseClipboard();
+        }
+        HANDLE thread = NULL;
+        if (pushed) {
+            thread = CreateThread(NULL, 0, receiveTestPush, &peer, 0, NULL);
+        }
+
+        // Held open as long as exportClipboard() does.
+        ULONGLONG t0 = getPreciseTime();
+        ClipSnapshot snap;
+        BOOL success = FALSE;
+        if (OpenClipboard(NULL)) {
+            success = snapshotClipboard(&(exporter->arena), &snap, basepath);
+            WCHAR buf[256];
+            getClipboardText(buf, _countof(buf));
+            CloseClipboard();
+        }
+        ULONGLONG t1 = getPreciseTime();
+        if (success) {
+            exportSnapshot(exporter, NULL, basepath, &snap);
+        }
+        resetArena(&(exporter->arena));
+        ULONGLONG t2 = getPreciseTime();
+        while (stepWriteJobs(exporter, TRUE));
+        ULONGLONG t3 = getPreciseTime();
+        if (thread != NULL) {
+            WaitForSingleObject(thread, INFINITE);
+            CloseHandle(thread);
+            t3 = max(t3, peer.received);
+        }
+        SIZE_T nbytes = (isbmp)? ndib : sizeof(WCHAR)*NCHARS;
+        ULONGLONG usec = (t3-t0)/10;
+        wprintf(L"stream: %s, %Iu bytes, clipboard held %I64u usec, "
+                L"window thread %I64u usec, written%s in %I64u usec, "
+                L"%I64u MB/s\n",
+                names[k], nbytes, (t1-t0)/10, (t2-t1)/10, 
+                (pushed)? L" and pushed" : L"", usec, 
+                (0 < usec)? (ULONGLONG)nbytes/usec : 0);
+
+        // The file holds what was on the clipboard.
+        WCHAR path[MAX_PATH];
+        StringCchPrintf(path, _countof(path), L"%s%s", basepath, 
+                        (isbmp)? FILE_EXT_BITMAP : FILE_EXT_TEXT);
+        DWORD nread = 0;
+        BYTE* bytes = readBytes(NULL, path, MAXDWORD, &nread);
+        if (isbmp) {
+            success = (success && bytes != NULL &&
+                       nread == sizeof(BITMAPFILEHEADER)+ndib &&
+                       memcmp(&(bytes[sizeof(BITMAPFILEHEADER)]), 
+                              bmp, ndib) == 0);
+        } else {
+            int nutf8 = 0;
+            LPSTR utf8 = getCHARfromWCHAR(&(exporter->arena), 
+                                          text, NCHARS, &nutf8);
+            success = (success && bytes != NULL && utf8 != NULL &&
+                       nread == (DWORD)nutf8 &&
+                       memcmp(bytes, utf8, nutf8) == 0);
+            if (pushed) {
+                success = (success && peer.status == 1 &&
+                           peer.rcv.nbytes == (DWORD)nutf8 &&
+                           memcmp(peer.rcv.bytes, utf8, nutf8) == 0);
+            }
+            resetArena(&(exporter->arena));
+        }
+        if (!success) {
+            wprintf(L"stream: %s: FAILED\n", names[k]);
+            nfailed++;
+        }
+        free(bytes);
+        DeleteFile(path);
+    }
+    wprintf(L"stream: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+
+    if (OpenClipboard(NULL)) {
+        EmptyClipboard();
+        CloseClipboard();
+    }
+    if (peer.rcv.bytes != NULL) {
+        freeBuffer(&(peer.receiver->pool), peer.rcv.bytes);
+    }
+    closesocket(peer.listener);
+    free(bmp);
+    free(text);
+    DestroyClipWatcher(peer.receiver);
+    DestroyClipWatcher(exporter);
+    WSACleanup();
+    return (nfailed == 0)? 0 : 1;
+}
+
+// testTextDelta()
+//   Exports documents of 1MB to 60MB with -d, edits each in a few
+//   places and exports it again, and imports the .txd written with
+//   another watcher. It prints how many bytes the .txd file takes
+//   against the whole text, how long the export takes, how long the
+//   delta takes to apply to the keyframe in memory, and how long the
+//   whole import takes (reading the keyframe from the file). The text
+//   put on the clipboard must be the one edited. The largest text
+//   that can be imported is MAX_TEXT_FILE_SIZE.
+static int testTextDelta()
+{
+    const DWORD sizes[] = { 1024*1024, 10*1024*1024, 60*1024*1024 };
+    const int NINSERT = 100;
+    const LPCWSTR words[] = { L"the ", L"clip ", L"board ", L"is ", 
+                              L"shared ", L"with ", L"a ", L"folder.\r\n" };
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherTest");
+    CreateDirectory(dirpath, NULL);
+    ClipWatcher* exporter = CreateClipWatcher(dirpath, dirpath, L"EXPORTTEST");
+    ClipWatcher* importer = CreateClipWatcher(dirpath, dirpath, L"IMPORTTEST");
+    if (exporter == NULL || importer == NULL) return 1;
+    exporter->delta = TRUE;
+    importer->delta = TRUE;
+    WCHAR basepath[MAX_PATH];
+    StringCchPrintf(basepath, _countof(basepath), L"%s\\%s", 
+                    dirpath, exporter->name);
+    WCHAR keypath[MAX_PATH];
+    StringCchPrintf(keypath, _countof(keypath), L"%s%s", 
+                    basepath, FILE_EXT_TEXT);
+    WCHAR path[MAX_PATH];
+    StringCchPrintf(path, _countof(path), L"%s%s", 
+                    basepath, FILE_EXT_TEXTDELTA);
+
+    int nfailed = 0;
+    for (int k = 0; k < _countof(sizes); k++) {
+        int nchars = 0;
+        LPWSTR text = (LPWSTR) malloc(sizeof(WCHAR)*(sizes[k]+NINSERT+16));
+        if (text == NULL) return 1;
+        // Each document is new. The word is taken from the high bits,
+        // as the low ones repeat every few MB.
+        DWORD seed = k+1;
+        while (nchars < (int)sizes[k]) {
+            seed = seed*1103515245 + 12345;
+            LPCWSTR word = words[(seed >> 24) % _countof(words)];
+            while (*word != L'\0') {
+                text[nchars++] = *(word++);
+            }
+        }
+        nchars = sizes[k];
+        text[nchars] = L'\0';
+        LPCWSTR ext = writeTextFile(exporter, basepath, text, nchars);
+        while (stepWriteJobs(exporter, TRUE));
+        resetArena(&(exporter->arena));
+        if (_wcsicmp(ext, FILE_EXT_TEXT) != 0) {
+            wprintf(L"textdelta: keyframe: FAILED\n");
+            nfailed++;
+            free(text);
+            continue;
+        }
+
+        // A paragraph inserted and a few lines typed over.
+        int at = nchars/3;
+        MoveMemory(&text[at+NINSERT], &text[at], 
+                   sizeof(WCHAR)*(nchars-at+1));
+        for (int i = 0; i < NINSERT; i++) {
+            text[at+i] = L'a' + i % 26;
+        }
+        nchars += NINSERT;
+        for (int j = 1; j <= 3; j++) {
+            for (int i = 0; i < 40; i++) {
+                text[nchars*j/4+i] = L'A' + (i+j) % 26;
+            }
+        }
+        ULONGLONG t0 = getPreciseTime();
+        ext = writeTextFile(exporter, basepath, text, nchars);
+        while (stepWriteJobs(exporter, TRUE));
+        resetArena(&(exporter->arena));
+        ULONGLONG usec = (getPreciseTime()-t0)/10;
+
+        // The keyframe as a watcher which has it cached applies it.
+        DWORD nbase = 0, ndelta = 0, ntext = 0;
+        BYTE* base = readBytes(NULL, keypath, MAX_TEXT_FILE_SIZE, &nbase);
+        BYTE* delta = readBytes(NULL, path, MAX_TEXT_FILE_SIZE, &ndelta);
+        t0 = getPreciseTime();
+        LPSTR applied = NULL;
+        if (base != NULL && delta != NULL) {
+            applied = applyTextDelta(&(importer->arena), base, nbase, 
+                                     delta, ndelta, &ntext);
+        }
+        ULONGLONG usec1 = (getPreciseTime()-t0)/10;
+        resetArena(&(importer->arena));
+
+        t0 = getPreciseTime();
+        BOOL success = importClipFile(importer, NULL, path);
+        resetArena(&(importer->arena));
+        ULONGLONG usec2 = (getPreciseTime()-t0)/10;
+        success = (success && applied != NULL && 
+                   ntext == (DWORD)nchars &&
+                   _wcsicmp(ext, FILE_EXT_TEXTDELTA) == 0 &&
+                   isClipboardData(CF_UNICODETEXT, (const BYTE*)text, 
+                                   sizeof(WCHAR)*(nchars+1)));
+        wprintf(L"textdelta: %u bytes, .txd %u bytes (%.3f%%), "
+                L"export %I64u usec, apply %I64u usec, import %I64u usec: %s\n",
+                nchars, ndelta, ndelta*100.0/nchars, usec, usec1, usec2,
+                success? L"OK" : L"FAILED");
+        if (!success) {
+            nfailed++;
+        }
+        if (base != NULL) {
+            free(base);
+        }
+        if (delta != NULL) {
+            free(delta);
+        }
+        free(text);
+    }
+    wprintf(L"textdelta: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+
+    DeleteFile(keypath);
+    DeleteFile(path);
+    if (OpenClipboard(NULL)) {
+        EmptyClipboard();
+        CloseClipboard();
+    }
+    DestroyClipWatcher(importer);
+    DestroyClipWatcher(exporter);
+    return (nfailed == 0)? 0 : 1;
+}
+
+// makeScanDir(dirpath, nfiles)
+//   Fills a directory with a small clip from each of nfiles hosts
+//   named PEER0000 and so on.
+static BOOL makeScanDir(LPCWSTR dirpath, int nfiles)
+{
+    CreateDirectory(dirpath, NULL);
+    for (int i = 0; i < nfiles; i++) {
+        WCHAR path[MAX_PATH];
+        StringCchPrintf(path, _countof(path), L"%s\\PEER%04d%s", 
+                        dirpath, i, FILE_EXT_TEXT);
+        char text[64];
+        StringCchPrintfA(text, _countof(text), "A clip from peer %d.", i);
+        writeBytes(path, 0, NULL, 0, text, strlen(text));
+        if (GetFileAttributes(path) == INVALID_FILE_ATTRIBUTES) return FALSE;
+    }
+    return TRUE;
+}
+
+// removeScanDir(dirpath, nfiles)
+static void removeScanDir(LPCWSTR dirpath, int nfiles)
+{
+    for (int i = 0; i < nfiles; i++) {
+        WCHAR path[MAX_PATH];
+        StringCchPrintf(path, _countof(path), L"%s\\PEER%04d%s", 
+                        dirpath, i, FILE_EXT_TEXT);
+        DeleteFile(path);
+    }
+    RemoveDirectory(dirpath);
+}
+
+// countFileEntries(files)
+static int countFileEntries(FileEntry* entry)
+{
+    int n = 0;
+    for (; entry != NULL; entry = entry->next) {
+        n++;
+    }
+    return n;
+}
+
+// testHostFilter()
+//   Checks the wildcards of -a and -x, that -x takes precedence over
+//   -a and that -m covers the compressed files and the deltas. Then
+//   it scans a folder of 1000 peers with all but 10 of them excluded
+//   by name with -x or by a wildcard with -a, and prints how many
+//   files are opened and how long the scan and each match take.
+static int testHostFilter()
+{
+    const struct {
+        LPCWSTR pattern;
+        LPCWSTR host;
+        BOOL match;
+    } globs[] = {
+        { L"LAB-*", L"LAB-01", TRUE },
+        { L"LAB-*", L"LAB-", TRUE },
+        { L"LAB-*", L"LAB", FALSE },
+        { L"L?B-*", L"LXB-9", TRUE },
+        { L"L?B-*", L"LB-9", FALSE },
+        { L"*-01", L"LAB-01", TRUE },
+        { L"*-01", L"LAB-011", FALSE },
+        { L"A*B*C", L"AXXBYYC", TRUE },
+        { L"A*B*C", L"AXXBYY", FALSE },
+        { L"*ABC*ABD", L"ABCXABCABD", TRUE },
+        { L"*AB", L"AAB", TRUE },
+        { L"A?", L"A", FALSE },
+        { L"**", L"", TRUE },
+        { L"", L"", TRUE },
+        { L"", L"A", FALSE },
+    };
+    int nfailed = 0;
+    for (int i = 0; i < _countof(globs); i++) {
+        if (matchGlob(globs[i].pattern, globs[i].host) != globs[i].match) {
+            wprintf(L"filter: glob %s %s: FAILED\n", 
+                    globs[i].pattern, globs[i].host);
+            nfailed++;
+        }
+    }
+
+    // -a LAB-* -a office-7 -x lab-13 -x *-TEST -m txt=1M
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherScan");
+    ClipWatcher* watcher = CreateClipWatcher(dirpath, dirpath, L"SCANTEST");
+    if (watcher == NULL) return 1;
+    addHostFilter(&(watcher->allow), L"LAB-*");
+    addHostFilter(&(watcher->allow), L"office-7");
+    addHostFilter(&(watcher->deny), L"lab-13");
+    addHostFilter(&(watcher->deny), L"*-TEST");
+    addSizeLimit(watcher, L"txt=1M");
+    compileHostFilter(&(watcher->allow));
+    compileHostFilter(&(watcher->deny));
+    const struct {
+        LPCWSTR name;
+        ULONGLONG nbytes;
+        BOOL subscribed;
+    } files[] = {
+        { L"LAB-01.txt", 100, TRUE },
+        { L"lab-02.bmp", 100, TRUE },
+        { L"Office-7.txt", 100, TRUE },
+        { L"OFFICE-8.txt", 100, FALSE },
+        { L"LAB-13.txt", 100, FALSE },
+        { L"LAB-TEST.txt", 100, FALSE },
+        { L"LAB-01.txt", 2*1024*1024, FALSE },
+        { L"LAB-01.txz", 2*1024*1024, FALSE },
+        { L"LAB-01.txd", 2*1024*1024, FALSE },
+        { L"LAB-01.bmp", 2*1024*1024, TRUE },
+    };
+    for (int i = 0; i < _countof(files); i++) {
+        if (isSubscribed(watcher, files[i].name, files[i].nbytes) != 
+            files[i].subscribed) {
+            wprintf(L"filter: %s %I64u bytes: FAILED\n", 
+                    files[i].name, files[i].nbytes);
+            nfailed++;
+        }
+    }
+    DestroyClipWatcher(watcher);
+
+    // 1000 peers, all of them taken, all but 10 excluded by name,
+    // or only 10 taken by a wildcard.
+    const int NPEERS = 1000;
+    if (!makeScanDir(dirpath, NPEERS)) {
+        wprintf(L"filter: cannot write %s\n", dirpath);
+        removeScanDir(dirpath, NPEERS);
+        return 1;
+    }
+    LPWSTR names = (LPWSTR) malloc(sizeof(WCHAR)*16*NPEERS);
+    if (names == NULL) return 1;
+    for (int i = 0; i < NPEERS; i++) {
+        StringCchPrintf(&(names[16*i]), 16, L"PEER%04d%s", i, FILE_EXT_TEXT);
+    }
+    const LPCWSTR cases[] = { L"no filter", L"990 names by -x", 
+                              L"a wildcard by -a" };
+    for (int k = 0; k < _countof(cases); k++) {
+        watcher = CreateClipWatcher(dirpath, dirpath, L"SCANTEST");
+        if (watcher == NULL) break;
+        if (k == 1) {
+            for (int i = 10; i < NPEERS; i++) {
+                WCHAR host[16];
+                StringCchPrintf(host, _countof(host), L"PEER%04d", i);
+                addHostFilter(&(watcher->deny), host);
+            }
+        } else if (k == 2) {
+            addHostFilter(&(watcher->allow), L"PEER000?");
+        }
+        compileHostFilter(&(watcher->allow));
+        compileHostFilter(&(watcher->deny));
+        ULONGLONG t0 = getPreciseTime();
+        checkFileChanges(watcher);
+        ULONGLONG usec = (getPreciseTime()-t0)/10;
+        int nopened = countFileEntries(watcher->files);
+        t0 = getPreciseTime();
+        for (int i = 0; i < NPEERS; i++) {
+            isSubscribed(watcher, &(names[16*i]), 100);
+        }
+        ULONGLONG nsec = (getPreciseTime()-t0)*100/NPEERS;
+        wprintf(L"filter: %d peers, %s, opened %d, scan %I64u usec, "
+                L"%I64u nsec per name\n", 
+                NPEERS, cases[k], nopened, usec, nsec);
+        if (nopened != ((k == 0)? NPEERS : 10)) {
+            wprintf(L"filter: scan: FAILED\n");
+            nfailed++;
+        }
+        DestroyClipWatcher(watcher);
+    }
+    removeScanDir(dirpath, NPEERS);
+    free(names);
+
+    wprintf(L"filter: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+    return (nfailed == 0)? 0 : 1;
+}
+
+// testScanWorkers()
+//   Scans folders of 100 and 1000 clips with checkFileChanges(), and
+//   prints how long each scan takes. Then it fingerprints 100 files
+//   with a delay added to each, as a remote folder would, on one
+//   thread and on SCAN_MAX_THREADS. Last, with random delays so that
+//   the workers finish in a different order each time, the merge
+//   must find the same clip and leave the same entries every time.
+//   Ten peers have the newest clock, so the clip is chosen by the
+//   host name.
+static int testScanWorkers()
+{
+    const int sizes[] = { 100, 1000 };
+    const int NITEMS = 100;
+    const DWORD DELAY = 10;
+    const int NRUNS = 5;
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherScan");
+
+    int nfailed = 0;
+    for (int k = 0; k < _countof(sizes); k++) {
+        ClipWatcher* watcher = CreateClipWatcher(dirpath, dirpath, 
+                                                 L"SCANTEST");
+        if (watcher == NULL || !makeScanDir(dirpath, sizes[k])) {
+            wprintf(L"scan: cannot write %s\n", dirpath);
+            removeScanDir(dirpath, sizes[k]);
+            return 1;
+        }
+        ULONGLONG t0 = getPreciseTime();
+        checkFileChanges(watcher);
+        ULONGLONG usec = (getPreciseTime()-t0)/10;
+        int nopened = countFileEntries(watcher->files);
+        wprintf(L"scan: %d files, %d threads, %I64u usec\n", 
+                sizes[k], watcher->scan_threads, usec);
+        if (nopened != sizes[k]) {
+            wprintf(L"scan: %d files: FAILED\n", sizes[k]);
+            nfailed++;
+        }
+        DestroyClipWatcher(watcher);
+        if (k+1 < _countof(sizes)) {
+            removeScanDir(dirpath, sizes[k]);
+        }
+    }
+
+    // The newest clock is taken by every tenth peer.
+    ScanItem* items = (ScanItem*) malloc(sizeof(ScanItem)*NITEMS);
+    DWORD* delays = (DWORD*) malloc(sizeof(DWORD)*NITEMS);
+    BufferPool pool;
+    initBufferPool(&pool, POOL_MAX_RETAINED);
+    if (items == NULL || delays == NULL) return 1;
+    const ULONGLONG CLOCK = 130000000000000000ULL;
+    for (int i = 0; i < NITEMS; i++) {
+        ZeroMemory(&items[i], sizeof(items[i]));
+        StringCchPrintf(items[i].path, _countof(items[i].path), 
+                        L"%s\\PEER%04d%s", dirpath, i, FILE_EXT_TEXT);
+        char text[64];
+        StringCchPrintfA(text, _countof(text), "A clip from peer %d.", i);
+        ULONGLONG clock = CLOCK + ((i % 10 == 3)? NITEMS : i)*10000000ULL;
+        writeBytes(items[i].path, clock, NULL, 0, text, strlen(text));
+        delays[i] = DELAY;
+    }
+    ScanJob job;
+    job.pool = &pool;
+    job.items = items;
+    job.nitems = NITEMS;
+    job.delays = delays;
+    DWORD usecs[2];
+    const int threads[] = { 1, SCAN_MAX_THREADS };
+    for (int j = 0; j < _countof(threads); j++) {
+        job.next = 0;
+        ULONGLONG t0 = getPreciseTime();
+        runWorkers(scanWorker, &job, threads[j]);
+        usecs[j] = (DWORD)((getPreciseTime()-t0)/10);
+    }
+    wprintf(L"scan: %d files, %u msec each, 1 thread %u usec, "
+            L"%d threads %u usec\n", NITEMS, DELAY, 
+            usecs[0], SCAN_MAX_THREADS, usecs[1]);
+
+    WCHAR expected[MAX_PATH];
+    StringCchPrintf(expected, _countof(expected), L"%s\\PEER%04d%s",
+                    dirpath, (NITEMS-1)/10*10+3, FILE_EXT_TEXT);
+    ULONGLONG first = 0;
+    DWORD seed = 1;
+    for (int r = 0; r < NRUNS; r++) {
+        for (int i = 0; i < NITEMS; i++) {
+            seed = seed*1103515245 + 12345;
+            delays[i] = (seed >> 16) % 4;
+            items[i].opened = FALSE;
+        }
+        job.next = 0;
+        runWorkers(scanWorker, &job, SCAN_MAX_THREADS);
+        ClipWatcher* watcher = CreateClipWatcher(dirpath, dirpath, 
+                                                 L"SCANTEST");
+        if (watcher == NULL) return 1;
+        FileEntry* found = mergeScanItems(watcher, items, NITEMS);
+        // The entries in their order.
+        ULONGLONG hash = 0;
+        for (FileEntry* entry = watcher->files; 
+             entry != NULL; entry = entry->next) {
+            ULONGLONG values[3] = { hash, entry->hash, 
+                                    getFileTimeValue(&(entry->mtime)) };
+            hash = getHash64((const BYTE*)values, sizeof(values)) ^
+                getHash64((const BYTE*)entry->path, 
+                          sizeof(WCHAR)*wcslen(entry->path));
+        }
+        if (r == 0) {
+            first = hash;
+        }
+        if (found == NULL || wcscmp(found->path, expected) != 0 ||
+            countFileEntries(watcher->files) != NITEMS || hash != first) {
+            wprintf(L"scan: merge %d: FAILED\n", r);
+            nfailed++;
+        }
+        DestroyClipWatcher(watcher);
+    }
+    wprintf(L"scan: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+
+    removeScanDir(dirpath, sizes[_countof(sizes)-1]);
+    freeBufferPool(&pool);
+    free(delays);
+    free(items);
+    return (nfailed == 0)? 0 : 1;
+}
+
+// testStage()
+//   Stages a file of several chunks in a temporary directory, stages
+//   it again, and then resumes a partial copy in which a chunk was
+//   torn, another was marked done without its data, and the latter
+//   half has its data and digests but is not marked done (as when
+//   the states were not written). Only those chunks must be copied
+//   again, and the staged file must match the source under the same
+//   key. It prints the throughput of the copy and of the resume
+//   (which reads back the chunks it keeps).
+static int testStage()
+{
+    const DWORD NCHUNKS = 16;
+    const ULONGLONG NBYTES = (ULONGLONG)NCHUNKS*FILEDROP_CHUNK_SIZE - 12345;
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherTest");
+    CreateDirectory(dirpath, NULL);
+    WCHAR srcpath[MAX_PATH];
+    StringCchPrintf(srcpath, _countof(srcpath), L"%s\\source.bin", dirpath);
+    BufferPool pool;
+    initBufferPool(&pool, POOL_MAX_RETAINED);
+    BYTE* buf = (BYTE*) malloc(FILEDROP_CHUNK_SIZE);
+    HCRYPTPROV prov;
+    if (buf == NULL ||
+        !CryptAcquireContext(&prov, NULL, NULL, PROV_RSA_AES, 
+                             CRYPT_VERIFYCONTEXT)) return 1;
+
+    int nfailed = 0;
+    HANDLE fp = CreateFile(srcpath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+    DWORD seed = 1;
+    for (DWORD i = 0; i < NCHUNKS; i++) {
+        ULONGLONG offset = (ULONGLONG)i*FILEDROP_CHUNK_SIZE;
+        DWORD n = (DWORD)min(NBYTES-offset, FILEDROP_CHUNK_SIZE);
+        for (DWORD j = 0; j < n; j++) {
+            seed = seed*1103515245 + 12345;
+            buf[j] = (BYTE)(seed >> 16);
+        }
+        if (fp == INVALID_HANDLE_VALUE || !writeChunk(fp, offset, buf, n)) {
+            nfailed++;
+            break;
+        }
+    }
+    if (fp != INVALID_HANDLE_VALUE) {
+        CloseHandle(fp);
+    }
+    WIN32_FILE_ATTRIBUTE_DATA attrs;
+    if (nfailed != 0 ||
+        !GetFileAttributesEx(srcpath, GetFileExInfoStandard, &attrs)) {
+        wprintf(L"stage: cannot write %s\n", srcpath);
+        return 1;
+    }
+
+    StagedFile* staged = NULL;
+    FileDrop drop;
+    ZeroMemory(&drop, sizeof(drop));
+    drop.pool = &pool;
+    drop.nthreads = FILEDROP_MAX_THREADS;
+    drop.host = L"STAGETEST";
+    StringCchPrintf(drop.stagedir, _countof(drop.stagedir), L"%s\\%s", 
+                    dirpath, STAGE_DIR);
+    drop.staged = &staged;
+
+    // A fresh copy.
+    ULONGLONG key1 = 0;
+    ULONGLONG t0 = getPreciseTime();
+    BOOL success = stageFile(&drop, srcpath, L"source.bin", &attrs, &key1);
+    ULONGLONG usec = (getPreciseTime()-t0)/10;
+    WCHAR keypath[MAX_PATH];
+    StringCchPrintf(keypath, _countof(keypath), L"%s\\%016I64x", 
+                    drop.stagedir, key1);
+    WCHAR dstpath[MAX_PATH];
+    StringCchPrintf(dstpath, _countof(dstpath), L"%s\\source.bin", keypath);
+    wprintf(L"stage: copy %I64u bytes, %I64u usec, %I64u MB/s\n", 
+            NBYTES, usec, (0 < usec)? NBYTES/usec : 0);
+    if (!success || drop.ncopied != NCHUNKS || 
+        !isSameFile(srcpath, dstpath, NBYTES)) {
+        wprintf(L"stage: copy: FAILED\n");
+        nfailed++;
+    }
+
+    // Staged again, it is not read.
+    ULONGLONG key2 = 0;
+    drop.ncopied = 0;
+    success = stageFile(&drop, srcpath, L"source.bin", &attrs, &key2);
+    if (!success || drop.ncopied != 0 || key2 != key1) {
+        wprintf(L"stage: staged: FAILED\n");
+        nfailed++;
+    }
+    DeleteFile(dstpath);
+    RemoveDirectory(keypath);
+    while (staged != NULL) {
+        StagedFile* next = staged->next;
+        free(staged);
+        staged = next;
+    }
+
+    // A partial copy as left by an interrupted attempt.
+    WCHAR tmppath[MAX_PATH];
+    StringCchPrintf(tmppath, _countof(tmppath), L"%s\\%016I64x%s", 
+                    drop.stagedir, getStageId(drop.host, srcpath, &attrs), 
+                    FILE_EXT_TEMP);
+    HANDLE src = CreateFile(srcpath, GENERIC_READ, FILE_SHARE_READ, NULL, 
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    fp = CreateFile(tmppath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, 
+                    FILE_ATTRIBUTE_NORMAL, NULL);
+    for (DWORD i = 0; i < NCHUNKS; i++) {
+        ULONGLONG offset = (ULONGLONG)i*FILEDROP_CHUNK_SIZE;
+        DWORD n = (DWORD)min(NBYTES-offset, FILEDROP_CHUNK_SIZE);
+        ChunkState state = {0};
+        state.done = (i < NCHUNKS/2);
+        if (src == INVALID_HANDLE_VALUE || fp == INVALID_HANDLE_VALUE ||
+            !readChunk(src, offset, buf, n) ||
+            !getSHA256(prov, buf, n, state.digest)) {
+            nfailed++;
+            break;
+        }
+        if (i == 1) {
+            // Torn: written in part.
+            ZeroMemory(&buf[n/2], n-n/2);
+        }
+        if ((i != 2 && !writeChunk(fp, offset, buf, n)) ||
+            !writeChunk(fp, NBYTES+sizeof(state)*i, 
+                        (const BYTE*)&state, sizeof(state))) {
+            nfailed++;
+            break;
+        }
+    }
+    if (src != INVALID_HANDLE_VALUE) {
+        CloseHandle(src);
+    }
+    if (fp != INVALID_HANDLE_VALUE) {
+        CloseHandle(fp);
+    }
+    drop.ncopied = 0;
+    t0 = getPreciseTime();
+    success = stageFile(&drop, srcpath, L"source.bin", &attrs, &key2);
+    usec = (getPreciseTime()-t0)/10;
+    DWORD expected = 2 + (NCHUNKS - NCHUNKS/2);
+    wprintf(L"stage: resume %u of %u chunks, %I64u usec, %I64u MB/s\n", 
+            drop.ncopied, NCHUNKS, usec, (0 < usec)? NBYTES/usec : 0);
+    if (nfailed != 0 || !success || drop.ncopied != expected || 
+        key2 != key1 || !isSameFile(srcpath, dstpath, NBYTES)) {
+        wprintf(L"stage: resume: FAILED\n");
+        nfailed++;
+    }
+
+    wprintf(L"stage: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+    DeleteFile(dstpath);
+    RemoveDirectory(keypath);
+    RemoveDirectory(drop.stagedir);
+    DeleteFile(srcpath);
+    while (staged != NULL) {
+        StagedFile* next = staged->next;
+        free(staged);
+        staged = next;
+    }
+    CryptReleaseContext(prov, 0);
+    free(buf);
+    freeBufferPool(&pool);
+    return (nfailed == 0)? 0 : 1;
+}
+
+// testPush(port)
+//   Pushes files of several sizes to this process over the loopback
+//   and checks that they arrive intact. The content is taken from the
+//   arena as an export does. For each size, it prints how long the
+//   window thread spent queueing the push (p50 and max) and how long
+//   it took until the whole file was received. Finally, pushes to an
+//   unreachable peer and to a port where nothing listens show that
+//   queueing does not wait for the connection, and that a refused
+//   connection does not wait for PUSH_TIMEOUT either.
+static int testPush(WORD port)
+{
+    const DWORD sizes[] = { 1024, 64*1024, 1024*1024, 16*1024*1024 };
+    const int NRUNS = 9;
+    WSADATA wsadata;
+    WSAStartup(MAKEWORD(2, 2), &wsadata);
+
+    // Nothing is read or written in this directory.
+    WCHAR dirpath[MAX_PATH];
+    GetTempPath(_countof(dirpath), dirpath);
+    StringCchCat(dirpath, _countof(dirpath), L"ClipWatcherTest");
+    ClipWatcher* sender = CreateClipWatcher(dirpath, dirpath, L"PUSHTEST-A");
+    ClipWatcher* receiver = CreateClipWatcher(dirpath, dirpath, L"PUSHTEST-B");
+    BYTE* bytes = (BYTE*) malloc(sizes[_countof(sizes)-1]);
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    SOCKADDR_IN addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sender == NULL || receiver == NULL || bytes == NULL ||
+        listener == INVALID_SOCKET ||
+        bind(listener, (SOCKADDR*)&addr, sizeof(addr)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        wprintf(L"push: cannot listen on port %u\n", port);
+        return 1;
+    }
+    WCHAR spec[64];
+    StringCchPrintf(spec, _countof(spec), L"127.0.0.1:%u", port);
+    addPushPeer(sender, spec);
+    for (DWORD i = 0; i < sizes[_countof(sizes)-1]; i++) {
+        bytes[i] = (BYTE)((i * 2654435761U) >> 24);
+    }
+
+    int nfailed = 0;
+    for (int k = 0; k < _countof(sizes); k++) {
+        DWORD nbytes = sizes[k];
+        ULONGLONG queued[NRUNS], received[NRUNS];
+        for (int run = 0; run < NRUNS; run++) {
+            bytes[0] = (BYTE)run;
+            BYTE* body = (BYTE*) allocArena(&(sender->arena), nbytes);
+            if (body == NULL) return 1;
+            CopyMemory(body, bytes, nbytes);
+            ULONGLONG t0 = getPreciseTime();
+            queuePushJob(sender, L"PUSHTEST-A.bmp", NULL, 0, body, nbytes, 
+                         FALSE);
+            ULONGLONG t1 = getPreciseTime();
+            // The event ends before the push is sent.
+            resetArena(&(sender->arena));
+
+            // Receive it as the window would, as the data arrives.
+            int status = -1;
+            PushReceiver rcv = {0};
+            rcv.s = accept(listener, NULL, NULL);
+            u_long nonblocking = 1;
+            ioctlsocket(rcv.s, FIONBIO, &nonblocking);
+            while (rcv.s != INVALID_SOCKET) {
+                fd_set rfds;
+                FD_ZERO(&rfds);
+                FD_SET(rcv.s, &rfds);
+                TIMEVAL timeout = { PUSH_RECV_TIMEOUT/1000, 0 };
+                if (select(0, &rfds, NULL, NULL, &timeout) <= 0) break;
+                status = readPushReceiver(receiver, &rcv);
+                if (status != 0) break;
+            }
+            ULONGLONG t2 = getPreciseTime();
+            queued[run] = (t1-t0)/10;
+            received[run] = (t2-t0)/10;
+            if (status != 1 || rcv.nbytes != nbytes ||
+                memcmp(rcv.bytes, bytes, nbytes) != 0) {
+                wprintf(L"push: nbytes=%u, run=%d: FAILED\n", nbytes, run);
+                nfailed++;
+            }
+            if (rcv.s != INVALID_SOCKET) {
+                closesocket(rcv.s);
+            }
+            if (rcv.bytes != NULL) {
+                freeBuffer(&(receiver->pool), rcv.bytes);
+            }
+        }
+        qsort(queued, NRUNS, sizeof(ULONGLONG), compareULONGLONG);
+        qsort(received, NRUNS, sizeof(ULONGLONG), compareULONGLONG);
+        ULONGLONG p50 = received[NRUNS/2];
+        wprintf(L"push: nbytes=%u, queue: p50 %I64u, max %I64u usec, "
+                L"received: p50 %I64u, max %I64u usec, %I64u MB/s\n",
+                nbytes, queued[NRUNS/2], queued[NRUNS-1], 
+                p50, received[NRUNS-1], 
+                (0 < p50)? (ULONGLONG)nbytes/p50 : 0);
+    }
+
+    // An unreachable peer only delays the push thread.
+    ClipWatcher* lost = CreateClipWatcher(dirpath, dirpath, L"PUSHTEST-C");
+    if (lost != NULL) {
+        addPushPeer(lost, L"192.0.2.1");
+        ULONGLONG t0 = getPreciseTime();
+        queuePushJob(lost, L"PUSHTEST-C.txt", NULL, 0, bytes, 1024, FALSE);
+        ULONGLONG t1 = getPreciseTime();
+        stopPushWorker(lost);
+        ULONGLONG t2 = getPreciseTime();
+        wprintf(L"push: unreachable peer, queue: %I64u usec, "
+                L"push thread: %I64u usec\n", (t1-t0)/10, (t2-t0)/10);
+        DestroyClipWatcher(lost);
+    }
+    // Nothing listens on a port bound to this socket.
+    SOCKET closed = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    addr.sin_port = htons(port+1);
+    ClipWatcher* refused = CreateClipWatcher(dirpath, dirpath, L"PUSHTEST-D");
+    if (closed != INVALID_SOCKET && refused != NULL &&
+        bind(closed, (SOCKADDR*)&addr, sizeof(addr)) == 0) {
+        StringCchPrintf(spec, _countof(spec), L"127.0.0.1:%u", port+1);
+        addPushPeer(refused, spec);
+        ULONGLONG t0 = getPreciseTime();
+        queuePushJob(refused, L"PUSHTEST-D.txt", NULL, 0, bytes, 1024, FALSE);
+        stopPushWorker(refused);
+        ULONGLONG usec = (getPreciseTime()-t0)/10;
+        wprintf(L"push: refused peer, push thread: %I64u usec\n", usec);
+        if (PUSH_TIMEOUT*1000/2 <= usec) {
+            wprintf(L"push: refused peer: FAILED\n");
+            nfailed++;
+        }
+    }
+    if (refused != NULL) {
+        DestroyClipWatcher(refused);
+    }
+    if (closed != INVALID_SOCKET) {
+        closesocket(closed);
+    }
+
+    wprintf(L"push: %s\n", (nfailed == 0)? L"OK" : L"FAILED");
+    closesocket(listener);
+    free(bytes);
+    DestroyClipWatcher(sender);
+    DestroyClipWatcher(receiver);
+    WSACleanup();
+    return (nfailed == 0)? 0 : 1;
+}
+
+//  ClipWatcherMain
+// 
+int ClipWatcherMain(
+    HINSTANCE hInstance, 
+    HINSTANCE hPrevInstance, 
+    int nCmdShow,
+    int argc, LPWSTR* argv)
+{
+    // Parse the command line options.
+    LPCWSTR clippath = DEFAULT_CLIPPATH;
+    WORD port = PUSH_DEFAULT_PORT;
+    BOOL compress = FALSE;
+    BOOL delta = FALSE;
+    DWORD interval = EXPORT_MIN_INTERVAL;
+    DWORD rate = 0;
+    BOOL local = FALSE;
+    int threads = SCAN_MAX_THREADS;
+    LPCWSTR trace = NULL;
+    LPCWSTR replay = NULL;
+    BOOL realtime = FALSE;
+    BOOL test = FALSE;
+    BOOL latency = FALSE;
+    LPCWSTR* filters = (LPCWSTR*) malloc(sizeof(LPCWSTR)*argc);
+    int nfilters = 0;
+    int npeers = 0;
+    LPCWSTR* peers = (LPCWSTR*) malloc(sizeof(LPCWSTR)*argc);
+    for (int i = 1; i < argc; i++) {
+        if (wcscmp(argv[i], L"-p") == 0 && i+1 < argc) {
+            if (peers != NULL) {
+                peers[npeers++] = argv[i+1];
+            }
+            i++;
+        } else if (wcscmp(argv[i], L"-l") == 0 && i+1 < argc) {
+            port = (WORD)_wtoi(argv[++i]);
+        } else if (wcscmp(argv[i], L"-z") == 0) {
+            compress = TRUE;
+        } else if (wcscmp(argv[i], L"-D") == 0) {
+            delta = TRUE;
+        } else if (wcscmp(argv[i], L"-s") == 0) {
+            local = TRUE;
+        } else if (wcscmp(argv[i], L"-T") == 0 && i+1 < argc) {
+            trace = argv[++i];
+        } else if (wcscmp(argv[i], L"-R") == 0 && i+1 < argc) {
+            replay = argv[++i];
+        } else if (wcscmp(argv[i], L"-r") == 0) {
+            realtime = TRUE;
+        } else if (wcscmp(argv[i], L"-t") == 0) {
+            test = TRUE;
+        } else if (wcscmp(argv[i], L"-L") == 0) {
+            latency = TRUE;
+        } else if (wcscmp(argv[i], L"-j") == 0 && i+1 < argc) {
+            threads = max(1, _wtoi(argv[++i]));
+        } else if (wcscmp(argv[i], L"-i") == 0 && i+1 < argc) {
+            interval = _wtoi(argv[++i]);
+        } else if (wcscmp(argv[i], L"-b") == 0 && i+1 < argc) {
+            rate = _wtoi(argv[++i])*1024;
+        } else if ((wcscmp(argv[i], L"-a") == 0 ||
+                    wcscmp(argv[i], L"-x") == 0 ||
+                    wcscmp(argv[i], L"-m") == 0) && i+1 < argc) {
+            // Applied once the watcher is created.
+            if (filters != NULL) {
+                filters[nfilters++] = argv[i];
+                filters[nfilters++] = argv[i+1];
+            }
+            i++;
+        } else {
+            clippath = argv[i];
+        }
+    }
+
+    // Replay a trace instead.
+    if (replay != NULL) {
+        free(peers);
+        if (filters != NULL) {
+            free(filters);
+        }
+        return replayTrace(replay, interval, rate, realtime);
+    }
+    // Or test the local ring, the latency estimates and the pushes.
+    if (test) {
+        free(peers);
+        if (filters != NULL) {
+            free(filters);
+        }
+        // The peak memory is measured before the other tests take any.
+        int status = testReadBMP();
+        status |= (testRing() | testLatency() | testScheduler() | 
+                   testConvergence() | testStage() | testTileDelta() |
+                   testLZ() | testExportEvents() | testImportExport() |
+                   testMixedExport() | testTextDelta() | testHostFilter() |
+                   testScanWorkers());
+        status |= testStreamExport(port+2);
+    return testPush(port) | status;
+    }
+
+    // Prevent a duplicate process.
+    HANDLE mutex = CreateMutex(NULL, TRUE, CLIPWATCHER_NAME);
+    if (GetLastError() == ERROR_ALREADY_EXISTS) {
+	CloseHandle(mutex);
+	return 0;
+    }
+    
+    // Obtain the clipboard directory path.
+    WCHAR clipdir[MAX_PATH];
+    if (GetFileAttributes(clippath) == INVALID_FILE_ATTRIBUTES) {
+	// Obtain the home path.
+	WCHAR home[MAX_PATH];
+	SHGetFolderPath(NULL, CSIDL_PROFILE, NULL, SHGFP_TYPE_CURRENT, home);
+	StringCchPrintf(clipdir, _countof(clipdir), L"%s\\%s", 
+			home, clippath);
+        if (GetFileAttributes(clipdir) == INVALID_FILE_ATTRIBUTES) {
+            WCHAR msg[MAX_PATH];
+            StringCchPrintf(msg, _countof(msg), L"%s (%s)", 
+                            ERROR_NOTFOUND, clipdir);
+            MessageBox(NULL, msg, ERROR_TITLE, MB_OK | MB_ICONERROR);
+            return 1;
+        }
+    } else {
+	StringCchCopy(clipdir, _countof(clipdir), clippath);
+    }
+    
+    // Obtain the computer name.
+    WCHAR name[MAX_COMPUTERNAME_LENGTH+1];
+    DWORD namelen = sizeof(name);
+    GetComputerName(name, &namelen);
+
+    // Register the window class.
+    ATOM atom;
+    {
+	WNDCLASS klass;
+	ZeroMemory(&klass, sizeof(klass));
+	klass.lpfnWndProc = clipWatcherWndProc;
+	klass.hInstance = hInstance;
+	klass.hIcon = LoadIcon(hInstance, MAKEINTRESOURCE(IDI_CLIPWATCHER));
+	klass.hbrBackground = (HBRUSH)(COLOR_WINDOW+1);
+        klass.lpszMenuName = MAKEINTRESOURCE(IDM_POPUPMENU);
+	klass.lpszClassName = CLIPWATCHER_WNDCLASS;
+	atom = RegisterClass(&klass);
+    }
+    
+    // Register the clipboard format.
+    CF_ORIGIN = RegisterClipboardFormat(CLIPWATCHER_ORIGIN);
+    // Register the window message.
+    WM_TASKBAR_CREATED = RegisterWindowMessage(TASKBAR_CREATED);
+
+    // Load the resources.
+    HICON_EMPTY = \
+        LoadIcon(hInstance, MAKEINTRESOURCE(IDI_CLIPEMPTY));
+    HICON_FILETYPE[FILETYPE_TEXT] = \
+        LoadIcon(hInstance, MAKEINTRESOURCE(IDI_CLIPTEXT));
+    HICON_FILETYPE[FILETYPE_BITMAP] = \
+        LoadIcon(hInstance, MAKEINTRESOURCE(IDI_CLIPBITMAP));
+    LoadString(hInstance, IDS_DEFAULT_CLIPPATH, 
+               DEFAULT_CLIPPATH, _countof(DEFAULT_CLIPPATH));
+    LoadString(hInstance, IDS_MESSAGE_WATCHING, 
+               MESSAGE_WATCHING, _countof(MESSAGE_WATCHING));
+    LoadString(hInstance, IDS_MESSAGE_UPDATED, 
+               MESSAGE_UPDATED, _countof(MESSAGE_UPDATED));
+    LoadString(hInstance, IDS_MESSAGE_BITMAP, 
+               MESSAGE_BITMAP, _countof(MESSAGE_BITMAP));
+    
+    // Initialize Winsock.
+    WSADATA wsadata;
+    WSAStartup(MAKEWORD(2, 2), &wsadata);
+
+    // Create a ClipWatcher object.
+    ClipWatcher* watcher = CreateClipWatcher(clipdir, clipdir, name);
+    watcher->port = port;
+    watcher->compress = compress;
+    watcher->delta = delta;
+    watcher->scan_threads = threads;
+    initExportScheduler(&(watcher->scheduler), 
+                        interval, max(interval, EXPORT_MAX_DELAY), rate, 
+                        GetTickCount());
+    for (int i = 0; i < npeers; i++) {
+        addPushPeer(watcher, peers[i]);
+    }
+    free(peers);
+    for (int i = 0; i+1 < nfilters; i += 2) {
+        if (wcscmp(filters[i], L"-a") == 0) {
+            addHostFilter(&(watcher->allow), filters[i+1]);
+        } else if (wcscmp(filters[i], L"-x") == 0) {
+            addHostFilter(&(watcher->deny), filters[i+1]);
+        } else {
+            addSizeLimit(watcher, filters[i+1]);
+        }
+    }
+    if (filters != NULL) {
+        free(filters);
+    }
+    compileHostFilter(&(watcher->allow));
+    compileHostFilter(&(watcher->deny));
+    if (local) {
+        watcher->ring = openLocalRing(watcher->srcdir);
+    }
+    if (trace != NULL) {
+        openTrace(watcher, trace);
+    }
+    if (latency) {
+        watcher->latency = TRUE;
+        writeOriginStamp(watcher);
+    }
+    StartClipWatcher(watcher);
+    checkFileChanges(watcher);
+    
+    // Create a SysTray window.
+    HWND hWnd = CreateWindow(
+	(LPCWSTR)atom,
+	CLIPWATCHER_NAME,
+	(WS_OVERLAPPED | WS_SYSMENU),
+	CW_USEDEFAULT, CW_USEDEFAULT,
+	CW_USEDEFAULT, CW_USEDEFAULT,
+	NULL, NULL, hInstance, watcher);
+    UpdateWindow(hWnd);
+    {
+        // Set the default item.
+        HMENU menu = GetMenu(hWnd);
+        if (menu != NULL) {
+            menu = GetSubMenu(menu, 0);
+            if (menu != NULL) {
+                SetMenuDefaultItem(menu, IDM_OPEN, FALSE);
+            }
+        }
+    }
+
+    // Event loop.
+    // The wakeups are counted to see how often an idle instance runs.
+    // Left alone for 3 minutes, it woke up only to quit. With the blink
+    // and check timers always on, it woke up 209 times a minute.
+    WakeupCounter wakeups = {0};
+    wakeups.start = wakeups.dump = GetTickCount();
+    MSG msg;
+    BOOL loop = TRUE;
+    while (loop) {
+        HANDLE handles[3];
+        int n = 0;
+        if (watcher->notifier != INVALID_HANDLE_VALUE) {
+            handles[n++] = watcher->notifier;
+        }
+        if (watcher->ring != NULL) {
+            handles[n++] = watcher->ring->event;
+        }
+        if (watcher->jobs != NULL && watcher->jobs->pending) {
+            handles[n++] = watcher->write_event;
+        }
+	DWORD obj = MsgWaitForMultipleObjects(n, handles,
+                                              FALSE, INFINITE, QS_ALLINPUT);
+        if (obj < WAIT_OBJECT_0) {
+	    // Unexpected failure!
+	    loop = FALSE;
+	    break;
+        }
+        int i = obj - WAIT_OBJECT_0;
+        DWORD now = GetTickCount();
+        if (WAKEUP_DUMP_INTERVAL <= now - wakeups.dump) {
+            dumpWakeups(&wakeups, now);
+        }
+        if (i < n && handles[i] == watcher->notifier) {
+            // We got a notification;
+            wakeups.nnotify++;
+            if (!FindNextChangeNotification(watcher->notifier)) {
+                // The folder is gone; it is retried by the timer.
+                StopClipWatcher(watcher);
+            }
+            PostMessage(hWnd, WM_NOTIFY_FILE, 0, 0);
+        } else if (i < n && handles[i] == watcher->write_event) {
+            // A chunk of a large file is written.
+            wakeups.nwrite++;
+            stepWriteJobs(watcher, FALSE);
+        } else if (i < n) {
+            // We got a clip from the local ring.
+            wakeups.nring++;
+            PostMessage(hWnd, WM_NOTIFY_RING, 0, 0);
+        } else {
+            // We got a Window Message.
+            wakeups.nmessage++;
+            while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE)) {
+                if (msg.message == WM_QUIT) {
+                    loop = FALSE;
+                    break;
+                }
+                if (msg.message == WM_TIMER) {
+                    wakeups.ntimer++;
+                }
+                TranslateMessage(&msg);
+                DispatchMessage(&msg);
+                // Release the buffers used for the message.
+                resetArena(&(watcher->arena));
+            }
+	}
+    }
+
+    // Clean up.
+    dumpWakeups(&wakeups, GetTickCount());
+    StopClipWatcher(watcher);
+    DestroyClipWatcher(watcher);
+    WSACleanup();
+
+    return (int)msg.wParam;
+}
+
+
+// WinMain and wmain
+#ifdef WINDOWS
+int WinMain(HINSTANCE hInstance, 
+	    HINSTANCE hPrevInstance, 
+	    LPSTR lpCmdLine,
+	    int nCmdShow)
+{
+    int argc;
+    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    return ClipWatcherMain(hInstance, hPrevInstance, nCmdShow, argc, argv);
+}
+#else
+int wmain(int argc, wchar_t* argv[])
+{
+    logfp = stderr;
+    return ClipWatcherMain(GetModuleHandle(NULL), NULL, 0, argc, argv);
+}
+#endif